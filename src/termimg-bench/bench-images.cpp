@@ -0,0 +1,93 @@
+#include "bench-images.h"
+
+#include <iostream>
+#include <vector>
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <unistd.h>
+#include <jpeglib.h>
+
+
+BenchImages::BenchImages(size_t varied_count, size_t huge_count, std::mt19937 &random) {
+    char directory[] = "/tmp/termimg-bench-XXXXXX";
+    if (mkdtemp(directory) == nullptr) {
+        perror("mkdtemp");
+        throw 1;
+    }
+    m_directory = directory;
+
+    std::uniform_int_distribution<int> side(160, 4000);
+    for (size_t i = 0; i < varied_count; ++i) {
+        m_varied.push_back(write(side(random), side(random), random));
+    }
+
+    std::uniform_int_distribution<int> huge_width(7680, 9000);
+    for (size_t i = 0; i < huge_count; ++i) {
+        const int width = huge_width(random);
+        m_huge.push_back(write(width, width * 9 / 16, random));
+    }
+}
+
+BenchImages::~BenchImages() {
+    for (const auto &path : m_varied) {
+        unlink(path.c_str());
+    }
+    for (const auto &path : m_huge) {
+        unlink(path.c_str());
+    }
+    rmdir(m_directory.c_str());
+}
+
+// Gradients with noise on top, which compresses about like a photo
+std::string BenchImages::write(int width, int height, std::mt19937 &random) {
+    const auto path = m_directory + "/" + std::to_string(m_varied.size() + m_huge.size()) + ".jpg";
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        perror("fopen");
+        throw 1;
+    }
+
+    jpeg_compress_struct compress{};
+    jpeg_error_mgr error_manager{};
+    compress.err = jpeg_std_error(&error_manager);
+    jpeg_create_compress(&compress);
+    jpeg_stdio_dest(&compress, file);
+
+    compress.image_width = static_cast<JDIMENSION>(width);
+    compress.image_height = static_cast<JDIMENSION>(height);
+    compress.input_components = 3;
+    compress.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&compress);
+    jpeg_set_quality(&compress, 85, TRUE);
+    jpeg_start_compress(&compress, TRUE);
+
+    std::uniform_int_distribution<int> noise(0, 31);
+    std::vector<JSAMPLE> row(static_cast<size_t>(width) * 3);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            const auto offset = static_cast<size_t>(x) * 3;
+            row[offset] = static_cast<JSAMPLE>(x * 223 / width + noise(random));
+            row[offset + 1] = static_cast<JSAMPLE>(y * 223 / height + noise(random));
+            row[offset + 2] = static_cast<JSAMPLE>((x + y) * 111 / (width + height) + noise(random));
+        }
+        JSAMPROW row_pointer = row.data();
+        jpeg_write_scanlines(&compress, &row_pointer, 1);
+    }
+
+    jpeg_finish_compress(&compress);
+    jpeg_destroy_compress(&compress);
+    fclose(file);
+
+    std::cerr << "Wrote " << width << "x" << height << " " << path << std::endl;
+    return path;
+}
+
+const std::vector<std::string>& BenchImages::varied() const {
+    return m_varied;
+}
+
+const std::vector<std::string>& BenchImages::huge() const {
+    return m_huge;
+}
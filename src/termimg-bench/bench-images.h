@@ -0,0 +1,30 @@
+#ifndef TERMIMG_BENCH_IMAGES_H
+#define TERMIMG_BENCH_IMAGES_H
+
+#include <string>
+#include <vector>
+#include <random>
+
+
+// Synthetic JPEGs in a temporary directory, removed again on destruction
+class BenchImages {
+private:
+    std::string m_directory;
+    std::vector<std::string> m_varied;
+    std::vector<std::string> m_huge;
+
+    std::string write(int width, int height, std::mt19937 &random);
+
+public:
+    BenchImages(size_t varied_count, size_t huge_count, std::mt19937 &random);
+    BenchImages(const BenchImages&) = delete;
+    ~BenchImages();
+
+    // Photos of random sizes, from thumbnails to camera resolutions
+    [[nodiscard]] const std::vector<std::string>& varied() const;
+    // Far larger than any terminal, 8K and up
+    [[nodiscard]] const std::vector<std::string>& huge() const;
+};
+
+
+#endif //TERMIMG_BENCH_IMAGES_H
@@ -0,0 +1,386 @@
+// Measures termimg-server end to end: starts it against a private Xvfb with a fake terminal
+// window and pty, replays display workloads through the client library and reports latency
+// percentiles, throughput and the server's peak RSS.
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <optional>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <charconv>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+
+#include <cstdlib>
+#include <cstdint>
+#include <cmath>
+
+#include <unistd.h>
+
+#include "termimg.h"
+#include "fake-terminal.h"
+#include "bench-images.h"
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::chrono::milliseconds reply_timeout(30000);
+
+// The fake terminal, 200x60 cells of 8x16 pixels
+constexpr unsigned short terminal_columns = 200;
+constexpr unsigned short terminal_lines = 60;
+
+struct DisplayCommand {
+    int32_t x;
+    int32_t y;
+    int32_t max_columns;
+    int32_t max_lines;
+    std::string path;
+};
+
+struct Workload {
+    std::string name;
+    std::vector<DisplayCommand> commands;
+    // Sends everything without waiting for replies, like a user holding down a key
+    bool burst;
+};
+
+struct WorkloadResult {
+    std::vector<double> latencies_ms;
+    size_t ok = 0;
+    size_t superseded = 0;
+    size_t failed = 0;
+    double seconds = 0;
+};
+
+struct Options {
+    std::string server_path = TERMIMG_SERVER_PATH;
+    std::string xvfb_path = "Xvfb";
+    std::vector<std::string> workloads = {"random", "scroll", "repeat", "huge"};
+    std::optional<std::string> replay_path;
+    size_t count = 200;
+    unsigned int seed = 1;
+    bool print_stats = false;
+};
+
+void print_usage(const char* argv0) {
+    std::cerr << "USAGE: " << argv0 << " [--server <path>] [--xvfb <path>] [--workload <name>]... [--replay <file>]" << std::endl;
+    std::cerr << "       [--count <requests>] [--seed <seed>] [--stats]" << std::endl;
+    std::cerr << "Workloads: random, scroll, repeat and huge, all of them by default" << std::endl;
+    std::cerr << "A replay file has one 'display <x> <y> <max_columns> <max_lines> <path>' per line" << std::endl;
+    std::cerr << "--stats prints the server's stage histograms at the end" << std::endl;
+}
+
+template<typename T>
+std::optional<T> parse_number(std::string_view str) {
+    T number{};
+    const auto result = std::from_chars(str.data(), str.data() + str.size(), number, 10);
+    if (result.ec != std::errc() || result.ptr != str.data() + str.size()) {
+        return std::nullopt;
+    }
+    return number;
+}
+
+std::optional<Options> parse_options(int argc, char* argv[]) {
+    Options options;
+    bool default_workloads = true;
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view arg(argv[i]);
+        if (arg == "--stats") {
+            options.print_stats = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            return std::nullopt;
+        }
+
+        const std::string_view value(argv[++i]);
+        if (arg == "--server") {
+            options.server_path = value;
+        }
+        else if (arg == "--xvfb") {
+            options.xvfb_path = value;
+        }
+        else if (arg == "--workload") {
+            if (default_workloads) {
+                options.workloads.clear();
+                default_workloads = false;
+            }
+            options.workloads.emplace_back(value);
+        }
+        else if (arg == "--replay") {
+            options.replay_path = value;
+            if (default_workloads) {
+                options.workloads.clear();
+                default_workloads = false;
+            }
+        }
+        else if (arg == "--count") {
+            const auto count = parse_number<size_t>(value);
+            if (!count.has_value() || count.value() == 0) {
+                return std::nullopt;
+            }
+            options.count = count.value();
+        }
+        else if (arg == "--seed") {
+            const auto seed = parse_number<unsigned int>(value);
+            if (!seed.has_value()) {
+                return std::nullopt;
+            }
+            options.seed = seed.value();
+        }
+        else {
+            return std::nullopt;
+        }
+    }
+
+    return options;
+}
+
+std::optional<Workload> read_replay(const std::string &path) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "Could not open " << path << std::endl;
+        return std::nullopt;
+    }
+
+    Workload workload{"replay", {}, false};
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        std::istringstream fields(line);
+        std::string command;
+        DisplayCommand display{};
+        fields >> command >> display.x >> display.y >> display.max_columns >> display.max_lines >> std::ws;
+        std::getline(fields, display.path);
+        if (command != "display" || !fields.eof() || display.path.empty()) {
+            std::cerr << "Invalid replay line: " << line << std::endl;
+            return std::nullopt;
+        }
+        workload.commands.push_back(std::move(display));
+    }
+
+    return workload;
+}
+
+// Images of every size in boxes of every size, anywhere on the terminal
+Workload make_random_workload(const BenchImages &images, size_t count, std::mt19937 &random) {
+    std::uniform_int_distribution<size_t> image(0, images.varied().size() - 1);
+    std::uniform_int_distribution<int32_t> columns(10, 120);
+    std::uniform_int_distribution<int32_t> lines(5, 50);
+
+    Workload workload{"random", {}, false};
+    for (size_t i = 0; i < count; ++i) {
+        const auto max_columns = columns(random);
+        const auto max_lines = lines(random);
+        std::uniform_int_distribution<int32_t> x(0, terminal_columns - max_columns);
+        std::uniform_int_distribution<int32_t> y(0, terminal_lines - max_lines);
+        workload.commands.push_back({x(random), y(random), max_columns, max_lines, images.varied()[image(random)]});
+    }
+    return workload;
+}
+
+// Scrolling through a directory of images in a file manager preview, faster than they decode
+Workload make_scroll_workload(const BenchImages &images, size_t count) {
+    Workload workload{"scroll", {}, true};
+    for (size_t i = 0; i < count; ++i) {
+        workload.commands.push_back({100, 2, 96, 40, images.varied()[i % images.varied().size()]});
+    }
+    return workload;
+}
+
+// Going back and forth between a few images, which the caches should make instant
+Workload make_repeat_workload(const BenchImages &images, size_t count) {
+    const size_t distinct = std::min<size_t>(4, images.varied().size());
+    Workload workload{"repeat", {}, false};
+    for (size_t i = 0; i < count; ++i) {
+        workload.commands.push_back({0, 0, 80, 30, images.varied()[i % distinct]});
+    }
+    return workload;
+}
+
+Workload make_huge_workload(const BenchImages &images, size_t count) {
+    Workload workload{"huge", {}, false};
+    for (size_t i = 0; i < count; ++i) {
+        // Every request a new box, so none of them are served from the caches
+        const auto max_columns = static_cast<int32_t>(120 - i % 40);
+        workload.commands.push_back({0, 0, max_columns, 50, images.huge()[i % images.huge().size()]});
+    }
+    return workload;
+}
+
+void count_reply(WorkloadResult &result, const TermimgReply &reply, Clock::time_point sent_at) {
+    result.latencies_ms.push_back(std::chrono::duration<double, std::milli>(Clock::now() - sent_at).count());
+    switch (reply.status) {
+        case ReplyStatus::Ok: ++result.ok; break;
+        case ReplyStatus::Superseded: ++result.superseded; break;
+        default: ++result.failed; break;
+    }
+}
+
+std::optional<WorkloadResult> run_workload(TermimgClient &client, const Workload &workload) {
+    WorkloadResult result;
+    std::map<uint32_t, Clock::time_point> pending;
+
+    const auto start = Clock::now();
+    for (const auto &command : workload.commands) {
+        const auto request_id = client.display(command.x, command.y, command.max_columns, command.max_lines, command.path);
+        const auto sent_at = Clock::now();
+        if (!client.flush()) {
+            return std::nullopt;
+        }
+
+        if (workload.burst) {
+            pending.emplace(request_id, sent_at);
+            continue;
+        }
+
+        const auto reply = client.wait_for_reply(request_id, reply_timeout);
+        if (!reply.has_value()) {
+            std::cerr << "No reply for request " << request_id << std::endl;
+            return std::nullopt;
+        }
+        count_reply(result, reply.value(), sent_at);
+    }
+
+    while (!pending.empty()) {
+        const auto reply = client.wait_for_reply(reply_timeout);
+        if (!reply.has_value()) {
+            std::cerr << pending.size() << " requests got no reply" << std::endl;
+            return std::nullopt;
+        }
+
+        const auto it = pending.find(reply->request_id);
+        if (it != pending.end()) {
+            count_reply(result, reply.value(), it->second);
+            pending.erase(it);
+        }
+    }
+    result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    // The next workload starts from an empty terminal, the caches stay warm
+    const auto clear_id = client.clear();
+    client.flush();
+    client.wait_for_reply(clear_id, reply_timeout);
+
+    return result;
+}
+
+double percentile(std::vector<double> values, double fraction) {
+    if (values.empty()) {
+        return 0;
+    }
+
+    std::sort(values.begin(), values.end());
+    const auto rank = static_cast<size_t>(std::ceil(fraction * static_cast<double>(values.size())));
+    return values[std::clamp<size_t>(rank, 1, values.size()) - 1];
+}
+
+void print_result(const std::string &name, const WorkloadResult &result) {
+    std::cout << std::left << std::setw(8) << name << std::right << std::fixed << std::setprecision(2)
+              << std::setw(10) << result.latencies_ms.size()
+              << std::setw(8) << result.ok
+              << std::setw(12) << result.superseded
+              << std::setw(8) << result.failed
+              << std::setw(10) << percentile(result.latencies_ms, 0.5)
+              << std::setw(10) << percentile(result.latencies_ms, 0.99)
+              << std::setw(10) << percentile(result.latencies_ms, 1.0)
+              << std::setw(12) << static_cast<double>(result.latencies_ms.size()) / result.seconds
+              << std::endl;
+}
+
+int run(const Options &options) {
+    std::mt19937 random(options.seed);
+
+    std::vector<Workload> workloads;
+    if (options.replay_path.has_value()) {
+        auto replay = read_replay(options.replay_path.value());
+        if (!replay.has_value()) {
+            return EXIT_FAILURE;
+        }
+        workloads.push_back(std::move(replay.value()));
+    }
+
+    const bool needs_huge = std::find(options.workloads.begin(), options.workloads.end(), "huge") != options.workloads.end();
+    const BenchImages images(24, needs_huge ? 2 : 0, random);
+    for (const auto &name : options.workloads) {
+        if (name == "random") {
+            workloads.push_back(make_random_workload(images, options.count, random));
+        }
+        else if (name == "scroll") {
+            workloads.push_back(make_scroll_workload(images, options.count));
+        }
+        else if (name == "repeat") {
+            workloads.push_back(make_repeat_workload(images, options.count));
+        }
+        else if (name == "huge") {
+            // Each of these decodes tens of megapixels
+            workloads.push_back(make_huge_workload(images, std::min<size_t>(options.count, 20)));
+        }
+        else {
+            std::cerr << "Unknown workload " << name << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    const Xvfb xvfb(options.xvfb_path);
+    const FakeTerminal terminal(xvfb.display_name(), terminal_columns, terminal_lines, 8, 16);
+    BenchServer server(options.server_path, xvfb.display_name(), terminal, "/tmp/termimg-bench-" + std::to_string(getpid()));
+
+    TermimgClient client(server.socket_path());
+
+    std::cout << std::left << std::setw(8) << "workload" << std::right
+              << std::setw(10) << "requests" << std::setw(8) << "ok" << std::setw(12) << "superseded"
+              << std::setw(8) << "failed" << std::setw(10) << "p50_ms" << std::setw(10) << "p99_ms"
+              << std::setw(10) << "max_ms" << std::setw(12) << "req_per_s" << std::endl;
+
+    bool ok = true;
+    for (const auto &workload : workloads) {
+        const auto result = run_workload(client, workload);
+        if (!result.has_value()) {
+            ok = false;
+            break;
+        }
+        print_result(workload.name, result.value());
+        ok = ok && result->failed == 0;
+    }
+
+    std::cout << "server peak rss: " << server.peak_rss_bytes() / (1024 * 1024) << " MiB" << std::endl;
+
+    if (options.print_stats) {
+        const auto stats_id = client.stats();
+        client.flush();
+        const auto reply = client.wait_for_reply(stats_id, reply_timeout);
+        if (reply.has_value()) {
+            std::cout << reply->payload << std::endl;
+        }
+    }
+
+    client.quit();
+    client.flush();
+    server.wait_for_exit();
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char* argv[]) {
+    const auto options = parse_options(argc, argv);
+    if (!options.has_value()) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    try {
+        return run(options.value());
+    }
+    catch (int) {
+        return EXIT_FAILURE;
+    }
+}
@@ -0,0 +1,212 @@
+#include "fake-terminal.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <chrono>
+
+#include <cstdio>
+#include <cstdlib>
+#include <csignal>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+
+// Polls for condition every 10ms until timeout
+template<typename Condition>
+static bool wait_until(Condition condition, std::chrono::milliseconds timeout) {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!condition()) {
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return true;
+}
+
+static bool path_exists(const std::string &path) {
+    struct stat s{};
+    return stat(path.c_str(), &s) == 0;
+}
+
+static void stop_child(pid_t pid) {
+    if (pid <= 0) {
+        return;
+    }
+
+    kill(pid, SIGTERM);
+    const bool exited = wait_until([pid]() { return waitpid(pid, nullptr, WNOHANG) != 0; }, std::chrono::milliseconds(2000));
+    if (!exited) {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+    }
+}
+
+Xvfb::Xvfb(const std::string &xvfb_path) {
+    int display_number = 90;
+    for (; display_number < 200; ++display_number) {
+        const auto number = std::to_string(display_number);
+        if (!path_exists("/tmp/.X11-unix/X" + number) && !path_exists("/tmp/.X" + number + "-lock")) {
+            break;
+        }
+    }
+    m_display_name = ":" + std::to_string(display_number);
+
+    m_pid = fork();
+    if (m_pid == -1) {
+        perror("fork");
+        throw 1;
+    }
+    if (m_pid == 0) {
+        execlp(xvfb_path.c_str(), xvfb_path.c_str(), m_display_name.c_str(), "-screen", "0", "1920x1080x24", "-nolisten", "tcp", "-noreset", nullptr);
+        perror("exec Xvfb");
+        _exit(127);
+    }
+
+    const auto socket_path = "/tmp/.X11-unix/X" + std::to_string(display_number);
+    const bool started = wait_until([&]() {
+        return path_exists(socket_path) || waitpid(m_pid, nullptr, WNOHANG) != 0;
+    }, std::chrono::milliseconds(5000));
+    if (!started || !path_exists(socket_path)) {
+        std::cerr << "Xvfb did not start on " << m_display_name << std::endl;
+        stop_child(m_pid);
+        throw 1;
+    }
+}
+
+Xvfb::~Xvfb() {
+    stop_child(m_pid);
+}
+
+const std::string& Xvfb::display_name() const {
+    return m_display_name;
+}
+
+FakeTerminal::FakeTerminal(const std::string &display_name, unsigned short columns, unsigned short lines, unsigned short cell_width, unsigned short cell_height)
+    : m_display(XOpenDisplay(display_name.c_str()), [](Display* display) { if (display) XCloseDisplay(display); }) {
+    if (!m_display) {
+        std::cerr << "Could not open display " << display_name << std::endl;
+        throw 1;
+    }
+
+    const unsigned int width = static_cast<unsigned int>(columns) * cell_width;
+    const unsigned int height = static_cast<unsigned int>(lines) * cell_height;
+    const int screen = DefaultScreen(m_display.get());
+    m_window = XCreateSimpleWindow(m_display.get(), RootWindow(m_display.get(), screen), 0, 0, width, height, 0,
+                                   BlackPixel(m_display.get(), screen), BlackPixel(m_display.get(), screen));
+    XStoreName(m_display.get(), m_window, "termimg-bench");
+    XMapWindow(m_display.get(), m_window);
+    XSync(m_display.get(), False);
+
+    m_fd_master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (m_fd_master == -1 || grantpt(m_fd_master) == -1 || unlockpt(m_fd_master) == -1) {
+        perror("posix_openpt");
+        throw 1;
+    }
+    m_pts_path = ptsname(m_fd_master);
+
+    const winsize size{lines, columns, static_cast<unsigned short>(width), static_cast<unsigned short>(height)};
+    if (ioctl(m_fd_master, TIOCSWINSZ, &size) == -1) {
+        perror("ioctl");
+        throw 1;
+    }
+}
+
+FakeTerminal::~FakeTerminal() {
+    close(m_fd_master);
+    XDestroyWindow(m_display.get(), m_window);
+    XSync(m_display.get(), False);
+}
+
+Window FakeTerminal::window() const {
+    return m_window;
+}
+
+const std::string& FakeTerminal::pts_path() const {
+    return m_pts_path;
+}
+
+BenchServer::BenchServer(const std::string &server_path, const std::string &display_name, const FakeTerminal &terminal, std::string socket_path)
+    : m_socket_path(std::move(socket_path)) {
+    unlink(m_socket_path.c_str());
+
+    m_pid = fork();
+    if (m_pid == -1) {
+        perror("fork");
+        throw 1;
+    }
+    if (m_pid == 0) {
+        // The first tty a session leader opens becomes its controlling terminal
+        setsid();
+        const int fd_pts = open(terminal.pts_path().c_str(), O_RDWR);
+        if (fd_pts == -1) {
+            perror("open pts");
+            _exit(127);
+        }
+
+        setenv("DISPLAY", display_name.c_str(), 1);
+        setenv("WINDOWID", std::to_string(terminal.window()).c_str(), 1);
+        setenv("TERMIMG_SOCKET", m_socket_path.c_str(), 1);
+        setenv("TERMIMG_LOG_LEVEL", "warning", 0);
+        // Runs start cold unless asked otherwise, a disk cache warmed by an earlier run would skew them
+        setenv("TERMIMG_DISK_CACHE_SIZE", "0", 0);
+
+        const auto pid = std::to_string(getpid());
+        execl(server_path.c_str(), server_path.c_str(), pid.c_str(), nullptr);
+        perror("exec termimg-server");
+        _exit(127);
+    }
+
+    const bool started = wait_until([&]() {
+        return path_exists(m_socket_path) || waitpid(m_pid, nullptr, WNOHANG) != 0;
+    }, std::chrono::milliseconds(10000));
+    if (!started || !path_exists(m_socket_path)) {
+        std::cerr << "termimg-server did not start" << std::endl;
+        stop_child(m_pid);
+        m_pid = -1;
+        throw 1;
+    }
+}
+
+BenchServer::~BenchServer() {
+    stop_child(m_pid);
+    unlink(m_socket_path.c_str());
+}
+
+pid_t BenchServer::pid() const {
+    return m_pid;
+}
+
+const std::string& BenchServer::socket_path() const {
+    return m_socket_path;
+}
+
+size_t BenchServer::peak_rss_bytes() const {
+    std::ifstream status("/proc/" + std::to_string(m_pid) + "/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind("VmHWM:", 0) == 0) {
+            std::istringstream fields(line.substr(6));
+            size_t kilobytes = 0;
+            fields >> kilobytes;
+            return kilobytes * 1024;
+        }
+    }
+
+    return 0;
+}
+
+void BenchServer::wait_for_exit() {
+    const bool exited = wait_until([this]() { return waitpid(m_pid, nullptr, WNOHANG) != 0; }, std::chrono::milliseconds(5000));
+    if (!exited) {
+        std::cerr << "termimg-server did not quit, killing it" << std::endl;
+        stop_child(m_pid);
+    }
+    m_pid = -1;
+}
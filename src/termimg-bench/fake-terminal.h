@@ -0,0 +1,63 @@
+#ifndef TERMIMG_FAKE_TERMINAL_H
+#define TERMIMG_FAKE_TERMINAL_H
+
+#include <string>
+#include <memory>
+
+#include <unistd.h>
+#include <X11/Xlib.h>
+
+
+// A private headless X server on the first free display number
+class Xvfb {
+private:
+    pid_t m_pid = -1;
+    std::string m_display_name;
+
+public:
+    explicit Xvfb(const std::string &xvfb_path);
+    Xvfb(const Xvfb&) = delete;
+    ~Xvfb();
+
+    [[nodiscard]] const std::string& display_name() const;
+};
+
+// A window and a pty standing in for a terminal emulator, sized columns x lines cells
+class FakeTerminal {
+private:
+    const std::shared_ptr<Display> m_display;
+    Window m_window;
+    int m_fd_master;
+    std::string m_pts_path;
+
+public:
+    FakeTerminal(const std::string &display_name, unsigned short columns, unsigned short lines, unsigned short cell_width, unsigned short cell_height);
+    FakeTerminal(const FakeTerminal&) = delete;
+    ~FakeTerminal();
+
+    [[nodiscard]] Window window() const;
+    [[nodiscard]] const std::string& pts_path() const;
+};
+
+// Runs termimg-server for the fake terminal in a new session with the pty as its controlling
+// terminal, so discovery finds both the way it would for a shell. Returns once the socket exists.
+class BenchServer {
+private:
+    pid_t m_pid = -1;
+    std::string m_socket_path;
+
+public:
+    BenchServer(const std::string &server_path, const std::string &display_name, const FakeTerminal &terminal, std::string socket_path);
+    BenchServer(const BenchServer&) = delete;
+    ~BenchServer();
+
+    [[nodiscard]] pid_t pid() const;
+    [[nodiscard]] const std::string& socket_path() const;
+    // VmHWM of the server, 0 when it cannot be read
+    [[nodiscard]] size_t peak_rss_bytes() const;
+    // Waits for the server to exit after a quit request, killing it when it takes too long
+    void wait_for_exit();
+};
+
+
+#endif //TERMIMG_FAKE_TERMINAL_H
@@ -1,44 +1,366 @@
 #include <string>
-#include <sstream>
+#include <string_view>
+#include <vector>
+#include <charconv>
+#include <optional>
+#include <chrono>
 #include <iostream>
 
 #include <cstdlib>
-#include <cstdio>
-#include <cstring>
-#include <sys/socket.h>
-#include <sys/un.h>
+#include <cstdint>
+#include <cmath>
+
 #include <unistd.h>
 
-const char socket_name[] = "/tmp/termimg";
+#include "termimg.h"
+
+constexpr std::chrono::milliseconds reply_timeout(5000);
+
+void print_usage(const char* argv0) {
+    std::cerr << "USAGE: " << argv0 << " [--wait] display <x> <y> <max_columns> <max_lines> <path>" << std::endl;
+    std::cerr << "       " << argv0 << " [--wait] place <id> <x> <y> <max_columns> <max_lines> <path>" << std::endl;
+    std::cerr << "       " << argv0 << " [--wait] move <id> <x> <y> <max_columns> <max_lines>" << std::endl;
+    std::cerr << "       " << argv0 << " [--wait] remove <id>" << std::endl;
+    std::cerr << "       " << argv0 << " [--wait] pause <id>" << std::endl;
+    std::cerr << "       " << argv0 << " [--wait] resume <id>" << std::endl;
+    std::cerr << "       " << argv0 << " [--wait] view <id> fit|fill" << std::endl;
+    std::cerr << "       " << argv0 << " [--wait] zoom <id> <factor>" << std::endl;
+    std::cerr << "       " << argv0 << " [--wait] pan <id> <columns> <lines>" << std::endl;
+    std::cerr << "       " << argv0 << " [--wait] grid <first_id> <x> <y> <grid_columns> <cell_columns> <cell_lines> <path>..." << std::endl;
+    std::cerr << "       " << argv0 << " [--wait] prefetch <max_columns> <max_lines> <path>..." << std::endl;
+    std::cerr << "       " << argv0 << " [--wait] clear" << std::endl;
+    std::cerr << "       " << argv0 << " stats" << std::endl;
+    std::cerr << "       " << argv0 << " [--wait] quit" << std::endl;
+    std::cerr << "       " << argv0 << " [--wait] --stdin" << std::endl;
+    std::cerr << "With --stdin every line of standard input is one of the commands above" << std::endl;
+    std::cerr << "Grid and prefetch paths are separated by whitespace, so they cannot contain spaces" << std::endl;
+    std::cerr << "Requests go to the terminal of the parent process, found from it or from WINDOWID" << std::endl;
+    std::cerr << "TERMIMG_SOCKET overrides the server socket path " << TermimgClient::default_socket_path << std::endl;
+}
+
+// The window terminals export to their children, 0 when it is not set
+uint64_t get_env_window_id() {
+    const char* value = std::getenv("WINDOWID");
+    if (value == nullptr) {
+        return 0;
+    }
+
+    uint64_t window_id = 0;
+    const std::string_view str(value);
+    const auto result = std::from_chars(str.data(), str.data() + str.size(), window_id, 10);
+    if (result.ec != std::errc() || result.ptr != str.data() + str.size()) {
+        return 0;
+    }
+
+    return window_id;
+}
+
+std::optional<int32_t> parse_int(std::string_view str) {
+    int32_t number = 0;
+    const auto result = std::from_chars(str.data(), str.data() + str.size(), number, 10);
+    if (result.ec != std::errc() || result.ptr != str.data() + str.size()) {
+        return std::nullopt;
+    }
+
+    return number;
+}
+
+std::optional<uint32_t> parse_id(std::string_view str) {
+    uint32_t number = 0;
+    const auto result = std::from_chars(str.data(), str.data() + str.size(), number, 10);
+    if (result.ec != std::errc() || result.ptr != str.data() + str.size()) {
+        return std::nullopt;
+    }
+
+    return number;
+}
+
+// A factor such as 2.5 as the permille the protocol takes
+std::optional<uint32_t> parse_zoom(std::string_view str) {
+    double factor = 0;
+    const auto result = std::from_chars(str.data(), str.data() + str.size(), factor);
+    if (result.ec != std::errc() || result.ptr != str.data() + str.size() || !(factor >= 0.1 && factor <= 100.0)) {
+        std::cerr << "Zoom factors go from 0.1 to 100" << std::endl;
+        return std::nullopt;
+    }
+
+    return static_cast<uint32_t>(std::lround(factor * 1000.0));
+}
+
+// Parses every argument from first on as an int
+std::optional<std::vector<int32_t>> parse_ints(const std::vector<std::string_view> &args, size_t first, size_t count) {
+    std::vector<int32_t> numbers;
+    for (size_t i = first; i < first + count; ++i) {
+        const auto number = parse_int(args[i]);
+        if (!number.has_value()) {
+            std::cerr << "Not an int" << std::endl;
+            return std::nullopt;
+        }
+        numbers.push_back(number.value());
+    }
+
+    return numbers;
+}
+
+// Splits off at most max_fields whitespace separated fields, the rest of the line
+// is kept whole as the last field so paths may contain spaces
+std::vector<std::string_view> split_fields(std::string_view line, size_t max_fields) {
+    std::vector<std::string_view> fields;
+    while (true) {
+        const auto start = line.find_first_not_of(" \t");
+        if (start == std::string_view::npos) {
+            break;
+        }
+        line.remove_prefix(start);
+
+        if (fields.size() + 1 == max_fields) {
+            fields.push_back(line);
+            break;
+        }
+
+        const auto end = line.find_first_of(" \t");
+        fields.push_back(line.substr(0, end));
+        if (end == std::string_view::npos) {
+            break;
+        }
+        line.remove_prefix(end);
+    }
+
+    return fields;
+}
+
+// Commands ending in a single path keep the rest of the line as the path
+size_t get_max_fields(std::string_view line) {
+    const auto command = split_fields(line, 2);
+    if (command.empty()) {
+        return 1;
+    }
+
+    if (command[0] == "display") return 6;
+    if (command[0] == "place") return 7;
+    return SIZE_MAX;
+}
+
+// Queues the command on the client and returns its request id
+std::optional<uint32_t> queue_command(TermimgClient &client, const std::vector<std::string_view> &args) {
+    if (args.empty()) {
+        return std::nullopt;
+    }
+
+    const auto command = args[0];
+    if (command == "display" && args.size() == 6) {
+        const auto x = parse_int(args[1]);
+        const auto y = parse_int(args[2]);
+        const auto max_columns = parse_int(args[3]);
+        const auto max_lines = parse_int(args[4]);
+        if (!x.has_value() || !y.has_value() || !max_columns.has_value() || !max_lines.has_value()) {
+            std::cerr << "Not an int" << std::endl;
+            return std::nullopt;
+        }
+
+        return client.display(x.value(), y.value(), max_columns.value(), max_lines.value(), args[5]);
+    }
+    else if ((command == "place" && args.size() == 7) || (command == "move" && args.size() == 6)) {
+        const auto placement_id = parse_id(args[1]);
+        const auto numbers = parse_ints(args, 2, 4);
+        if (!placement_id.has_value() || !numbers.has_value()) {
+            return std::nullopt;
+        }
+
+        const auto &n = numbers.value();
+        if (command == "place") {
+            return client.create_placement(placement_id.value(), n[0], n[1], n[2], n[3], args[6]);
+        }
+        return client.move_placement(placement_id.value(), n[0], n[1], n[2], n[3]);
+    }
+    else if ((command == "remove" || command == "pause" || command == "resume") && args.size() == 2) {
+        const auto placement_id = parse_id(args[1]);
+        if (!placement_id.has_value()) {
+            return std::nullopt;
+        }
+
+        if (command == "pause") {
+            return client.pause_animation(placement_id.value());
+        }
+        if (command == "resume") {
+            return client.resume_animation(placement_id.value());
+        }
+        return client.remove_placement(placement_id.value());
+    }
+    else if (command == "view" && args.size() == 3) {
+        const auto placement_id = parse_id(args[1]);
+        if (!placement_id.has_value() || (args[2] != "fit" && args[2] != "fill")) {
+            return std::nullopt;
+        }
+
+        return client.set_view_mode(placement_id.value(), args[2] == "fit" ? ViewportMode::Fit : ViewportMode::Fill);
+    }
+    else if (command == "zoom" && args.size() == 3) {
+        const auto placement_id = parse_id(args[1]);
+        const auto zoom_permille = parse_zoom(args[2]);
+        if (!placement_id.has_value() || !zoom_permille.has_value()) {
+            return std::nullopt;
+        }
+
+        return client.zoom(placement_id.value(), zoom_permille.value());
+    }
+    else if (command == "pan" && args.size() == 4) {
+        const auto placement_id = parse_id(args[1]);
+        const auto numbers = parse_ints(args, 2, 2);
+        if (!placement_id.has_value() || !numbers.has_value()) {
+            return std::nullopt;
+        }
+
+        return client.pan(placement_id.value(), numbers.value()[0], numbers.value()[1]);
+    }
+    else if (command == "grid" && args.size() >= 8) {
+        const auto first_placement_id = parse_id(args[1]);
+        const auto numbers = parse_ints(args, 2, 5);
+        if (!first_placement_id.has_value() || !numbers.has_value()) {
+            return std::nullopt;
+        }
+
+        const auto &n = numbers.value();
+        const std::vector<std::string_view> paths(args.begin() + 7, args.end());
+        return client.display_grid(first_placement_id.value(), n[0], n[1], n[2], n[3], n[4], paths);
+    }
+    else if (command == "prefetch" && args.size() >= 4) {
+        const auto numbers = parse_ints(args, 1, 2);
+        if (!numbers.has_value()) {
+            return std::nullopt;
+        }
+
+        std::vector<PrefetchItem> items;
+        for (size_t i = 3; i < args.size(); ++i) {
+            items.push_back({numbers.value()[0], numbers.value()[1], args[i]});
+        }
+        return client.prefetch(items);
+    }
+    else if (command == "stats" && args.size() == 1) {
+        return client.stats();
+    }
+    else if (command == "clear" && args.size() == 1) {
+        return client.clear();
+    }
+    else if (command == "quit" && args.size() == 1) {
+        return client.quit();
+    }
+
+    return std::nullopt;
+}
+
+bool print_reply(TermimgClient &client, uint32_t request_id, std::chrono::steady_clock::time_point sent_at) {
+    const auto reply = client.wait_for_reply(request_id, reply_timeout);
+    if (!reply.has_value()) {
+        std::cerr << "No reply for request " << request_id << std::endl;
+        return false;
+    }
+
+    const auto round_trip = std::chrono::steady_clock::now() - sent_at;
+    std::cout << "request " << reply->request_id
+              << " status: " << reply_status_to_string(reply->status)
+              << " server_us: " << reply->elapsed_us;
+
+    const auto display_reply = parse_display_reply_payload(reply->payload);
+    const auto grid_reply = parse_display_grid_reply_payload(reply->payload);
+    if (display_reply.has_value()) {
+        std::cout << " first_pixel_us: " << display_reply->first_pixel_us;
+    }
+    else if (grid_reply.has_value()) {
+        std::cout << " first_pixel_us: " << grid_reply->payload.first_pixel_us;
+    }
+    else if (!reply->payload.empty()) {
+        std::cout << " payload: " << reply->payload;
+    }
+
+    std::cout << " round_trip_us: " << std::chrono::duration_cast<std::chrono::microseconds>(round_trip).count()
+              << std::endl;
+
+    // One line for each image of a grid
+    if (grid_reply.has_value()) {
+        for (size_t i = 0; i < grid_reply->items.size(); ++i) {
+            const auto &item = grid_reply->items[i];
+            std::cout << "  image " << i
+                      << " status: " << reply_status_to_string(static_cast<ReplyStatus>(item.status))
+                      << " first_pixel_us: " << item.first_pixel_us
+                      << " done_us: " << item.done_us << std::endl;
+        }
+    }
+
+    return reply->status == ReplyStatus::Ok;
+}
+
+int run_stdin(TermimgClient &client, bool wait_for_reply) {
+    bool ok = true;
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        const auto request_id = queue_command(client, split_fields(line, get_max_fields(line)));
+        if (!request_id.has_value()) {
+            std::cerr << "Invalid command: " << line << std::endl;
+            ok = false;
+            continue;
+        }
+
+        const auto sent_at = std::chrono::steady_clock::now();
+        if (!client.flush()) {
+            return EXIT_FAILURE;
+        }
+
+        if (wait_for_reply) {
+            ok = print_reply(client, request_id.value(), sent_at) && ok;
+        }
+    }
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
 int main(int argc, char* argv[]) {
-    std::stringstream ss;
-    for (int i = 1; i < argc; i++) {
-        if (i != 1)
-            ss << "\n";
-        ss << argv[i];
+    int arg_index = 1;
+    bool wait_for_reply = false;
+    if (arg_index < argc && std::string_view(argv[arg_index]) == "--wait") {
+        wait_for_reply = true;
+        ++arg_index;
+    }
+
+    if (arg_index >= argc) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Stats are useless without the reply
+    if (std::string_view(argv[arg_index]) == "stats") {
+        wait_for_reply = true;
     }
-    std::string message = ss.str();
 
-    std::cout << message << std::endl;
+    try {
+        const char* socket_path = std::getenv("TERMIMG_SOCKET");
+        TermimgClient client(socket_path != nullptr ? socket_path : TermimgClient::default_socket_path, wait_for_reply);
+        // The parent is the shell, so a server serving many terminals finds the terminal once per shell
+        client.set_terminal(getppid(), get_env_window_id());
 
-  int unix_socket = socket(AF_UNIX, SOCK_DGRAM, 0);
-  if (unix_socket < 0) {
-    perror("socket");
-    return EXIT_FAILURE;
-  }
+        if (std::string_view(argv[arg_index]) == "--stdin" && arg_index + 1 == argc) {
+            return run_stdin(client, wait_for_reply);
+        }
 
-  struct sockaddr_un socket_address;
-  socket_address.sun_family = AF_UNIX;
-  strncpy(socket_address.sun_path, socket_name, sizeof(socket_address.sun_path));
+        const std::vector<std::string_view> args(argv + arg_index, argv + argc);
+        const auto request_id = queue_command(client, args);
+        if (!request_id.has_value()) {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
 
-  if (sendto(unix_socket, message.c_str(), message.size(), 0, reinterpret_cast<sockaddr*>(&socket_address), sizeof(socket_address)) < 0) {
-    perror("sendto");
-    close(unix_socket);
-    return EXIT_FAILURE;
-  }
+        const auto sent_at = std::chrono::steady_clock::now();
+        if (!client.flush()) {
+            return EXIT_FAILURE;
+        }
 
-  close(unix_socket);
+        if (wait_for_reply) {
+            return print_reply(client, request_id.value(), sent_at) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    catch (int) {
+        return EXIT_FAILURE;
+    }
 
-  return EXIT_SUCCESS;
+    return EXIT_SUCCESS;
 }
@@ -0,0 +1,244 @@
+#include "termimg.h"
+
+#include <iostream>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+
+
+TermimgClient::TermimgClient(const std::string &socket_path, bool receive_replies) : m_receive_replies(receive_replies) {
+    m_fd_socket = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (m_fd_socket < 0) {
+        perror("socket");
+        throw 1;
+    }
+
+    if (m_receive_replies) {
+        // Binding with only the family set autobinds to an abstract address the server can reply to
+        sockaddr_un client_address{};
+        client_address.sun_family = AF_UNIX;
+        if (bind(m_fd_socket, reinterpret_cast<sockaddr*>(&client_address), sizeof(sa_family_t)) != 0) {
+            perror("bind");
+            close(m_fd_socket);
+            throw 1;
+        }
+    }
+
+    sockaddr_un server_address{};
+    server_address.sun_family = AF_UNIX;
+    strncpy(server_address.sun_path, socket_path.c_str(), sizeof(server_address.sun_path) - 1);
+    if (connect(m_fd_socket, reinterpret_cast<sockaddr*>(&server_address), sizeof(server_address)) != 0) {
+        perror("connect");
+        close(m_fd_socket);
+        throw 1;
+    }
+}
+
+TermimgClient::~TermimgClient() {
+    close(m_fd_socket);
+}
+
+void TermimgClient::set_terminal(int32_t pid, uint64_t window_id) {
+    m_terminal_frame.clear();
+    append_request(m_terminal_frame, MessageType::SetTerminal, 0, make_terminal_payload(pid, window_id));
+}
+
+uint32_t TermimgClient::display(int32_t x, int32_t y, int32_t max_columns, int32_t max_lines, std::string_view path) {
+    return queue(MessageType::DisplayImage, make_display_payload(x, y, max_columns, max_lines, path));
+}
+
+uint32_t TermimgClient::display_pixels(int32_t x, int32_t y, int32_t max_columns, int32_t max_lines,
+                                       int fd, uint32_t width, uint32_t height, uint64_t offset) {
+    const auto fd_index = static_cast<uint32_t>(m_batch_fds.size());
+    m_batch_fds.push_back(fd);
+    return queue(MessageType::DisplayPixels, make_display_pixels_payload(x, y, max_columns, max_lines, width, height, fd_index, offset));
+}
+
+uint32_t TermimgClient::create_placement(uint32_t placement_id, int32_t x, int32_t y, int32_t max_columns, int32_t max_lines, std::string_view path) {
+    return queue(MessageType::CreatePlacement, make_placement_payload(placement_id, x, y, max_columns, max_lines, path));
+}
+
+uint32_t TermimgClient::move_placement(uint32_t placement_id, int32_t x, int32_t y, int32_t max_columns, int32_t max_lines) {
+    return queue(MessageType::MovePlacement, make_placement_payload(placement_id, x, y, max_columns, max_lines));
+}
+
+uint32_t TermimgClient::remove_placement(uint32_t placement_id) {
+    return queue(MessageType::RemovePlacement, make_placement_id_payload(placement_id));
+}
+
+uint32_t TermimgClient::pause_animation(uint32_t placement_id) {
+    return queue(MessageType::PauseAnimation, make_placement_id_payload(placement_id));
+}
+
+uint32_t TermimgClient::resume_animation(uint32_t placement_id) {
+    return queue(MessageType::ResumeAnimation, make_placement_id_payload(placement_id));
+}
+
+uint32_t TermimgClient::set_view_mode(uint32_t placement_id, ViewportMode mode) {
+    return queue(MessageType::SetViewport, make_viewport_payload(placement_id, mode, 0, 0, 0));
+}
+
+uint32_t TermimgClient::zoom(uint32_t placement_id, uint32_t zoom_permille) {
+    return queue(MessageType::SetViewport, make_viewport_payload(placement_id, ViewportMode::Keep, zoom_permille, 0, 0));
+}
+
+uint32_t TermimgClient::pan(uint32_t placement_id, int32_t columns, int32_t lines) {
+    return queue(MessageType::SetViewport, make_viewport_payload(placement_id, ViewportMode::Keep, 0, columns, lines));
+}
+
+uint32_t TermimgClient::display_grid(uint32_t first_placement_id, int32_t x, int32_t y, int32_t grid_columns,
+                                     int32_t cell_columns, int32_t cell_lines, const std::vector<std::string_view> &paths) {
+    return queue(MessageType::DisplayGrid, make_display_grid_payload(first_placement_id, x, y, grid_columns, cell_columns, cell_lines, paths));
+}
+
+uint32_t TermimgClient::prefetch(const std::vector<PrefetchItem> &items) {
+    return queue(MessageType::Prefetch, make_prefetch_payload(items));
+}
+
+uint32_t TermimgClient::stats() {
+    return queue(MessageType::Stats);
+}
+
+uint32_t TermimgClient::clear() {
+    return queue(MessageType::Clear);
+}
+
+uint32_t TermimgClient::quit() {
+    return queue(MessageType::Quit);
+}
+
+int TermimgClient::create_pixel_buffer(uint32_t width, uint32_t height) {
+    const int fd = memfd_create("termimg-pixels", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        perror("memfd_create");
+        return -1;
+    }
+
+    if (ftruncate(fd, static_cast<off_t>(static_cast<uint64_t>(width) * height * 4)) == -1) {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+
+    // The server maps sealed buffers instead of copying them, as they cannot shrink under it
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) == -1) {
+        perror("fcntl");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+bool TermimgClient::has_queued() const {
+    return !m_batch.empty();
+}
+
+bool TermimgClient::flush() {
+    if (m_batch.empty()) {
+        return true;
+    }
+
+    iovec io_vectors[] = {
+        {m_terminal_frame.data(), m_terminal_frame.size()},
+        {m_batch.data(), m_batch.size()},
+    };
+    msghdr message_header{};
+    message_header.msg_iov = io_vectors;
+    message_header.msg_iovlen = 2;
+
+    std::vector<char> control;
+    if (!m_batch_fds.empty()) {
+        const size_t fds_size = sizeof(int) * m_batch_fds.size();
+        control.resize(CMSG_SPACE(fds_size));
+        message_header.msg_control = control.data();
+        message_header.msg_controllen = control.size();
+
+        // Never null with the space reserved above, but the compiler cannot tell
+        cmsghdr* control_message = CMSG_FIRSTHDR(&message_header);
+        if (!control_message) {
+            std::cerr << "No room for the fds of the batch" << std::endl;
+            m_batch.clear();
+            m_batch_fds.clear();
+            return false;
+        }
+        control_message->cmsg_level = SOL_SOCKET;
+        control_message->cmsg_type = SCM_RIGHTS;
+        control_message->cmsg_len = CMSG_LEN(fds_size);
+        std::memcpy(CMSG_DATA(control_message), m_batch_fds.data(), fds_size);
+    }
+
+    const ssize_t bytes_sent = sendmsg(m_fd_socket, &message_header, 0);
+    m_batch.clear();
+    m_batch_fds.clear();
+    if (bytes_sent < 0) {
+        perror("send");
+        return false;
+    }
+
+    return true;
+}
+
+std::optional<TermimgReply> TermimgClient::wait_for_reply(std::chrono::milliseconds timeout) {
+    if (!m_receive_replies) {
+        return std::nullopt;
+    }
+
+    pollfd poll_fd{m_fd_socket, POLLIN, 0};
+    const int ready = poll(&poll_fd, 1, static_cast<int>(timeout.count()));
+    if (ready <= 0) {
+        if (ready < 0) {
+            perror("poll");
+        }
+        return std::nullopt;
+    }
+
+    char buf[sizeof(ReplyHeader) + 65536];
+    const ssize_t bytes_read = recv(m_fd_socket, buf, sizeof(buf), 0);
+    if (bytes_read < 0) {
+        perror("recv");
+        return std::nullopt;
+    }
+
+    const auto reply = parse_reply(std::string_view(buf, static_cast<size_t>(bytes_read)));
+    if (!reply.has_value()) {
+        std::cerr << "Malformed reply" << std::endl;
+        return std::nullopt;
+    }
+
+    return TermimgReply{
+        reply->header.request_id,
+        static_cast<ReplyStatus>(reply->header.status),
+        reply->header.elapsed_us,
+        std::string(reply->payload)
+    };
+}
+
+std::optional<TermimgReply> TermimgClient::wait_for_reply(uint32_t request_id, std::chrono::milliseconds timeout) {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (true) {
+        const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (remaining.count() <= 0) {
+            return std::nullopt;
+        }
+
+        auto reply = wait_for_reply(remaining);
+        if (!reply.has_value() || reply->request_id == request_id) {
+            return reply;
+        }
+    }
+}
+
+uint32_t TermimgClient::queue(MessageType type, std::string_view payload) {
+    const uint32_t request_id = m_next_request_id++;
+    append_request(m_batch, type, request_id, payload);
+    return request_id;
+}
@@ -0,0 +1,91 @@
+#ifndef TERMIMG_TERMIMG_H
+#define TERMIMG_TERMIMG_H
+
+#include <string>
+#include <string_view>
+#include <optional>
+#include <chrono>
+#include <vector>
+
+#include <cstdint>
+
+#include "protocol.h"
+
+
+struct TermimgReply {
+    uint32_t request_id;
+    ReplyStatus status;
+    uint64_t elapsed_us;
+    std::string payload;
+};
+
+// Keeps one socket connected to termimg-server. Requests are queued and sent
+// together as a single datagram by flush().
+class TermimgClient {
+private:
+    int m_fd_socket;
+    const bool m_receive_replies;
+    uint32_t m_next_request_id = 1;
+    std::string m_batch;
+    std::vector<int> m_batch_fds;
+    // Sent ahead of every batch once set_terminal was called
+    std::string m_terminal_frame;
+
+    uint32_t queue(MessageType type, std::string_view payload = {});
+
+public:
+    static constexpr const char* default_socket_path = "/tmp/termimg";
+
+    // Replies can only be received when the socket is bound, which receive_replies does
+    explicit TermimgClient(const std::string &socket_path = default_socket_path, bool receive_replies = true);
+    TermimgClient(const TermimgClient&) = delete;
+    ~TermimgClient();
+
+    // Makes every following request go to the terminal pid runs in, for servers serving many
+    // terminals. window_id is the terminal's window, from WINDOWID, or 0 when unknown.
+    void set_terminal(int32_t pid, uint64_t window_id = 0);
+
+    // Each of these queues a request and returns its request id
+    uint32_t display(int32_t x, int32_t y, int32_t max_columns, int32_t max_lines, std::string_view path);
+    // Shows width * height 32-bit ARGB pixels stored at offset in a memfd or shared memory
+    // object. fd is sent with SCM_RIGHTS on flush(), so it has to stay open until then.
+    uint32_t display_pixels(int32_t x, int32_t y, int32_t max_columns, int32_t max_lines,
+                            int fd, uint32_t width, uint32_t height, uint64_t offset = 0);
+    // Displays path in the placement with this id, creating it if needed
+    uint32_t create_placement(uint32_t placement_id, int32_t x, int32_t y, int32_t max_columns, int32_t max_lines, std::string_view path);
+    // The image is scaled again when the cell box changes
+    uint32_t move_placement(uint32_t placement_id, int32_t x, int32_t y, int32_t max_columns, int32_t max_lines);
+    uint32_t remove_placement(uint32_t placement_id);
+    // Lays out the images row by row in placements first_placement_id and up, with one reply for all of them
+    uint32_t display_grid(uint32_t first_placement_id, int32_t x, int32_t y, int32_t grid_columns,
+                          int32_t cell_columns, int32_t cell_lines, const std::vector<std::string_view> &paths);
+    // Pausing keeps the current frame shown
+    uint32_t pause_animation(uint32_t placement_id);
+    uint32_t resume_animation(uint32_t placement_id);
+    // Viewports of placements showing a path. A new mode starts over at zoom 1 in the middle of the image.
+    uint32_t set_view_mode(uint32_t placement_id, ViewportMode mode);
+    // zoom_permille is relative to the fit or fill size, 1000 being that size
+    uint32_t zoom(uint32_t placement_id, uint32_t zoom_permille);
+    // Moves the visible area by cells, stopping at the edges of the image
+    uint32_t pan(uint32_t placement_id, int32_t columns, int32_t lines);
+    // Decodes and scales the images into the server's caches at low priority, replacing the last prefetch
+    uint32_t prefetch(const std::vector<PrefetchItem> &items);
+    // The reply payload is a JSON object of the server's stage timings and counters
+    uint32_t stats();
+    // Removes every placement
+    uint32_t clear();
+    uint32_t quit();
+
+    // Creates a memfd of exactly width * height ARGB pixels, sealed against resizing, ready to mmap and fill
+    static int create_pixel_buffer(uint32_t width, uint32_t height);
+
+    [[nodiscard]] bool has_queued() const;
+    bool flush();
+
+    std::optional<TermimgReply> wait_for_reply(std::chrono::milliseconds timeout);
+    // Waits for the reply to request_id, replies to other requests are discarded
+    std::optional<TermimgReply> wait_for_reply(uint32_t request_id, std::chrono::milliseconds timeout);
+};
+
+
+#endif //TERMIMG_TERMIMG_H
@@ -0,0 +1,538 @@
+#ifndef TERMIMG_PROTOCOL_H
+#define TERMIMG_PROTOCOL_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <optional>
+
+#include <cstdint>
+#include <cstring>
+
+// Every datagram holds one or more frames, each a fixed layout header followed by
+// payload_size bytes of payload. Both ends live on the same machine, so fields are
+// in native byte order.
+
+constexpr uint32_t protocol_magic = 0x474d4954; // "TIMG"
+constexpr uint16_t protocol_version = 1;
+
+enum class MessageType : uint16_t {
+    DisplayImage = 1,
+    Clear = 2,
+    Quit = 3,
+    DisplayPixels = 4,
+    CreatePlacement = 5,
+    MovePlacement = 6,
+    RemovePlacement = 7,
+    DisplayGrid = 8,
+    PauseAnimation = 9,
+    ResumeAnimation = 10,
+    Prefetch = 11,
+    SetTerminal = 12,
+    Stats = 13,
+    SetViewport = 14,
+    Reply = 0x100,
+};
+
+enum class ReplyStatus : uint16_t {
+    Ok = 0,
+    Superseded = 1,
+    InvalidRequest = 2,
+    UnsupportedVersion = 3,
+    LoadFailed = 4,
+    Failed = 5,
+    NoTerminal = 6,
+};
+
+struct RequestHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t type;
+    uint32_t request_id;
+    uint32_t payload_size;
+};
+static_assert(sizeof(RequestHeader) == 16);
+
+// Followed by the image path, which takes up the rest of the payload
+struct DisplayPayload {
+    int32_t x;
+    int32_t y;
+    int32_t max_columns;
+    int32_t max_lines;
+};
+static_assert(sizeof(DisplayPayload) == 16);
+
+// Raw 32-bit ARGB pixels in a memfd or POSIX shared memory object. The file
+// descriptors of a datagram are passed along with it as SCM_RIGHTS, fd_index
+// selects which of them holds the pixels. Memfds sealed with F_SEAL_SHRINK are mapped,
+// anything else is copied.
+struct DisplayPixelsPayload {
+    DisplayPayload display;
+    uint32_t width;
+    uint32_t height;
+    uint32_t fd_index;
+    uint32_t reserved;
+    uint64_t offset;
+};
+static_assert(sizeof(DisplayPixelsPayload) == 40);
+
+// Placements are independent images identified by ids the client picks. Display
+// image and display pixels use placement 0. Create placement displays the path,
+// which takes up the rest of the payload, in the placement and creates it if
+// needed. Move placement has no path and displays the placement's image again
+// when the cell box changes.
+struct PlacementPayload {
+    uint32_t placement_id;
+    uint32_t reserved;
+    DisplayPayload display;
+};
+static_assert(sizeof(PlacementPayload) == 24);
+
+// Remove placement, pause animation and resume animation only name the placement
+struct PlacementIdPayload {
+    uint32_t placement_id;
+    uint32_t reserved;
+};
+static_assert(sizeof(PlacementIdPayload) == 8);
+
+// Lays out count images starting at x, y in cell boxes of cell_columns x cell_lines,
+// grid_columns to a row. Image i goes in placement first_placement_id + i. Followed
+// by count paths, each terminated by a NUL byte. There is one reply for the grid,
+// which carries a DisplayGridReplyPayload once the images were displayed.
+struct DisplayGridPayload {
+    uint32_t first_placement_id;
+    int32_t x;
+    int32_t y;
+    int32_t grid_columns;
+    int32_t cell_columns;
+    int32_t cell_lines;
+    uint32_t count;
+    uint32_t reserved;
+};
+static_assert(sizeof(DisplayGridPayload) == 32);
+
+// One server can serve many terminals. Set terminal names the terminal the frames after it
+// in the same datagram are for: the terminal window is found from pid and its ancestors,
+// and window_id, the client's WINDOWID, is tried first when it is not 0. Set terminal is
+// not replied to. Without it, frames go to the terminal the server was started for.
+struct TerminalPayload {
+    int32_t pid;
+    uint32_t reserved;
+    uint64_t window_id;
+};
+static_assert(sizeof(TerminalPayload) == 16);
+
+enum class ViewportMode : uint32_t {
+    Keep = 0,
+    // The whole image in the cell box, never scaled up
+    Fit = 1,
+    // Covers the cell box, cropping what sticks out
+    Fill = 2,
+};
+
+// Zooms and pans the image of a placement that shows a path, cropping and scaling
+// the decoded image the server keeps for it, so nothing is decoded again. A new mode
+// starts over at zoom 1 in the middle of the image. zoom_permille is relative to the
+// mode's size, 1000 being the mode itself, and 0 keeps the zoom. Panning moves the
+// visible area by pan_columns x pan_lines cells and stops at the edges of the image.
+// The viewport stays when the placement is moved or shows the same path again.
+struct ViewportPayload {
+    uint32_t placement_id;
+    uint32_t mode;
+    uint32_t zoom_permille;
+    int32_t pan_columns;
+    int32_t pan_lines;
+    uint32_t reserved;
+};
+static_assert(sizeof(ViewportPayload) == 24);
+
+struct ReplyHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t type;
+    uint32_t request_id;
+    uint16_t status;
+    uint16_t reserved;
+    // Time from the server receiving the request until it sent this reply
+    uint64_t elapsed_us;
+    uint32_t payload_size;
+    uint32_t reserved2;
+};
+static_assert(sizeof(ReplyHeader) == 32);
+
+// Prefetch decodes and scales images into the server's caches at low priority, so
+// displaying them later is instant. The payload is count entries, each this header
+// followed by path_size bytes of path. A new prefetch drops what is left of the last.
+struct PrefetchEntry {
+    int32_t max_columns;
+    int32_t max_lines;
+    uint32_t path_size;
+    uint32_t reserved;
+};
+static_assert(sizeof(PrefetchEntry) == 16);
+
+// The Ok reply to stats carries a JSON object as its payload, with a histogram of the
+// time spent in each stage of displaying images and counters such as cache hits.
+
+// Payload of Ok replies to requests that show images. The reply's elapsed_us is the time
+// until the final image was shown, first_pixel_us until anything was, such as a preview.
+struct DisplayReplyPayload {
+    uint64_t first_pixel_us;
+};
+static_assert(sizeof(DisplayReplyPayload) == 8);
+
+// Payload of the reply to a display grid once all its images are done, whatever its status.
+// first_pixel_us is the first any image showed. Followed by count GridItemReply in the order of the paths.
+struct DisplayGridReplyPayload {
+    uint64_t first_pixel_us;
+    uint32_t count;
+    uint32_t reserved;
+};
+static_assert(sizeof(DisplayGridReplyPayload) == 16);
+
+// Times are from the server receiving the grid, first_pixel_us is 0 when the image showed nothing
+struct GridItemReply {
+    uint64_t first_pixel_us;
+    uint64_t done_us;
+    uint32_t status;
+    uint32_t reserved;
+};
+static_assert(sizeof(GridItemReply) == 24);
+
+struct RequestFrame {
+    RequestHeader header;
+    std::string_view payload;
+};
+
+struct DisplayRequest {
+    DisplayPayload payload;
+    std::string_view path;
+};
+
+struct PlacementRequest {
+    PlacementPayload payload;
+    std::string_view path;
+};
+
+struct DisplayGridRequest {
+    DisplayGridPayload payload;
+    std::vector<std::string_view> paths;
+};
+
+struct DisplayGridReply {
+    DisplayGridReplyPayload payload;
+    std::vector<GridItemReply> items;
+};
+
+struct PrefetchItem {
+    int32_t max_columns;
+    int32_t max_lines;
+    std::string_view path;
+};
+
+struct ReplyFrame {
+    ReplyHeader header;
+    std::string_view payload;
+};
+
+template<typename T>
+void append_struct(std::string &buffer, const T &value) {
+    buffer.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template<typename T>
+T read_struct(std::string_view data) {
+    T value;
+    std::memcpy(&value, data.data(), sizeof(value));
+    return value;
+}
+
+inline void append_request(std::string &buffer, MessageType type, uint32_t request_id, std::string_view payload = {}) {
+    const RequestHeader header{
+        protocol_magic,
+        protocol_version,
+        static_cast<uint16_t>(type),
+        request_id,
+        static_cast<uint32_t>(payload.size())
+    };
+    append_struct(buffer, header);
+    buffer.append(payload);
+}
+
+inline std::string make_display_payload(int32_t x, int32_t y, int32_t max_columns, int32_t max_lines, std::string_view path) {
+    std::string payload;
+    append_struct(payload, DisplayPayload{x, y, max_columns, max_lines});
+    payload.append(path);
+    return payload;
+}
+
+// Returns std::nullopt when the datagram is not made up of whole frames
+inline std::optional<std::vector<RequestFrame>> parse_request_frames(std::string_view datagram) {
+    std::vector<RequestFrame> frames;
+    while (!datagram.empty()) {
+        if (datagram.size() < sizeof(RequestHeader)) {
+            return std::nullopt;
+        }
+
+        const auto header = read_struct<RequestHeader>(datagram);
+        if (header.magic != protocol_magic || datagram.size() - sizeof(RequestHeader) < header.payload_size) {
+            return std::nullopt;
+        }
+
+        frames.push_back({header, datagram.substr(sizeof(RequestHeader), header.payload_size)});
+        datagram.remove_prefix(sizeof(RequestHeader) + header.payload_size);
+    }
+
+    return frames;
+}
+
+inline std::optional<DisplayRequest> parse_display_payload(std::string_view payload) {
+    if (payload.size() <= sizeof(DisplayPayload)) {
+        return std::nullopt;
+    }
+
+    return DisplayRequest{read_struct<DisplayPayload>(payload), payload.substr(sizeof(DisplayPayload))};
+}
+
+inline std::string make_display_pixels_payload(int32_t x, int32_t y, int32_t max_columns, int32_t max_lines,
+                                               uint32_t width, uint32_t height, uint32_t fd_index, uint64_t offset) {
+    std::string payload;
+    append_struct(payload, DisplayPixelsPayload{{x, y, max_columns, max_lines}, width, height, fd_index, 0, offset});
+    return payload;
+}
+
+inline std::optional<DisplayPixelsPayload> parse_display_pixels_payload(std::string_view payload) {
+    if (payload.size() != sizeof(DisplayPixelsPayload)) {
+        return std::nullopt;
+    }
+
+    return read_struct<DisplayPixelsPayload>(payload);
+}
+
+inline std::string make_placement_payload(uint32_t placement_id, int32_t x, int32_t y, int32_t max_columns, int32_t max_lines,
+                                          std::string_view path = {}) {
+    std::string payload;
+    append_struct(payload, PlacementPayload{placement_id, 0, {x, y, max_columns, max_lines}});
+    payload.append(path);
+    return payload;
+}
+
+// Create placement needs a path, move placement must not have one
+inline std::optional<PlacementRequest> parse_placement_payload(std::string_view payload, bool with_path) {
+    if (payload.size() < sizeof(PlacementPayload) || (payload.size() > sizeof(PlacementPayload)) != with_path) {
+        return std::nullopt;
+    }
+
+    return PlacementRequest{read_struct<PlacementPayload>(payload), payload.substr(sizeof(PlacementPayload))};
+}
+
+inline std::string make_placement_id_payload(uint32_t placement_id) {
+    std::string payload;
+    append_struct(payload, PlacementIdPayload{placement_id, 0});
+    return payload;
+}
+
+inline std::optional<PlacementIdPayload> parse_placement_id_payload(std::string_view payload) {
+    if (payload.size() != sizeof(PlacementIdPayload)) {
+        return std::nullopt;
+    }
+
+    return read_struct<PlacementIdPayload>(payload);
+}
+
+inline std::string make_viewport_payload(uint32_t placement_id, ViewportMode mode, uint32_t zoom_permille,
+                                         int32_t pan_columns, int32_t pan_lines) {
+    std::string payload;
+    append_struct(payload, ViewportPayload{placement_id, static_cast<uint32_t>(mode), zoom_permille, pan_columns, pan_lines, 0});
+    return payload;
+}
+
+inline std::optional<ViewportPayload> parse_viewport_payload(std::string_view payload) {
+    if (payload.size() != sizeof(ViewportPayload)) {
+        return std::nullopt;
+    }
+
+    const auto viewport = read_struct<ViewportPayload>(payload);
+    if (viewport.mode > static_cast<uint32_t>(ViewportMode::Fill)) {
+        return std::nullopt;
+    }
+
+    return viewport;
+}
+
+inline std::string make_display_grid_payload(uint32_t first_placement_id, int32_t x, int32_t y, int32_t grid_columns,
+                                             int32_t cell_columns, int32_t cell_lines, const std::vector<std::string_view> &paths) {
+    std::string payload;
+    append_struct(payload, DisplayGridPayload{
+        first_placement_id, x, y, grid_columns, cell_columns, cell_lines, static_cast<uint32_t>(paths.size()), 0
+    });
+    for (const auto path : paths) {
+        payload.append(path);
+        payload.push_back('\0');
+    }
+    return payload;
+}
+
+inline std::optional<DisplayGridRequest> parse_display_grid_payload(std::string_view payload) {
+    if (payload.size() < sizeof(DisplayGridPayload)) {
+        return std::nullopt;
+    }
+
+    DisplayGridRequest request{read_struct<DisplayGridPayload>(payload), {}};
+    if (request.payload.grid_columns <= 0 || request.payload.count == 0) {
+        return std::nullopt;
+    }
+
+    payload.remove_prefix(sizeof(DisplayGridPayload));
+    while (!payload.empty()) {
+        const auto end = payload.find('\0');
+        if (end == std::string_view::npos || end == 0) {
+            return std::nullopt;
+        }
+        request.paths.push_back(payload.substr(0, end));
+        payload.remove_prefix(end + 1);
+    }
+
+    if (request.paths.size() != request.payload.count) {
+        return std::nullopt;
+    }
+
+    return request;
+}
+
+inline std::string make_prefetch_payload(const std::vector<PrefetchItem> &items) {
+    std::string payload;
+    for (const auto &item : items) {
+        append_struct(payload, PrefetchEntry{item.max_columns, item.max_lines, static_cast<uint32_t>(item.path.size()), 0});
+        payload.append(item.path);
+    }
+    return payload;
+}
+
+inline std::optional<std::vector<PrefetchItem>> parse_prefetch_payload(std::string_view payload) {
+    std::vector<PrefetchItem> items;
+    while (!payload.empty()) {
+        if (payload.size() < sizeof(PrefetchEntry)) {
+            return std::nullopt;
+        }
+
+        const auto entry = read_struct<PrefetchEntry>(payload);
+        payload.remove_prefix(sizeof(PrefetchEntry));
+        if (entry.path_size == 0 || payload.size() < entry.path_size) {
+            return std::nullopt;
+        }
+
+        items.push_back({entry.max_columns, entry.max_lines, payload.substr(0, entry.path_size)});
+        payload.remove_prefix(entry.path_size);
+    }
+
+    if (items.empty()) {
+        return std::nullopt;
+    }
+
+    return items;
+}
+
+inline std::string make_reply(uint32_t request_id, ReplyStatus status, uint64_t elapsed_us, std::string_view payload = {}) {
+    const ReplyHeader header{
+        protocol_magic,
+        protocol_version,
+        static_cast<uint16_t>(MessageType::Reply),
+        request_id,
+        static_cast<uint16_t>(status),
+        0,
+        elapsed_us,
+        static_cast<uint32_t>(payload.size()),
+        0
+    };
+
+    std::string reply;
+    append_struct(reply, header);
+    reply.append(payload);
+    return reply;
+}
+
+inline std::optional<ReplyFrame> parse_reply(std::string_view datagram) {
+    if (datagram.size() < sizeof(ReplyHeader)) {
+        return std::nullopt;
+    }
+
+    const auto header = read_struct<ReplyHeader>(datagram);
+    if (header.magic != protocol_magic
+        || header.type != static_cast<uint16_t>(MessageType::Reply)
+        || datagram.size() - sizeof(ReplyHeader) < header.payload_size) {
+        return std::nullopt;
+    }
+
+    return ReplyFrame{header, datagram.substr(sizeof(ReplyHeader), header.payload_size)};
+}
+
+inline std::string make_display_reply_payload(uint64_t first_pixel_us) {
+    std::string payload;
+    append_struct(payload, DisplayReplyPayload{first_pixel_us});
+    return payload;
+}
+
+inline std::optional<DisplayReplyPayload> parse_display_reply_payload(std::string_view payload) {
+    if (payload.size() != sizeof(DisplayReplyPayload)) {
+        return std::nullopt;
+    }
+
+    return read_struct<DisplayReplyPayload>(payload);
+}
+
+inline std::string make_display_grid_reply_payload(uint64_t first_pixel_us, const std::vector<GridItemReply> &items) {
+    std::string payload;
+    append_struct(payload, DisplayGridReplyPayload{first_pixel_us, static_cast<uint32_t>(items.size()), 0});
+    for (const auto &item : items) {
+        append_struct(payload, item);
+    }
+    return payload;
+}
+
+inline std::optional<DisplayGridReply> parse_display_grid_reply_payload(std::string_view payload) {
+    if (payload.size() < sizeof(DisplayGridReplyPayload)) {
+        return std::nullopt;
+    }
+
+    DisplayGridReply reply{read_struct<DisplayGridReplyPayload>(payload), {}};
+    payload.remove_prefix(sizeof(DisplayGridReplyPayload));
+    if (payload.size() != static_cast<size_t>(reply.payload.count) * sizeof(GridItemReply)) {
+        return std::nullopt;
+    }
+
+    for (uint32_t i = 0; i < reply.payload.count; ++i) {
+        reply.items.push_back(read_struct<GridItemReply>(payload.substr(i * sizeof(GridItemReply))));
+    }
+    return reply;
+}
+
+inline std::string make_terminal_payload(int32_t pid, uint64_t window_id) {
+    std::string payload;
+    append_struct(payload, TerminalPayload{pid, 0, window_id});
+    return payload;
+}
+
+inline std::optional<TerminalPayload> parse_terminal_payload(std::string_view payload) {
+    if (payload.size() != sizeof(TerminalPayload)) {
+        return std::nullopt;
+    }
+
+    return read_struct<TerminalPayload>(payload);
+}
+
+inline const char* reply_status_to_string(ReplyStatus status) {
+    switch (status) {
+        case ReplyStatus::Ok: return "ok";
+        case ReplyStatus::Superseded: return "superseded";
+        case ReplyStatus::InvalidRequest: return "invalid request";
+        case ReplyStatus::UnsupportedVersion: return "unsupported version";
+        case ReplyStatus::LoadFailed: return "load failed";
+        case ReplyStatus::Failed: return "failed";
+        case ReplyStatus::NoTerminal: return "no terminal";
+        default: return "unknown status";
+    }
+}
+
+
+#endif //TERMIMG_PROTOCOL_H
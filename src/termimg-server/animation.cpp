@@ -0,0 +1,541 @@
+#include "animation.h"
+
+#include <algorithm>
+#include <optional>
+#include <utility>
+
+#include <cstdio>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "gif-loader.h"
+#include "log.h"
+
+
+// Browsers treat these delays as unset, many GIFs rely on that
+constexpr std::chrono::milliseconds min_frame_delay(20);
+constexpr std::chrono::milliseconds default_frame_delay(100);
+
+static uint32_t read_big_endian(const unsigned char* bytes) {
+    return static_cast<uint32_t>(bytes[0]) << 24 | static_cast<uint32_t>(bytes[1]) << 16
+         | static_cast<uint32_t>(bytes[2]) << 8 | static_cast<uint32_t>(bytes[3]);
+}
+
+// Walks the chunks before the image data looking for acTL
+static bool png_has_animation_control(FILE* file) {
+    unsigned char chunk_header[8];
+    while (fread(chunk_header, 1, sizeof(chunk_header), file) == sizeof(chunk_header)) {
+        if (std::memcmp(chunk_header + 4, "acTL", 4) == 0) {
+            return true;
+        }
+        if (std::memcmp(chunk_header + 4, "IDAT", 4) == 0) {
+            return false;
+        }
+
+        // Skip the data and the CRC
+        if (fseek(file, static_cast<long>(read_big_endian(chunk_header)) + 4, SEEK_CUR) != 0) {
+            return false;
+        }
+    }
+
+    return false;
+}
+
+static bool is_gif(const std::string &path) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+
+    unsigned char magic[4] = {};
+    const bool gif = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && std::memcmp(magic, "GIF8", 4) == 0;
+    fclose(file);
+    return gif;
+}
+
+bool may_be_animated(const std::string &path) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+
+    unsigned char magic[8] = {};
+    const size_t bytes_read = fread(magic, 1, sizeof(magic), file);
+
+    bool animated = false;
+    if (bytes_read >= 4 && std::memcmp(magic, "GIF8", 4) == 0) {
+        animated = true;
+    }
+    else if (bytes_read == 8 && std::memcmp(magic, "\x89PNG\r\n\x1a\n", 8) == 0) {
+        animated = png_has_animation_control(file);
+    }
+
+    fclose(file);
+    return animated;
+}
+
+struct Canvas {
+    std::vector<uint32_t> pixels;
+    int width;
+    int height;
+};
+
+struct FramePixels {
+    const DATA32* pixels;
+    int width;
+    int height;
+};
+
+enum class FrameDisposal {
+    Keep,
+    Clear,
+    Previous,
+};
+
+// A frame as a decoder hands it out, its pixels are only valid until the next one is decoded
+struct DecodedFrame {
+    FramePixels pixels;
+    int x;
+    int y;
+    bool blend;
+    // What happens to the canvas after the frame was shown
+    FrameDisposal disposal;
+    std::chrono::milliseconds delay;
+};
+
+// Fills in the next frame, false once there are no more
+using NextFrameFunction = std::function<bool(DecodedFrame&)>;
+
+static std::chrono::milliseconds get_frame_delay(std::chrono::milliseconds delay) {
+    return delay < min_frame_delay ? default_frame_delay : delay;
+}
+
+// Non-premultiplied ARGB source over destination
+static uint32_t blend_pixel(uint32_t source, uint32_t destination) {
+    const uint32_t source_alpha = source >> 24;
+    if (source_alpha == 255) {
+        return source;
+    }
+    if (source_alpha == 0) {
+        return destination;
+    }
+
+    const uint32_t destination_alpha = (destination >> 24) * (255 - source_alpha) / 255;
+    const uint32_t alpha = source_alpha + destination_alpha;
+    uint32_t result = alpha << 24;
+    for (const int shift : {16, 8, 0}) {
+        const uint32_t source_channel = (source >> shift) & 0xff;
+        const uint32_t destination_channel = (destination >> shift) & 0xff;
+        const uint32_t channel = (source_channel * source_alpha + destination_channel * destination_alpha) / alpha;
+        result |= channel << shift;
+    }
+
+    return result;
+}
+
+static void draw_frame(Canvas &canvas, const FramePixels &frame, int frame_x, int frame_y, bool blend) {
+    const int x_start = std::max(0, frame_x);
+    const int y_start = std::max(0, frame_y);
+    const int x_end = std::min(canvas.width, frame_x + frame.width);
+    const int y_end = std::min(canvas.height, frame_y + frame.height);
+
+    for (int y = y_start; y < y_end; ++y) {
+        const DATA32* source = frame.pixels + static_cast<size_t>(y - frame_y) * static_cast<size_t>(frame.width);
+        uint32_t* destination = canvas.pixels.data() + static_cast<size_t>(y) * static_cast<size_t>(canvas.width);
+        for (int x = x_start; x < x_end; ++x) {
+            const auto source_pixel = static_cast<uint32_t>(source[x - frame_x]);
+            destination[x] = blend ? blend_pixel(source_pixel, destination[x]) : source_pixel;
+        }
+    }
+}
+
+static void clear_rectangle(Canvas &canvas, int rect_x, int rect_y, int rect_width, int rect_height) {
+    const int x_start = std::max(0, rect_x);
+    const int y_start = std::max(0, rect_y);
+    const int x_end = std::min(canvas.width, rect_x + rect_width);
+    const int y_end = std::min(canvas.height, rect_y + rect_height);
+
+    for (int y = y_start; y < y_end; ++y) {
+        uint32_t* row = canvas.pixels.data() + static_cast<size_t>(y) * static_cast<size_t>(canvas.width);
+        std::fill(row + x_start, row + x_end, 0u);
+    }
+}
+
+static size_t frames_size_bytes(const std::vector<AnimationFrame> &frames) {
+    size_t bytes = 0;
+    for (const auto &frame : frames) {
+        bytes += frame.image->size_bytes();
+    }
+    return bytes;
+}
+
+// Keeps every other frame, the delays of dropped frames go to the frame before them
+static void drop_every_other_frame(std::vector<AnimationFrame> &frames) {
+    std::vector<AnimationFrame> kept;
+    for (size_t i = 0; i < frames.size(); ++i) {
+        if (i % 2 == 0) {
+            kept.push_back(std::move(frames[i]));
+        }
+        else {
+            kept.back().delay += frames[i].delay;
+        }
+    }
+    frames = std::move(kept);
+}
+
+// Composites the frames from next_frame onto a canvas and keeps the scaled canvas after each of them.
+// A frame that fails to decode ends the animation there, nullptr when not even the first one did.
+static std::shared_ptr<AnimatedImage> composite_frames(int canvas_width, int canvas_height, const NextFrameFunction &next_frame,
+                                                       int max_width, int max_height, size_t budget_bytes, const std::function<bool()> &superseded) {
+    auto animation = std::make_shared<AnimatedImage>();
+    animation->stride = 1;
+
+    Canvas canvas{{}, canvas_width, canvas_height};
+    canvas.pixels.resize(static_cast<size_t>(canvas.width) * static_cast<size_t>(canvas.height), 0u);
+
+    std::vector<uint32_t> saved_canvas;
+    DecodedFrame frame{};
+    std::optional<DecodedFrame> previous_frame;
+    for (size_t frame_index = 0; ; ++frame_index) {
+        if (superseded()) {
+            return nullptr;
+        }
+        if (!next_frame(frame)) {
+            break;
+        }
+
+        // Disposal of the previous frame happens before this one is drawn
+        if (previous_frame.has_value()) {
+            if (previous_frame->disposal == FrameDisposal::Previous && !saved_canvas.empty()) {
+                canvas.pixels = saved_canvas;
+            }
+            else if (previous_frame->disposal == FrameDisposal::Clear) {
+                clear_rectangle(canvas, previous_frame->x, previous_frame->y, previous_frame->pixels.width, previous_frame->pixels.height);
+            }
+        }
+        previous_frame = frame;
+
+        if (frame.disposal == FrameDisposal::Previous) {
+            saved_canvas = canvas.pixels;
+        }
+
+        draw_frame(canvas, frame.pixels, frame.x, frame.y, frame.blend);
+
+        const auto delay = get_frame_delay(frame.delay);
+        if (frame_index % animation->stride != 0) {
+            animation->frames.back().delay += delay;
+            continue;
+        }
+
+        auto composited = image_from_pixels(std::make_shared<std::vector<uint32_t>>(canvas.pixels), canvas.width, canvas.height, true);
+        auto scaled = composited ? scale_image(*composited, max_width, max_height) : nullptr;
+        if (!scaled) {
+            return nullptr;
+        }
+        animation->frames.push_back({std::move(scaled), delay});
+
+        while (animation->frames.size() > 1 && frames_size_bytes(animation->frames) > budget_bytes) {
+            drop_every_other_frame(animation->frames);
+            animation->stride *= 2;
+        }
+    }
+
+    if (animation->frames.empty()) {
+        return nullptr;
+    }
+    if (animation->stride > 1) {
+        TERMIMG_LOG(Debug) << "Kept every " << animation->stride << " frames to stay within " << budget_bytes << " bytes";
+    }
+
+    return animation;
+}
+
+static std::shared_ptr<AnimatedImage> load_gif_animation(const std::string &path, int max_width, int max_height,
+                                                         size_t budget_bytes, const std::function<bool()> &superseded) {
+    const auto decoder = open_gif(path);
+    if (!decoder) {
+        return nullptr;
+    }
+
+    size_t frame_count = 0;
+    auto animation = composite_frames(decoder->canvas_width(), decoder->canvas_height(), [&](DecodedFrame &frame) {
+        GifFrame gif_frame{};
+        if (!decoder->next(gif_frame)) {
+            return false;
+        }
+
+        frame.pixels = {gif_frame.pixels, gif_frame.width, gif_frame.height};
+        frame.x = gif_frame.x;
+        frame.y = gif_frame.y;
+        // Transparent pixels show the canvas below
+        frame.blend = true;
+        frame.disposal = gif_frame.disposal == GifDisposal::Clear ? FrameDisposal::Clear
+                       : gif_frame.disposal == GifDisposal::Previous ? FrameDisposal::Previous
+                       : FrameDisposal::Keep;
+        frame.delay = gif_frame.delay;
+        ++frame_count;
+        return true;
+    }, max_width, max_height, budget_bytes, superseded);
+
+    TERMIMG_LOG(Debug) << "GIF " << path << " has " << frame_count << " frames of width: " << decoder->canvas_width() << " height: " << decoder->canvas_height();
+    return animation;
+}
+
+#ifdef IMLIB_IMAGE_ANIMATED
+
+static FrameDisposal get_frame_disposal(const Imlib_Frame_Info &info) {
+    if (info.frame_flags & IMLIB_FRAME_DISPOSE_PREV) {
+        return FrameDisposal::Previous;
+    }
+    if (info.frame_flags & IMLIB_FRAME_DISPOSE_CLEAR) {
+        return FrameDisposal::Clear;
+    }
+    return FrameDisposal::Keep;
+}
+
+// imlib_load_image_frame parses the file from the start for every frame, so GIFs are left to giflib
+static std::shared_ptr<AnimatedImage> load_imlib_animation(const std::string &path, int max_width, int max_height,
+                                                           size_t budget_bytes, const std::function<bool()> &superseded) {
+    Imlib_Frame_Info info{};
+    auto load_frame = [&](int frame_number) -> std::shared_ptr<Image> {
+        Imlib_Image frame;
+        {
+            std::lock_guard lock(imlib_mutex());
+            frame = imlib_load_image_frame(path.c_str(), frame_number);
+            if (frame) {
+                imlib_context_set_image(frame);
+                imlib_image_get_frame_info(&info);
+            }
+        }
+        if (!frame) {
+            TERMIMG_LOG(Warning) << "Could not load frame " << frame_number << " of " << path;
+            return nullptr;
+        }
+        return std::make_shared<Image>(frame);
+    };
+
+    auto frame_image = load_frame(1);
+    if (!frame_image) {
+        return nullptr;
+    }
+
+    const int frame_count = info.frame_count;
+    if (!(info.frame_flags & IMLIB_IMAGE_ANIMATED) || frame_count <= 1) {
+        auto scaled = scale_image(*frame_image, max_width, max_height);
+        if (!scaled) {
+            return nullptr;
+        }
+
+        auto animation = std::make_shared<AnimatedImage>();
+        animation->stride = 1;
+        animation->frames.push_back({std::move(scaled), std::chrono::milliseconds(0)});
+        return animation;
+    }
+
+    const int canvas_width = info.canvas_w > 0 ? info.canvas_w : frame_image->width();
+    const int canvas_height = info.canvas_h > 0 ? info.canvas_h : frame_image->height();
+    TERMIMG_LOG(Debug) << "Animation " << path << " has " << frame_count << " frames of width: " << canvas_width << " height: " << canvas_height;
+
+    // Frame 1 is loaded already, it was needed for the frame count
+    int frame_number = 0;
+    return composite_frames(canvas_width, canvas_height, [&](DecodedFrame &frame) {
+        if (++frame_number > frame_count) {
+            return false;
+        }
+        if (frame_number > 1) {
+            frame_image = load_frame(frame_number);
+            if (!frame_image) {
+                return false;
+            }
+        }
+
+        frame.pixels = {frame_image->pixels(), frame_image->width(), frame_image->height()};
+        frame.x = info.frame_x;
+        frame.y = info.frame_y;
+        frame.blend = (info.frame_flags & IMLIB_FRAME_BLEND) != 0;
+        frame.disposal = get_frame_disposal(info);
+        frame.delay = std::chrono::milliseconds(info.frame_delay);
+        return true;
+    }, max_width, max_height, budget_bytes, superseded);
+}
+
+#else
+
+static std::shared_ptr<AnimatedImage> load_imlib_animation(const std::string &path, int max_width, int max_height,
+                                                           size_t, const std::function<bool()> &) {
+    // Imlib2 before 1.9 has no frame API, only the first frame is shown
+    const auto image = load_image(path);
+    if (!image) {
+        return nullptr;
+    }
+
+    auto scaled = scale_image(*image, max_width, max_height);
+    if (!scaled) {
+        return nullptr;
+    }
+
+    auto animation = std::make_shared<AnimatedImage>();
+    animation->stride = 1;
+    animation->frames.push_back({std::move(scaled), std::chrono::milliseconds(0)});
+    return animation;
+}
+
+#endif
+
+std::shared_ptr<AnimatedImage> load_animation(const std::string &path, int max_width, int max_height,
+                                              size_t budget_bytes, const std::function<bool()> &superseded) {
+    if (is_gif(path)) {
+        auto animation = load_gif_animation(path, max_width, max_height, budget_bytes, superseded);
+        if (animation || superseded()) {
+            return animation;
+        }
+        TERMIMG_LOG(Debug) << "giflib could not decode " << path << ", trying Imlib2";
+    }
+
+    return load_imlib_animation(path, max_width, max_height, budget_bytes, superseded);
+}
+
+Animation::Animation(Epoll &epoll, std::shared_ptr<Display> display, Renderer &renderer, Drawable drawable, unsigned int depth,
+                     std::vector<AnimationFrame> frames, std::function<void(Pixmap)> show_frame)
+    : m_epoll(epoll), m_display(std::move(display)), m_renderer(renderer), m_drawable(drawable), m_depth(depth),
+      m_fd_timer(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)),
+      m_frames(std::move(frames)), m_pixmaps(m_frames.size(), None), m_show_frame(std::move(show_frame)) {
+    if (m_fd_timer == -1) {
+        perror("timerfd_create");
+        throw 1;
+    }
+
+    m_epoll.register_fd(m_fd_timer, [this]() {
+        on_timer();
+    });
+}
+
+Animation::~Animation() {
+    m_epoll.unregister_fd(m_fd_timer);
+    close(m_fd_timer);
+
+    for (const auto pixmap : m_pixmaps) {
+        if (pixmap != None) {
+            XFreePixmap(m_display.get(), pixmap);
+        }
+    }
+
+    if (m_dropped_frames > 0) {
+        TERMIMG_LOG(Debug) << "Animation skipped " << m_dropped_frames << " frames";
+    }
+}
+
+CachedPixmap Animation::first_frame() {
+    const auto &image = *m_frames[0].image;
+    const Pixmap pixmap = get_pixmap(0);
+    return {pixmap, static_cast<unsigned int>(image.width()), static_cast<unsigned int>(image.height())};
+}
+
+void Animation::start() {
+    m_current_frame = 0;
+    m_next_frame_at = std::chrono::steady_clock::now() + m_frames[0].delay;
+    arm_timer();
+}
+
+void Animation::pause() {
+    if (m_paused) {
+        return;
+    }
+
+    m_paused = true;
+    m_remaining = std::max(std::chrono::steady_clock::duration::zero(), m_next_frame_at - std::chrono::steady_clock::now());
+
+    const itimerspec disarm{};
+    if (timerfd_settime(m_fd_timer, 0, &disarm, nullptr) == -1) {
+        perror("timerfd_settime");
+    }
+}
+
+void Animation::resume() {
+    if (!m_paused) {
+        return;
+    }
+
+    m_paused = false;
+    m_next_frame_at = std::chrono::steady_clock::now() + m_remaining;
+    arm_timer();
+}
+
+bool Animation::paused() const {
+    return m_paused;
+}
+
+uint64_t Animation::dropped_frames() const {
+    return m_dropped_frames;
+}
+
+Pixmap Animation::get_pixmap(size_t index) {
+    if (m_pixmaps[index] != None) {
+        return m_pixmaps[index];
+    }
+
+    const auto &image = *m_frames[index].image;
+    const Pixmap pixmap = XCreatePixmap(m_display.get(), m_drawable,
+                                        static_cast<unsigned int>(image.width()), static_cast<unsigned int>(image.height()), m_depth);
+    m_renderer.render(image, pixmap);
+    m_pixmaps[index] = pixmap;
+
+    // Once every frame lives on the X server the decoded frames are no longer needed
+    m_frames[index].image.reset();
+    if (++m_rendered_frames == m_frames.size()) {
+        TERMIMG_LOG(Debug) << "All " << m_frames.size() << " animation frames rendered";
+    }
+
+    return pixmap;
+}
+
+void Animation::arm_timer() {
+    // steady_clock is CLOCK_MONOTONIC, an absolute deadline keeps the frame times from drifting
+    const auto since_epoch = m_next_frame_at.time_since_epoch();
+    const auto seconds = std::chrono::duration_cast<std::chrono::seconds>(since_epoch);
+    const auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(since_epoch - seconds);
+
+    itimerspec spec{};
+    spec.it_value.tv_sec = seconds.count();
+    spec.it_value.tv_nsec = nanoseconds.count();
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+        spec.it_value.tv_nsec = 1;
+    }
+
+    if (timerfd_settime(m_fd_timer, TFD_TIMER_ABSTIME, &spec, nullptr) == -1) {
+        perror("timerfd_settime");
+    }
+}
+
+void Animation::on_timer() {
+    uint64_t expirations;
+    if (read(m_fd_timer, &expirations, sizeof(expirations)) == -1) {
+        // A pause right before the read disarms the timer
+        return;
+    }
+    if (m_paused) {
+        return;
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    size_t frame = (m_current_frame + 1) % m_frames.size();
+    auto shown_at = m_next_frame_at;
+
+    // After a long stall start over from now instead of skipping through whole loops
+    if (now - shown_at > std::chrono::seconds(1)) {
+        shown_at = now;
+    }
+
+    while (shown_at + m_frames[frame].delay <= now) {
+        shown_at += m_frames[frame].delay;
+        frame = (frame + 1) % m_frames.size();
+        ++m_dropped_frames;
+    }
+
+    m_current_frame = frame;
+    m_next_frame_at = shown_at + m_frames[frame].delay;
+    m_show_frame(get_pixmap(frame));
+    arm_timer();
+}
@@ -0,0 +1,83 @@
+#ifndef TERMIMG_ANIMATION_H
+#define TERMIMG_ANIMATION_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <functional>
+
+#include <cstddef>
+#include <cstdint>
+
+#include <X11/Xlib.h>
+
+#include "epoll.h"
+#include "image.h"
+#include "pixmap-cache.h"
+#include "renderer.h"
+
+
+struct AnimationFrame {
+    // Composited onto the canvas and scaled, released once the frame is rendered to a pixmap
+    std::shared_ptr<Image> image;
+    std::chrono::milliseconds delay;
+};
+
+struct AnimatedImage {
+    std::vector<AnimationFrame> frames;
+    // Only every stride'th source frame was kept to stay within the memory budget
+    size_t stride;
+};
+
+// GIFs and PNGs with an animation control chunk, anything else is not worth probing for frames
+bool may_be_animated(const std::string &path);
+
+// Decodes and composites every frame and scales the kept ones to fit max_width x max_height.
+// Frames are dropped evenly until the scaled frames fit budget_bytes. A still image gives
+// a single frame, nullptr means loading failed or the display was superseded.
+std::shared_ptr<AnimatedImage> load_animation(const std::string &path, int max_width, int max_height,
+                                              size_t budget_bytes, const std::function<bool()> &superseded);
+
+// Plays frames with a timerfd on the epoll loop. Frames are rendered to pixmaps the first
+// time they are shown, and frames whose time has passed when the loop was busy are skipped.
+class Animation {
+private:
+    Epoll &m_epoll;
+    const std::shared_ptr<Display> m_display;
+    Renderer &m_renderer;
+    const Drawable m_drawable;
+    const unsigned int m_depth;
+    const int m_fd_timer;
+    std::vector<AnimationFrame> m_frames;
+    std::vector<Pixmap> m_pixmaps;
+    size_t m_rendered_frames = 0;
+    size_t m_current_frame = 0;
+    bool m_paused = false;
+    std::chrono::steady_clock::time_point m_next_frame_at;
+    // Time left of the current frame when paused
+    std::chrono::steady_clock::duration m_remaining{};
+    uint64_t m_dropped_frames = 0;
+    const std::function<void(Pixmap)> m_show_frame;
+
+    Pixmap get_pixmap(size_t index);
+    void arm_timer();
+    void on_timer();
+
+public:
+    Animation(Epoll &epoll, std::shared_ptr<Display> display, Renderer &renderer, Drawable drawable, unsigned int depth,
+              std::vector<AnimationFrame> frames, std::function<void(Pixmap)> show_frame);
+    Animation(const Animation&) = delete;
+    ~Animation();
+
+    [[nodiscard]] CachedPixmap first_frame();
+    void start();
+    void pause();
+    void resume();
+
+    [[nodiscard]] bool paused() const;
+    [[nodiscard]] uint64_t dropped_frames() const;
+};
+
+
+#endif //TERMIMG_ANIMATION_H
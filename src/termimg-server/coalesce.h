@@ -0,0 +1,50 @@
+#ifndef TERMIMG_COALESCE_H
+#define TERMIMG_COALESCE_H
+
+#include <vector>
+#include <set>
+#include <string>
+#include <optional>
+#include <utility>
+
+#include <cstddef>
+
+
+// Whether slot or a slot covering it, one of its prefixes ending in a '/', was seen already
+inline bool is_slot_taken(const std::set<std::string> &seen_slots, const std::string &slot) {
+    for (size_t end = slot.find('/'); end != std::string::npos; end = slot.find('/', end + 1)) {
+        if (seen_slots.contains(slot.substr(0, end + 1))) {
+            return true;
+        }
+    }
+    return seen_slots.contains(slot);
+}
+
+// Keeps only the newest message for every slot, messages without a slot are always kept. A slot
+// ending in a '/' covers every slot under it, so such a message also drops older ones in those.
+// on_dropped is called for every message that is dropped, the number of which is returned.
+template<typename T, typename SlotFunction, typename DroppedFunction>
+size_t coalesce(std::vector<T> &messages, SlotFunction slot_of, DroppedFunction on_dropped) {
+    std::set<std::string> seen_slots;
+    std::vector<T> kept;
+    kept.reserve(messages.size());
+
+    for (auto it = messages.rbegin(); it != messages.rend(); ++it) {
+        const std::optional<std::string> slot = slot_of(*it);
+        if (slot.has_value()) {
+            if (is_slot_taken(seen_slots, slot.value())) {
+                on_dropped(*it);
+                continue;
+            }
+            seen_slots.insert(slot.value());
+        }
+        kept.push_back(std::move(*it));
+    }
+
+    const size_t dropped = messages.size() - kept.size();
+    messages.assign(std::make_move_iterator(kept.rbegin()), std::make_move_iterator(kept.rend()));
+    return dropped;
+}
+
+
+#endif //TERMIMG_COALESCE_H
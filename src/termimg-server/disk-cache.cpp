@@ -0,0 +1,381 @@
+#include "disk-cache.h"
+
+#include <vector>
+#include <string_view>
+#include <algorithm>
+#include <utility>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+
+
+constexpr char entry_magic[8] = {'T', 'I', 'M', 'G', 'R', 'A', 'W', '1'};
+// Pixels waiting for the writer, what does not fit is written the next time it is scaled
+constexpr size_t max_pending_bytes = 64 * 1024 * 1024;
+// Hits refresh the modification time eviction goes by, but at most this often
+constexpr time_t touch_interval_seconds = 60;
+// Temporary files this old were left behind by a server that died while writing
+constexpr time_t stale_temp_seconds = 10 * 60;
+
+// Written in native byte order, the cache directory is never shared between machines
+struct EntryHeader {
+    char magic[8];
+    uint64_t device;
+    uint64_t inode;
+    int64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int32_t max_width;
+    int32_t max_height;
+    uint32_t width;
+    uint32_t height;
+    uint32_t has_alpha;
+    uint32_t reserved;
+};
+
+static EntryHeader make_header(const ImageKey &key) {
+    EntryHeader header{};
+    std::memcpy(header.magic, entry_magic, sizeof(header.magic));
+    header.device = key.device;
+    header.inode = key.inode;
+    header.file_size = key.file_size;
+    header.mtime_sec = key.mtime_sec;
+    header.mtime_nsec = key.mtime_nsec;
+    header.max_width = key.max_width;
+    header.max_height = key.max_height;
+    return header;
+}
+
+// The name is a hash, so the header is checked too before an entry is used
+static bool same_source(const EntryHeader &a, const EntryHeader &b) {
+    return std::memcmp(a.magic, b.magic, sizeof(a.magic)) == 0
+        && a.device == b.device && a.inode == b.inode && a.file_size == b.file_size
+        && a.mtime_sec == b.mtime_sec && a.mtime_nsec == b.mtime_nsec
+        && a.max_width == b.max_width && a.max_height == b.max_height;
+}
+
+// The file's identity and the target size, not its path, so renamed files still hit
+static std::string entry_name(const ImageKey &key) {
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](uint64_t value) {
+        for (int i = 0; i < 8; ++i) {
+            hash ^= value & 0xff;
+            hash *= 1099511628211ull;
+            value >>= 8;
+        }
+    };
+    mix(key.device);
+    mix(key.inode);
+    mix(static_cast<uint64_t>(key.file_size));
+    mix(static_cast<uint64_t>(key.mtime_sec));
+    mix(static_cast<uint64_t>(key.mtime_nsec));
+    mix(static_cast<uint32_t>(key.max_width));
+    mix(static_cast<uint32_t>(key.max_height));
+
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016" PRIx64 ".argb", hash);
+    return name;
+}
+
+static bool write_all(int fd, const void* data, size_t size) {
+    const auto* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        const ssize_t written = write(fd, bytes, size);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            return false;
+        }
+        bytes += written;
+        size -= static_cast<size_t>(written);
+    }
+
+    return true;
+}
+
+// Creates the directory and any missing parents, readable by the user only
+static bool make_directories(const std::string &path) {
+    for (size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+        const auto directory = path.substr(0, slash);
+        if (mkdir(directory.c_str(), 0700) == -1 && errno != EEXIST) {
+            perror("mkdir");
+            return false;
+        }
+        if (slash == std::string::npos) {
+            return true;
+        }
+    }
+}
+
+DiskCache::DiskCache(std::string directory, size_t budget_bytes) : m_directory(std::move(directory)), m_budget_bytes(budget_bytes) {
+    if (m_directory.empty() || m_budget_bytes == 0) {
+        m_directory.clear();
+        TERMIMG_LOG(Info) << "Disk cache disabled";
+        return;
+    }
+
+    if (!make_directories(m_directory)) {
+        TERMIMG_LOG(Warning) << "Disk cache disabled, " << m_directory << " cannot be created";
+        m_directory.clear();
+        return;
+    }
+
+    TERMIMG_LOG(Info) << "Disk cache in " << m_directory << " with a budget of " << m_budget_bytes << " bytes";
+    m_writer = std::thread([this]() {
+        write_entries();
+    });
+}
+
+DiskCache::~DiskCache() {
+    // Unwritten images are dropped, freeing them takes the imlib lock so that happens after unlocking
+    std::deque<Entry> pending;
+    {
+        std::lock_guard lock(m_mutex);
+        m_stopping = true;
+        pending.swap(m_pending);
+    }
+    m_condition.notify_all();
+
+    if (m_writer.joinable()) {
+        m_writer.join();
+    }
+}
+
+std::shared_ptr<Image> DiskCache::get(const ImageKey &key) {
+    if (m_directory.empty()) {
+        return nullptr;
+    }
+
+    std::shared_ptr<Image> image;
+    const int fd = open((m_directory + "/" + entry_name(key)).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        const auto expected = make_header(key);
+        EntryHeader header{};
+        if (pread(fd, &header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header)) && same_source(header, expected)) {
+            image = map_pixels(fd, header.width, header.height, sizeof(header), header.has_alpha != 0);
+        }
+
+        struct stat s{};
+        if (image && fstat(fd, &s) == 0 && s.st_mtim.tv_sec + touch_interval_seconds < std::time(nullptr)) {
+            futimens(fd, nullptr);
+        }
+        close(fd);
+    }
+
+    std::lock_guard lock(m_mutex);
+    if (image) {
+        ++m_stats.hits;
+    }
+    else {
+        ++m_stats.misses;
+    }
+    return image;
+}
+
+void DiskCache::put(const ImageKey &key, std::shared_ptr<Image> image) {
+    if (m_directory.empty()) {
+        return;
+    }
+
+    const auto bytes = image->size_bytes();
+    {
+        std::lock_guard lock(m_mutex);
+        if (m_pending_bytes + bytes > max_pending_bytes) {
+            return;
+        }
+        m_pending_bytes += bytes;
+        m_pending.emplace_back(key, std::move(image));
+    }
+    m_condition.notify_one();
+}
+
+bool DiskCache::contains(const ImageKey &key) const {
+    return !m_directory.empty() && access((m_directory + "/" + entry_name(key)).c_str(), F_OK) == 0;
+}
+
+DiskCacheStats DiskCache::stats() const {
+    std::lock_guard lock(m_mutex);
+    return m_stats;
+}
+
+void DiskCache::write_entries() {
+    while (true) {
+        Entry entry;
+        bool scanned;
+        {
+            std::unique_lock lock(m_mutex);
+            m_condition.wait(lock, [this]() { return m_stopping || !m_pending.empty(); });
+            if (m_stopping) {
+                return;
+            }
+
+            entry = std::move(m_pending.front());
+            m_pending.pop_front();
+            m_pending_bytes -= entry.second->size_bytes();
+            scanned = m_scanned;
+        }
+
+        // The size of the directory is only known after a scan
+        if (!scanned) {
+            evict();
+        }
+
+        const bool written = write_entry(entry.first, *entry.second);
+        bool over_budget;
+        {
+            std::lock_guard lock(m_mutex);
+            if (written) {
+                ++m_stats.writes;
+                m_stats.used_bytes += sizeof(EntryHeader) + entry.second->size_bytes();
+            }
+            over_budget = m_stats.used_bytes > m_budget_bytes;
+        }
+
+        if (over_budget) {
+            evict();
+        }
+    }
+}
+
+bool DiskCache::write_entry(const ImageKey &key, const Image &image) {
+    auto header = make_header(key);
+    header.width = static_cast<uint32_t>(image.width());
+    header.height = static_cast<uint32_t>(image.height());
+
+    const DATA32* pixels = image.pixels();
+    header.has_alpha = image.has_alpha() ? 1 : 0;
+
+    // Renamed into place once complete, so other servers never map a partial entry
+    const auto name = entry_name(key);
+    auto temp_path = m_directory + "/." + name + ".XXXXXX";
+    const int fd = mkostemp(temp_path.data(), O_CLOEXEC);
+    if (fd == -1) {
+        perror("mkostemp");
+        return false;
+    }
+
+    const bool written = write_all(fd, &header, sizeof(header)) && write_all(fd, pixels, image.size_bytes());
+    close(fd);
+    if (!written) {
+        unlink(temp_path.c_str());
+        return false;
+    }
+
+    if (rename(temp_path.c_str(), (m_directory + "/" + name).c_str()) == -1) {
+        perror("rename");
+        unlink(temp_path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+void DiskCache::evict() {
+    const int fd_lock = open((m_directory + "/.lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd_lock == -1) {
+        perror("open");
+        return;
+    }
+
+    // Another server evicting right now does the same job. It leaves the directory at 3/4 of the budget,
+    // taking that as the size keeps the writer from scanning again before every entry while it runs.
+    if (flock(fd_lock, LOCK_EX | LOCK_NB) == -1) {
+        close(fd_lock);
+        std::lock_guard lock(m_mutex);
+        m_scanned = true;
+        m_stats.used_bytes = m_budget_bytes / 4 * 3;
+        return;
+    }
+
+    DIR* directory = opendir(m_directory.c_str());
+    if (directory == nullptr) {
+        perror("opendir");
+        close(fd_lock);
+        return;
+    }
+
+    struct CachedFile {
+        time_t mtime_sec;
+        long mtime_nsec;
+        size_t size;
+        std::string name;
+    };
+
+    std::vector<CachedFile> files;
+    size_t used_bytes = 0;
+    const time_t now = std::time(nullptr);
+    while (const dirent* entry = readdir(directory)) {
+        struct stat s{};
+        if (fstatat(dirfd(directory), entry->d_name, &s, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(s.st_mode)) {
+            continue;
+        }
+
+        const std::string_view name(entry->d_name);
+        if (name.starts_with('.')) {
+            if (name != ".lock" && s.st_mtim.tv_sec + stale_temp_seconds < now) {
+                unlinkat(dirfd(directory), entry->d_name, 0);
+            }
+            continue;
+        }
+
+        files.push_back({s.st_mtim.tv_sec, s.st_mtim.tv_nsec, static_cast<size_t>(s.st_size), std::string(name)});
+        used_bytes += static_cast<size_t>(s.st_size);
+    }
+
+    // Least recently used first, down to 3/4 of the budget so the next eviction is a while away
+    uint64_t evictions = 0;
+    if (used_bytes > m_budget_bytes) {
+        std::sort(files.begin(), files.end(), [](const CachedFile &a, const CachedFile &b) {
+            return std::pair(a.mtime_sec, a.mtime_nsec) < std::pair(b.mtime_sec, b.mtime_nsec);
+        });
+
+        for (const auto &file : files) {
+            if (used_bytes <= m_budget_bytes / 4 * 3) {
+                break;
+            }
+            if (unlinkat(dirfd(directory), file.name.c_str(), 0) == 0) {
+                used_bytes -= file.size;
+                ++evictions;
+            }
+        }
+    }
+
+    closedir(directory);
+    close(fd_lock);
+
+    TERMIMG_LOG(Debug) << "Disk cache holds " << used_bytes << " bytes after evicting " << evictions << " entries";
+
+    std::lock_guard lock(m_mutex);
+    m_scanned = true;
+    m_stats.used_bytes = used_bytes;
+    m_stats.evictions += evictions;
+}
+
+std::string get_disk_cache_directory() {
+    // Relative paths are invalid there according to the XDG base directory spec
+    const char* cache_home = std::getenv("XDG_CACHE_HOME");
+    if (cache_home != nullptr && cache_home[0] == '/') {
+        return std::string(cache_home) + "/termimg";
+    }
+
+    const char* home = std::getenv("HOME");
+    if (home != nullptr && home[0] == '/') {
+        return std::string(home) + "/.cache/termimg";
+    }
+
+    return {};
+}
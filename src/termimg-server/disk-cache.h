@@ -0,0 +1,71 @@
+#ifndef TERMIMG_DISK_CACHE_H
+#define TERMIMG_DISK_CACHE_H
+
+#include <string>
+#include <memory>
+#include <deque>
+#include <utility>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "image.h"
+
+
+struct DiskCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t writes = 0;
+    uint64_t evictions = 0;
+    // As of the last scan of the directory plus what this server wrote since
+    size_t used_bytes = 0;
+};
+
+// Scaled images as raw ARGB files, which outlive the server and are shared by all servers of a user.
+// A hit maps the file, so it costs a page cache lookup instead of a decode and scale. Files are
+// written under a temporary name and renamed into place, so readers only ever see whole files,
+// and only one server at a time evicts, holding an flock on the directory's lock file.
+class DiskCache {
+private:
+    using Entry = std::pair<ImageKey, std::shared_ptr<Image>>;
+
+    // Empty when the cache is disabled
+    std::string m_directory;
+    const size_t m_budget_bytes;
+
+    std::deque<Entry> m_pending;
+    size_t m_pending_bytes = 0;
+    bool m_scanned = false;
+    bool m_stopping = false;
+    DiskCacheStats m_stats;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_condition;
+
+    std::thread m_writer;
+
+    void write_entries();
+    bool write_entry(const ImageKey &key, const Image &image);
+    void evict();
+
+public:
+    DiskCache(std::string directory, size_t budget_bytes);
+    DiskCache(const DiskCache&) = delete;
+    ~DiskCache();
+
+    std::shared_ptr<Image> get(const ImageKey &key);
+    // Queues the image for the writer thread, so the caller does not wait for the disk
+    void put(const ImageKey &key, std::shared_ptr<Image> image);
+    // Only checks that the entry exists, it may still turn out stale
+    [[nodiscard]] bool contains(const ImageKey &key) const;
+
+    [[nodiscard]] DiskCacheStats stats() const;
+};
+
+// $XDG_CACHE_HOME/termimg or ~/.cache/termimg, empty when neither variable is set
+std::string get_disk_cache_directory();
+
+
+#endif //TERMIMG_DISK_CACHE_H
@@ -4,14 +4,13 @@
 
 #include "epoll.h"
 
-#include <iostream>
-
-#include <cassert>
 #include <cstdio>
 
 #include <unistd.h>
 #include <sys/epoll.h>
 
+#include "log.h"
+
 
 Epoll::Epoll() : m_fd_epoll(epoll_create(1)) {
 }
@@ -21,7 +20,7 @@ Epoll::~Epoll() {
 }
 
 void Epoll::register_fd(int fd, std::function<void()> event_handler) {
-    std::cerr << "Registering fd: " << fd << std::endl;
+    TERMIMG_LOG(Debug) << "Registering fd: " << fd;
     m_event_handlers.insert({fd, event_handler});
 
     epoll_event new_event;
@@ -35,24 +34,35 @@ void Epoll::register_fd(int fd, std::function<void()> event_handler) {
 }
 
 void Epoll::unregister_fd(int fd) {
-    std::cerr << "Unregistering fd: " << fd << std::endl;
+    TERMIMG_LOG(Debug) << "Unregistering fd: " << fd;
     if (epoll_ctl(m_fd_epoll, EPOLL_CTL_DEL, fd, nullptr) != 0) {
         perror("epoll_ctl EPOLL_CTL_DEL");
         throw 1;
     }
 
     m_event_handlers.erase(fd);
+    m_unregistered_fds.insert(fd);
 }
 
-void Epoll::run_loop() const {
+void Epoll::run_loop() {
     epoll_event events[max_events];
     while(!m_should_exit) {
         int ready_fds = epoll_wait(m_fd_epoll, events, sizeof(events) / sizeof(events[0]), -1);
+        m_unregistered_fds.clear();
         for (int i = 0; i < ready_fds; ++i) {
+            // An earlier handler of the batch may have removed this one, such as a clear destroying an animation
             int fd = events[i].data.fd;
-            assert(m_event_handlers.count(fd) == 1);
-            m_event_handlers.at(fd)();
+            const auto it = m_event_handlers.find(fd);
+            if (it == m_event_handlers.end() || m_unregistered_fds.count(fd) > 0) {
+                TERMIMG_LOG(Debug) << "Skipping event of unregistered fd: " << fd;
+                continue;
+            }
+
+            // Copied, the handler may unregister its own fd
+            const auto event_handler = it->second;
+            event_handler();
         }
+        flush_log();
     }
 }
 
@@ -6,6 +6,7 @@
 #define TERMIMG_EPOLL_H
 
 #include <map>
+#include <set>
 #include <functional>
 
 
@@ -13,6 +14,9 @@ class Epoll {
 private:
     const int m_fd_epoll;
     std::map<int, std::function<void()>> m_event_handlers;
+    // Unregistered while handling the current batch of events, whose events for them are stale
+    // even when the fd number was registered again meanwhile
+    std::set<int> m_unregistered_fds;
     bool m_should_exit = false;
 
     // Arbitrary
@@ -26,7 +30,7 @@ public:
 
     void register_fd(int fd, std::function<void()>);
     void unregister_fd(int fd);
-    void run_loop() const;
+    void run_loop();
     void exit_loop();
 };
 
@@ -0,0 +1,166 @@
+#include "gif-loader.h"
+
+#include <iterator>
+
+#include <cstddef>
+
+#include "log.h"
+
+
+// The limits Imlib2 puts on images, so a GIF does not get further here than it would there
+constexpr int max_gif_side = 32767;
+constexpr size_t max_gif_pixels = size_t{1} << 29;
+
+// Interlaced GIFs store every 8th row from row 0, then every 8th from row 4, every 4th from 2 and every 2nd from 1
+constexpr int interlace_offsets[] = {0, 4, 2, 1};
+constexpr int interlace_steps[] = {8, 8, 4, 2};
+
+static bool is_size_ok(int width, int height) {
+    return width > 0 && height > 0 && width <= max_gif_side && height <= max_gif_side
+        && static_cast<size_t>(width) * static_cast<size_t>(height) <= max_gif_pixels;
+}
+
+static GifDisposal to_disposal(int disposal_mode) {
+    switch (disposal_mode) {
+        case DISPOSE_BACKGROUND: return GifDisposal::Clear;
+        case DISPOSE_PREVIOUS: return GifDisposal::Previous;
+        default: return GifDisposal::Keep;
+    }
+}
+
+GifDecoder::GifDecoder(GifFileType* gif) : m_gif(gif) {
+}
+
+GifDecoder::~GifDecoder() {
+    int error = 0;
+    DGifCloseFile(m_gif, &error);
+}
+
+int GifDecoder::canvas_width() const {
+    return m_gif->SWidth;
+}
+
+int GifDecoder::canvas_height() const {
+    return m_gif->SHeight;
+}
+
+bool GifDecoder::next(GifFrame &frame) {
+    // A graphic control extension only applies to the image right after it
+    GraphicsControlBlock control{DISPOSAL_UNSPECIFIED, false, 0, NO_TRANSPARENT_COLOR};
+
+    while (true) {
+        GifRecordType record_type;
+        if (DGifGetRecordType(m_gif, &record_type) == GIF_ERROR) {
+            TERMIMG_LOG(Warning) << "Broken GIF record: " << GifErrorString(m_gif->Error);
+            return false;
+        }
+
+        switch (record_type) {
+            case IMAGE_DESC_RECORD_TYPE:
+                return read_frame(control, frame);
+            case EXTENSION_RECORD_TYPE: {
+                int extension_code = 0;
+                GifByteType* extension = nullptr;
+                if (DGifGetExtension(m_gif, &extension_code, &extension) == GIF_ERROR) {
+                    TERMIMG_LOG(Warning) << "Broken GIF extension: " << GifErrorString(m_gif->Error);
+                    return false;
+                }
+                if (extension_code == GRAPHICS_EXT_FUNC_CODE && extension != nullptr) {
+                    DGifExtensionToGCB(extension[0], extension + 1, &control);
+                }
+                while (extension != nullptr) {
+                    if (DGifGetExtensionNext(m_gif, &extension) == GIF_ERROR) {
+                        TERMIMG_LOG(Warning) << "Broken GIF extension: " << GifErrorString(m_gif->Error);
+                        return false;
+                    }
+                }
+                break;
+            }
+            case TERMINATE_RECORD_TYPE:
+                return false;
+            default:
+                break;
+        }
+    }
+}
+
+bool GifDecoder::read_frame(const GraphicsControlBlock &control, GifFrame &frame) {
+    if (DGifGetImageDesc(m_gif) == GIF_ERROR) {
+        TERMIMG_LOG(Warning) << "Broken GIF image descriptor: " << GifErrorString(m_gif->Error);
+        return false;
+    }
+
+    const auto &description = m_gif->Image;
+    const ColorMapObject* color_map = description.ColorMap != nullptr ? description.ColorMap : m_gif->SColorMap;
+    if (!is_size_ok(description.Width, description.Height) || color_map == nullptr) {
+        TERMIMG_LOG(Warning) << "GIF frame of width: " << description.Width << " height: " << description.Height << " cannot be decoded";
+        return false;
+    }
+
+    const int width = description.Width;
+    const int height = description.Height;
+    const auto row_size = static_cast<size_t>(width);
+    m_indices.resize(row_size * static_cast<size_t>(height));
+
+    auto read_row = [&](int row) {
+        return DGifGetLine(m_gif, m_indices.data() + static_cast<size_t>(row) * row_size, width) != GIF_ERROR;
+    };
+    if (description.Interlace) {
+        for (size_t pass = 0; pass < std::size(interlace_offsets); ++pass) {
+            for (int row = interlace_offsets[pass]; row < height; row += interlace_steps[pass]) {
+                if (!read_row(row)) {
+                    TERMIMG_LOG(Warning) << "Broken GIF image data: " << GifErrorString(m_gif->Error);
+                    return false;
+                }
+            }
+        }
+    }
+    else {
+        for (int row = 0; row < height; ++row) {
+            if (!read_row(row)) {
+                TERMIMG_LOG(Warning) << "Broken GIF image data: " << GifErrorString(m_gif->Error);
+                return false;
+            }
+        }
+    }
+
+    // Indices past the end of the color map have no color, they are left transparent like the transparent one
+    m_pixels.resize(m_indices.size());
+    for (size_t i = 0; i < m_indices.size(); ++i) {
+        const int index = m_indices[i];
+        if (index == control.TransparentColor || index >= color_map->ColorCount) {
+            m_pixels[i] = 0;
+            continue;
+        }
+
+        const auto &color = color_map->Colors[index];
+        m_pixels[i] = 0xff000000u | static_cast<uint32_t>(color.Red) << 16 | static_cast<uint32_t>(color.Green) << 8 | static_cast<uint32_t>(color.Blue);
+    }
+
+    frame.pixels = m_pixels.data();
+    frame.x = description.Left;
+    frame.y = description.Top;
+    frame.width = width;
+    frame.height = height;
+    frame.disposal = to_disposal(control.DisposalMode);
+    // In hundredths of a second
+    frame.delay = std::chrono::milliseconds(control.DelayTime * 10);
+    return true;
+}
+
+std::unique_ptr<GifDecoder> open_gif(const std::string &path) {
+    int error = 0;
+    GifFileType* gif = DGifOpenFileName(path.c_str(), &error);
+    if (gif == nullptr) {
+        TERMIMG_LOG(Debug) << "giflib cannot open " << path << ": " << GifErrorString(error);
+        return nullptr;
+    }
+
+    auto decoder = std::make_unique<GifDecoder>(gif);
+    if (!is_size_ok(decoder->canvas_width(), decoder->canvas_height())) {
+        TERMIMG_LOG(Warning) << "GIF canvas of width: " << decoder->canvas_width() << " height: " << decoder->canvas_height() << " is too large";
+        return nullptr;
+    }
+
+    return decoder;
+}
@@ -0,0 +1,59 @@
+#ifndef TERMIMG_GIF_LOADER_H
+#define TERMIMG_GIF_LOADER_H
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <chrono>
+
+#include <cstdint>
+
+#include <gif_lib.h>
+
+
+enum class GifDisposal {
+    Keep,
+    // Back to transparent
+    Clear,
+    // Back to the canvas before the frame
+    Previous,
+};
+
+struct GifFrame {
+    // width * height ARGB pixels, transparent ones have no alpha. Only valid until the next frame is decoded.
+    const uint32_t* pixels;
+    int x;
+    int y;
+    int width;
+    int height;
+    GifDisposal disposal;
+    // As given in the file, 0 when unset
+    std::chrono::milliseconds delay;
+};
+
+// Decodes the frames of a GIF one after the other in a single pass over the file, where
+// imlib_load_image_frame parses it again from the start for every frame. Needs no imlib_mutex.
+class GifDecoder {
+private:
+    GifFileType* m_gif;
+    std::vector<GifPixelType> m_indices;
+    std::vector<uint32_t> m_pixels;
+
+    bool read_frame(const GraphicsControlBlock &control, GifFrame &frame);
+
+public:
+    explicit GifDecoder(GifFileType* gif);
+    GifDecoder(const GifDecoder&) = delete;
+    ~GifDecoder();
+
+    [[nodiscard]] int canvas_width() const;
+    [[nodiscard]] int canvas_height() const;
+    // False at the end of the file, or where it is broken
+    bool next(GifFrame &frame);
+};
+
+// nullptr when giflib cannot open path, or its canvas is too large
+std::unique_ptr<GifDecoder> open_gif(const std::string &path);
+
+
+#endif //TERMIMG_GIF_LOADER_H
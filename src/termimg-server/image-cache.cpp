@@ -0,0 +1,74 @@
+#include "image-cache.h"
+
+#include <utility>
+
+
+ImageCache::ImageCache(size_t budget_bytes) : m_budget_bytes(budget_bytes) {
+}
+
+std::shared_ptr<Image> ImageCache::get(const ImageKey &key) {
+    std::lock_guard lock(m_mutex);
+    const auto it = m_index.find(key);
+    if (it == m_index.end()) {
+        ++m_stats.misses;
+        return nullptr;
+    }
+
+    ++m_stats.hits;
+    m_lru.splice(m_lru.begin(), m_lru, it->second);
+    return it->second->second;
+}
+
+void ImageCache::put(const ImageKey &key, std::shared_ptr<Image> image) {
+    const auto bytes = image->size_bytes();
+    if (bytes > m_budget_bytes) {
+        return;
+    }
+
+    // Freeing an image takes the imlib lock, so evicted images are released after unlocking
+    std::vector<std::shared_ptr<Image>> evicted;
+    std::lock_guard lock(m_mutex);
+    const auto it = m_index.find(key);
+    if (it != m_index.end()) {
+        m_stats.used_bytes -= it->second->second->size_bytes();
+        evicted.push_back(std::move(it->second->second));
+        m_lru.erase(it->second);
+        m_index.erase(it);
+    }
+
+    evict_until_fits(bytes, evicted);
+
+    m_lru.emplace_front(key, std::move(image));
+    m_index.insert({key, m_lru.begin()});
+    m_stats.used_bytes += bytes;
+    m_stats.entries = m_lru.size();
+}
+
+bool ImageCache::contains(const ImageKey &key) const {
+    std::lock_guard lock(m_mutex);
+    return m_index.count(key) > 0;
+}
+
+std::shared_ptr<Image> ImageCache::peek(const ImageKey &key) const {
+    std::lock_guard lock(m_mutex);
+    const auto it = m_index.find(key);
+    return it == m_index.end() ? nullptr : it->second->second;
+}
+
+ImageCacheStats ImageCache::stats() const {
+    std::lock_guard lock(m_mutex);
+    return m_stats;
+}
+
+void ImageCache::evict_until_fits(size_t bytes, std::vector<std::shared_ptr<Image>> &evicted) {
+    while (!m_lru.empty() && m_stats.used_bytes + bytes > m_budget_bytes) {
+        const auto &[key, image] = m_lru.back();
+        m_stats.used_bytes -= image->size_bytes();
+        evicted.push_back(image);
+        m_index.erase(key);
+        m_lru.pop_back();
+        ++m_stats.evictions;
+    }
+
+    m_stats.entries = m_lru.size();
+}
@@ -0,0 +1,53 @@
+#ifndef TERMIMG_IMAGE_CACHE_H
+#define TERMIMG_IMAGE_CACHE_H
+
+#include <list>
+#include <map>
+#include <memory>
+#include <utility>
+#include <mutex>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "image.h"
+
+
+struct ImageCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t used_bytes = 0;
+    size_t entries = 0;
+};
+
+// Thread safe LRU cache of decoded originals and scaled images bounded by a memory budget
+class ImageCache {
+private:
+    using Entry = std::pair<ImageKey, std::shared_ptr<Image>>;
+
+    const size_t m_budget_bytes;
+    std::list<Entry> m_lru;
+    std::map<ImageKey, std::list<Entry>::iterator> m_index;
+    ImageCacheStats m_stats;
+    mutable std::mutex m_mutex;
+
+    void evict_until_fits(size_t bytes, std::vector<std::shared_ptr<Image>> &evicted);
+
+public:
+    explicit ImageCache(size_t budget_bytes);
+    ImageCache(const ImageCache&) = delete;
+
+    std::shared_ptr<Image> get(const ImageKey &key);
+    void put(const ImageKey &key, std::shared_ptr<Image> image);
+    // Does not count as a use of the entry
+    [[nodiscard]] bool contains(const ImageKey &key) const;
+    // Like get, but does not count as a use of the entry either
+    [[nodiscard]] std::shared_ptr<Image> peek(const ImageKey &key) const;
+
+    [[nodiscard]] ImageCacheStats stats() const;
+};
+
+
+#endif //TERMIMG_IMAGE_CACHE_H
@@ -0,0 +1,363 @@
+#include "image.h"
+
+#include <algorithm>
+#include <atomic>
+#include <utility>
+#include <vector>
+
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "scaler.h"
+#include "stats.h"
+#include "log.h"
+
+
+static thread_local std::function<void(std::function<void()>)> image_releaser;
+
+Image::Image(Imlib_Image image) : m_image(image) {
+    assert(m_image != nullptr);
+    std::lock_guard lock(imlib_mutex());
+    imlib_context_set_image(m_image);
+    m_width = imlib_image_get_width();
+    m_height = imlib_image_get_height();
+    m_pixels = imlib_image_get_data_for_reading_only();
+    m_has_alpha = imlib_image_has_alpha() != 0;
+}
+
+Image::Image(std::shared_ptr<void> backing, DATA32* pixels, int width, int height, bool has_alpha)
+    : m_image(nullptr), m_backing(std::move(backing)), m_pixels(pixels), m_width(width), m_height(height), m_has_alpha(has_alpha) {
+}
+
+Image::~Image() {
+    if (m_image == nullptr) {
+        return;
+    }
+
+    auto release = [image = m_image, backing = std::move(m_backing)]() {
+        std::lock_guard lock(imlib_mutex());
+        imlib_context_set_image(image);
+        imlib_free_image();
+    };
+    if (image_releaser) {
+        image_releaser(std::move(release));
+    }
+    else {
+        release();
+    }
+}
+
+Imlib_Image Image::get() const {
+    if (m_image == nullptr) {
+        m_image = imlib_create_image_using_data(m_width, m_height, m_pixels);
+        if (m_image != nullptr) {
+            imlib_context_set_image(m_image);
+            imlib_image_set_has_alpha(m_has_alpha ? 1 : 0);
+        }
+    }
+    return m_image;
+}
+
+const DATA32* Image::pixels() const {
+    return m_pixels;
+}
+
+bool Image::has_alpha() const {
+    return m_has_alpha;
+}
+
+int Image::width() const {
+    return m_width;
+}
+
+int Image::height() const {
+    return m_height;
+}
+
+size_t Image::size_bytes() const {
+    // Imlib2 always stores 32-bit ARGB
+    return static_cast<size_t>(m_width) * static_cast<size_t>(m_height) * 4;
+}
+
+ImageKey ImageKey::original() const {
+    return ImageKey{path, device, inode, file_size, mtime_sec, mtime_nsec, 0, 0};
+}
+
+std::mutex& imlib_mutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+void set_image_releaser(std::function<void(std::function<void()>)> releaser) {
+    image_releaser = std::move(releaser);
+}
+
+std::optional<ImageKey> make_image_key(const std::string &path, int max_width, int max_height) {
+    struct stat s{};
+    if (stat(path.c_str(), &s) == -1) {
+        perror("stat");
+        return std::nullopt;
+    }
+
+    return ImageKey{path, s.st_dev, s.st_ino, s.st_size, s.st_mtim.tv_sec, s.st_mtim.tv_nsec, max_width, max_height};
+}
+
+#ifdef IMLIB2_VERSION
+#if IMLIB2_VERSION >= IMLIB2_VERSION_(1, 10, 0)
+#define TERMIMG_IMLIB_LOAD_MEM
+#endif
+#endif
+
+std::shared_ptr<Image> load_image(const std::string &path, [[maybe_unused]] const MappedFile* file) {
+#ifdef TERMIMG_IMLIB_LOAD_MEM
+    if (file != nullptr) {
+        Imlib_Image image = nullptr;
+        const bool complete = file->read([&]() {
+            std::lock_guard lock(imlib_mutex());
+            // The path only picks the loader to try first
+            image = imlib_load_image_mem(path.c_str(), file->data(), file->size());
+            if (image) {
+                // Make sure the pixels are decoded before the caller drops the mapping
+                imlib_context_set_image(image);
+                imlib_image_get_data_for_reading_only();
+            }
+        });
+        if (image && complete) {
+            return std::make_shared<Image>(image);
+        }
+        if (image) {
+            TERMIMG_LOG(Warning) << "Image " << path << " shrank while it was decoded";
+            std::lock_guard lock(imlib_mutex());
+            imlib_context_set_image(image);
+            imlib_free_image();
+        }
+        // Loading by path again gets the reason it failed, or what is in the file now
+    }
+#endif
+
+    Imlib_Load_Error load_error;
+    Imlib_Image image;
+    {
+        std::lock_guard lock(imlib_mutex());
+        image = imlib_load_image_with_error_return(path.c_str(), &load_error);
+    }
+    if (!image) {
+        TERMIMG_LOG(Warning) << "Image loading failed for image " << path << ": " << get_imlib_load_error(load_error);
+        return nullptr;
+    }
+
+    return std::make_shared<Image>(image);
+}
+
+std::shared_ptr<Image> map_pixels(int fd, uint32_t width, uint32_t height, uint64_t offset, bool has_alpha) {
+    if (width == 0 || height == 0 || width > INT32_MAX / 4 || height > INT32_MAX / width) {
+        TERMIMG_LOG(Warning) << "Invalid pixel dimensions width: " << width << " height: " << height;
+        return nullptr;
+    }
+
+    struct stat s{};
+    if (fstat(fd, &s) == -1) {
+        perror("fstat");
+        return nullptr;
+    }
+
+    const auto pixels_size = static_cast<uint64_t>(width) * height * 4;
+    if (offset > static_cast<uint64_t>(s.st_size) || static_cast<uint64_t>(s.st_size) - offset < pixels_size) {
+        TERMIMG_LOG(Warning) << "Pixel buffer of " << s.st_size << " bytes is too small";
+        return nullptr;
+    }
+
+    // mmap offsets have to be page aligned
+    const auto page_size = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    const auto map_offset = offset - offset % page_size;
+    const size_t map_size = offset - map_offset + pixels_size;
+
+    // Private and writable since Imlib2 wants mutable data, the caller's pixels are never touched
+    void* mapping = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, static_cast<off_t>(map_offset));
+    if (mapping == MAP_FAILED) {
+        perror("mmap");
+        return nullptr;
+    }
+    std::shared_ptr<void> backing(mapping, [map_size](void* address) { munmap(address, map_size); });
+
+    auto* pixels = reinterpret_cast<DATA32*>(static_cast<char*>(mapping) + (offset - map_offset));
+    return std::make_shared<Image>(std::move(backing), pixels, static_cast<int>(width), static_cast<int>(height), has_alpha);
+}
+
+std::shared_ptr<Image> receive_pixels(int fd, uint32_t width, uint32_t height, uint64_t offset) {
+    const int seals = fcntl(fd, F_GET_SEALS);
+    if (seals != -1 && (seals & F_SEAL_SHRINK) != 0) {
+        return map_pixels(fd, width, height, offset);
+    }
+
+    if (width == 0 || height == 0 || width > INT32_MAX / 4 || height > INT32_MAX / width) {
+        TERMIMG_LOG(Warning) << "Invalid pixel dimensions width: " << width << " height: " << height;
+        return nullptr;
+    }
+
+    TERMIMG_LOG(Debug) << "Copying pixels of an fd that can still shrink";
+    auto pixels = std::make_shared<std::vector<uint32_t>>(static_cast<size_t>(width) * height);
+    auto* bytes = reinterpret_cast<char*>(pixels->data());
+    size_t remaining = pixels->size() * sizeof(uint32_t);
+    auto position = static_cast<off_t>(offset);
+    while (remaining > 0) {
+        const ssize_t bytes_read = pread(fd, bytes, remaining, position);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            TERMIMG_LOG(Warning) << "Pixel buffer is too small or unreadable";
+            return nullptr;
+        }
+        bytes += bytes_read;
+        remaining -= static_cast<size_t>(bytes_read);
+        position += bytes_read;
+    }
+
+    return image_from_pixels(std::move(pixels), static_cast<int>(width), static_cast<int>(height), true);
+}
+
+std::shared_ptr<Image> image_from_pixels(std::shared_ptr<std::vector<uint32_t>> pixels, int width, int height, bool has_alpha) {
+    DATA32* data = pixels->data();
+    return std::make_shared<Image>(std::move(pixels), data, width, height, has_alpha);
+}
+
+static Scaler configured_scaler = Scaler::Auto;
+static BoxKernel configured_box_kernel = BoxKernel::Scalar;
+static unsigned int configured_scaler_threads = 1;
+// Box scales running right now, on any worker
+static std::atomic<unsigned int> active_box_scales = 0;
+
+void configure_scaler(Scaler scaler, unsigned int thread_count) {
+    configured_scaler = scaler;
+    configured_box_kernel = detect_box_kernel();
+    configured_scaler_threads = std::max(1u, thread_count);
+    TERMIMG_LOG(Info) << "Box scaler kernel: " << box_kernel_to_string(configured_box_kernel)
+                      << " threads: " << configured_scaler_threads;
+}
+
+static bool use_box_scaler(int img_width, int img_height, int width, int height) {
+    if (configured_scaler == Scaler::Imlib || !can_box_downscale(img_width, img_height, width, height)) {
+        return false;
+    }
+
+    return configured_scaler == Scaler::Box
+        || (img_width >= width * box_min_ratio && img_height >= height * box_min_ratio);
+}
+
+static std::shared_ptr<Image> box_scale_image(const Image &image, int src_x, int src_y, int src_width, int src_height, int width, int height) {
+    const DATA32* pixels = image.pixels();
+
+    // Scales running at once, such as the cells of a grid, split the threads between them
+    // rather than each starting all of them and oversubscribing the cores
+    const unsigned int concurrent_scales = ++active_box_scales;
+    const unsigned int thread_count = std::max(1u, configured_scaler_threads / concurrent_scales);
+
+    // Only this image's pixels are read, so it needs no imlib_mutex
+    auto scaled_pixels = std::make_shared<std::vector<uint32_t>>(static_cast<size_t>(width) * static_cast<size_t>(height));
+    const auto stride = static_cast<size_t>(image.width());
+    box_downscale(pixels + static_cast<size_t>(src_y) * stride + static_cast<size_t>(src_x), src_width, src_height, stride,
+                  scaled_pixels->data(), width, height,
+                  configured_box_kernel, thread_count);
+    --active_box_scales;
+
+    return image_from_pixels(std::move(scaled_pixels), width, height, image.has_alpha());
+}
+
+// Cropping without scaling only copies rows, which needs neither Imlib2 nor its lock
+static std::shared_ptr<Image> crop_image(const Image &image, int src_x, int src_y, int width, int height) {
+    auto cropped_pixels = std::make_shared<std::vector<uint32_t>>(static_cast<size_t>(width) * static_cast<size_t>(height));
+    const auto stride = static_cast<size_t>(image.width());
+    for (int row = 0; row < height; ++row) {
+        const DATA32* source = image.pixels() + static_cast<size_t>(src_y + row) * stride + static_cast<size_t>(src_x);
+        std::copy(source, source + width, cropped_pixels->data() + static_cast<size_t>(row) * static_cast<size_t>(width));
+    }
+
+    return image_from_pixels(std::move(cropped_pixels), width, height, image.has_alpha());
+}
+
+static std::shared_ptr<Image> imlib_scale_image(const Image &image, int src_x, int src_y, int src_width, int src_height, int width, int height) {
+    Imlib_Image scaled;
+    {
+        std::lock_guard lock(imlib_mutex());
+        const Imlib_Image source = image.get();
+        if (source) {
+            imlib_context_set_image(source);
+            scaled = imlib_create_cropped_scaled_image(src_x, src_y, src_width, src_height, width, height);
+        }
+        else {
+            scaled = nullptr;
+        }
+    }
+    if (!scaled) {
+        TERMIMG_LOG(Warning) << "Could not scale image to width: " << width << " height: " << height;
+        return nullptr;
+    }
+
+    return std::make_shared<Image>(scaled);
+}
+
+std::pair<int, int> fit_size(int img_width, int img_height, int max_width, int max_height) {
+    const float aspect_ratio = static_cast<float>(img_width) / static_cast<float>(img_height);
+    const float aspect_ratio_inverse = 1.0f / aspect_ratio;
+
+    const int raw_width = std::min(img_width, max_width);
+    const int raw_height = std::min(img_height, max_height);
+
+    const int aspect_corrected_width = std::min(raw_width, static_cast<int>(static_cast<float>(raw_height) * aspect_ratio));
+    const int aspect_corrected_height = std::min(raw_height, static_cast<int>(static_cast<float>(raw_width) * aspect_ratio_inverse));
+
+    return {aspect_corrected_width, aspect_corrected_height};
+}
+
+std::shared_ptr<Image> scale_image(const Image &image, int max_width, int max_height) {
+    const auto [aspect_corrected_width, aspect_corrected_height] = fit_size(image.width(), image.height(), max_width, max_height);
+    return crop_scale_image(image, 0, 0, image.width(), image.height(), aspect_corrected_width, aspect_corrected_height);
+}
+
+std::shared_ptr<Image> crop_scale_image(const Image &image, int src_x, int src_y, int src_width, int src_height, int width, int height) {
+    const StageTimer timer(Stage::Scale);
+
+    if (src_width == width && src_height == height) {
+        return crop_image(image, src_x, src_y, width, height);
+    }
+
+    if (use_box_scaler(src_width, src_height, width, height)) {
+        return box_scale_image(image, src_x, src_y, src_width, src_height, width, height);
+    }
+
+    return imlib_scale_image(image, src_x, src_y, src_width, src_height, width, height);
+}
+
+std::shared_ptr<Image> resize_image(const Image &image, int width, int height) {
+    return imlib_scale_image(image, 0, 0, image.width(), image.height(), width, height);
+}
+
+const char* get_imlib_load_error(Imlib_Load_Error load_error) {
+    switch (load_error) {
+        case IMLIB_LOAD_ERROR_NONE: return "Error none";
+        case IMLIB_LOAD_ERROR_FILE_DOES_NOT_EXIST: return "File does not exist";
+        case IMLIB_LOAD_ERROR_FILE_IS_DIRECTORY: return "File is directory";
+        case IMLIB_LOAD_ERROR_PERMISSION_DENIED_TO_READ: return "Permission denied to read";
+        case IMLIB_LOAD_ERROR_NO_LOADER_FOR_FILE_FORMAT: return "No loader for file for file format";
+        case IMLIB_LOAD_ERROR_PATH_TOO_LONG: return "Path too long";
+        case IMLIB_LOAD_ERROR_PATH_COMPONENT_NON_EXISTANT: return "Path component non existant";
+        case IMLIB_LOAD_ERROR_PATH_COMPONENT_NOT_DIRECTORY: return "Path component not directory";
+        case IMLIB_LOAD_ERROR_PATH_POINTS_OUTSIDE_ADDRESS_SPACE: return "Path points outside address space";
+        case IMLIB_LOAD_ERROR_TOO_MANY_SYMBOLIC_LINKS: return "Too many symbolic links";
+        case IMLIB_LOAD_ERROR_OUT_OF_MEMORY: return "Out of memory";
+        case IMLIB_LOAD_ERROR_OUT_OF_FILE_DESCRIPTORS: return "Out of file descriptors";
+        case IMLIB_LOAD_ERROR_PERMISSION_DENIED_TO_WRITE: return "Permission denied to write";
+        case IMLIB_LOAD_ERROR_OUT_OF_DISK_SPACE: return "Out of disk space";
+        case IMLIB_LOAD_ERROR_UNKNOWN: return "Unknown error";
+        case IMLIB_LOAD_ERROR_IMAGE_READ: return "Image read";
+        case IMLIB_LOAD_ERROR_IMAGE_FRAME: return "Image frame";
+        default: return "WTF!";
+    }
+}
@@ -0,0 +1,98 @@
+#ifndef TERMIMG_IMAGE_H
+#define TERMIMG_IMAGE_H
+
+#include <string>
+#include <memory>
+#include <optional>
+#include <compare>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/types.h>
+#include <Imlib2.h>
+
+#include "scaler.h"
+#include "mapped-file.h"
+
+
+// 32-bit ARGB pixels. Images decoded or scaled by Imlib2 wrap an Imlib2 image, the others are only
+// pixels. The pixels, size and alpha are read once when it is created, so using them needs no lock.
+class Image {
+private:
+    // Created on demand for images that are only pixels
+    mutable Imlib_Image m_image;
+    // Keeps pixel data alive for images that are only pixels
+    std::shared_ptr<void> m_backing;
+    DATA32* m_pixels;
+    int m_width;
+    int m_height;
+    bool m_has_alpha;
+
+public:
+    explicit Image(Imlib_Image image);
+    Image(std::shared_ptr<void> backing, DATA32* pixels, int width, int height, bool has_alpha);
+    Image(const Image&) = delete;
+    Image(Image&&) = delete;
+    ~Image();
+
+    // For imlib_ calls, with imlib_mutex held. nullptr when no Imlib2 image could be made for the pixels.
+    [[nodiscard]] Imlib_Image get() const;
+    [[nodiscard]] const DATA32* pixels() const;
+    [[nodiscard]] bool has_alpha() const;
+    [[nodiscard]] int width() const;
+    [[nodiscard]] int height() const;
+    [[nodiscard]] size_t size_bytes() const;
+};
+
+struct ImageKey {
+    std::string path;
+    dev_t device;
+    ino_t inode;
+    off_t file_size;
+    time_t mtime_sec;
+    long mtime_nsec;
+    // 0x0 identifies the decoded original
+    int max_width;
+    int max_height;
+
+    [[nodiscard]] ImageKey original() const;
+
+    auto operator<=>(const ImageKey&) const = default;
+};
+
+// Imlib2 keeps its context in global state, every imlib_ call has to hold this
+std::mutex& imlib_mutex();
+// Images with an Imlib2 image that are destroyed on the calling thread are freed by running the
+// function given to releaser, such as on a worker, since freeing one waits for imlib_mutex.
+// Only applies to the calling thread, nullptr frees them right away again.
+void set_image_releaser(std::function<void(std::function<void()>)> releaser);
+
+std::optional<ImageKey> make_image_key(const std::string &path, int max_width, int max_height);
+
+// Decodes from file when it is given and Imlib2 can load from memory, from path otherwise
+std::shared_ptr<Image> load_image(const std::string &path, const MappedFile* file = nullptr);
+// Maps width * height 32-bit ARGB pixels starting at offset in fd, without copying them
+std::shared_ptr<Image> map_pixels(int fd, uint32_t width, uint32_t height, uint64_t offset, bool has_alpha = true);
+// Like map_pixels for an fd a client sent. Unless it is sealed against shrinking the pixels are
+// copied, since a client truncating a mapped fd would kill the server with SIGBUS.
+std::shared_ptr<Image> receive_pixels(int fd, uint32_t width, uint32_t height, uint64_t offset);
+// Wraps width * height 32-bit ARGB pixels without copying them
+std::shared_ptr<Image> image_from_pixels(std::shared_ptr<std::vector<uint32_t>> pixels, int width, int height, bool has_alpha);
+void configure_scaler(Scaler scaler, unsigned int thread_count);
+// The largest size within max_width x max_height that keeps the aspect ratio and never upscales
+std::pair<int, int> fit_size(int img_width, int img_height, int max_width, int max_height);
+std::shared_ptr<Image> scale_image(const Image &image, int max_width, int max_height);
+// Scales only the src_width x src_height part at src_x, src_y to width x height
+std::shared_ptr<Image> crop_scale_image(const Image &image, int src_x, int src_y, int src_width, int src_height, int width, int height);
+// Scales to exactly width x height with Imlib2, upscaling too
+std::shared_ptr<Image> resize_image(const Image &image, int width, int height);
+
+const char* get_imlib_load_error(Imlib_Load_Error load_error);
+
+
+#endif //TERMIMG_IMAGE_H
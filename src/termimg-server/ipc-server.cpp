@@ -6,8 +6,11 @@
 
 #include <string>
 #include <string_view>
-#include <iostream>
+#include <vector>
+#include <chrono>
+#include <optional>
 
+#include <cerrno>
 #include <cstring>
 #include <cstdlib>
 
@@ -16,10 +19,12 @@
 #include <sys/un.h>
 
 #include "epoll.h"
+#include "stats.h"
+#include "log.h"
 
 IPCServer::IPCServer(std::string path, Epoll &epoll) : m_path(std::move(path)), m_epoll(epoll) {
-    std::cerr << m_path << std::endl;
-    m_fd_socket = socket(AF_UNIX, SOCK_DGRAM, 0);
+    TERMIMG_LOG(Debug) << m_path;
+    m_fd_socket = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0);
     if (m_fd_socket < 0) {
         perror("socket");
         throw 1;
@@ -28,7 +33,7 @@ IPCServer::IPCServer(std::string path, Epoll &epoll) : m_path(std::move(path)),
     sockaddr_un socket_address{};
     socket_address.sun_family = AF_UNIX;
     strncpy(socket_address.sun_path, m_path.c_str(), sizeof(socket_address.sun_path));
-    std::cerr << socket_address.sun_path << std::endl;
+    TERMIMG_LOG(Debug) << socket_address.sun_path;
 
     if (bind(m_fd_socket, reinterpret_cast<sockaddr*>(&socket_address), sizeof(socket_address)) != 0)
     {
@@ -36,18 +41,64 @@ IPCServer::IPCServer(std::string path, Epoll &epoll) : m_path(std::move(path)),
         throw 1;
     }
     epoll.register_fd(m_fd_socket, [this]() {
-        std::cerr << "IPC event" << std::endl;
-        char buf[256];
-        ssize_t bytes_read = read(m_fd_socket, buf, sizeof(buf) - 1);
-        if (bytes_read < 0) {
-            perror("read");
-            throw 1;
-        }
+        TERMIMG_LOG(Debug) << "IPC event";
+        std::vector<IPCMessage> messages;
+        std::optional<StageTimer> receive_timer(Stage::Receive);
+        while (true) {
+            // Peek with MSG_TRUNC to learn the size of the datagram, so nothing gets truncated
+            const ssize_t datagram_size = recv(m_fd_socket, nullptr, 0, MSG_PEEK | MSG_TRUNC);
+            if (datagram_size < 0) {
+                if (errno == EAGAIN) {
+                    break;
+                }
+                perror("recv");
+                throw 1;
+            }
+
+            IPCMessage message;
+            message.data.resize(static_cast<size_t>(datagram_size));
+
+            iovec io_vector{message.data.data(), message.data.size()};
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * max_fds)];
+            msghdr message_header{};
+            message_header.msg_name = &message.sender.address;
+            message_header.msg_namelen = sizeof(message.sender.address);
+            message_header.msg_iov = &io_vector;
+            message_header.msg_iovlen = 1;
+            message_header.msg_control = control;
+            message_header.msg_controllen = sizeof(control);
+
+            const ssize_t bytes_read = recvmsg(m_fd_socket, &message_header, MSG_CMSG_CLOEXEC);
+            if (bytes_read < 0) {
+                perror("recvmsg");
+                throw 1;
+            }
+            message.sender.length = message_header.msg_namelen;
+
+            for (cmsghdr* control_message = CMSG_FIRSTHDR(&message_header); control_message != nullptr; control_message = CMSG_NXTHDR(&message_header, control_message)) {
+                if (control_message->cmsg_level != SOL_SOCKET || control_message->cmsg_type != SCM_RIGHTS) {
+                    continue;
+                }
+
+                const size_t fd_count = (control_message->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                for (size_t i = 0; i < fd_count; ++i) {
+                    int fd;
+                    std::memcpy(&fd, CMSG_DATA(control_message) + i * sizeof(int), sizeof(fd));
+                    message.fds.push_back(std::make_shared<FileDescriptor>(fd));
+                }
+            }
 
-        // Protect from read out of bounds data
-        buf[bytes_read + 1] = 0;
+            if (message_header.msg_flags & MSG_CTRUNC) {
+                TERMIMG_LOG(Warning) << "Too many file descriptors in datagram, some were dropped";
+            }
 
-        m_message_handler(std::string_view(buf, static_cast<size_t>(bytes_read)));
+            message.data.resize(static_cast<size_t>(bytes_read));
+            message.received_at = std::chrono::steady_clock::now();
+            messages.push_back(std::move(message));
+        }
+
+        receive_timer.reset();
+        m_messages_handler(std::move(messages));
     });
 }
 
@@ -57,6 +108,33 @@ IPCServer::~IPCServer() {
     unlink(m_path.c_str());
 }
 
-void IPCServer::register_on_message_handler(std::function<void(const std::string_view)> message_handler) {
-    m_message_handler = message_handler;
+void IPCServer::register_on_messages_handler(std::function<void(std::vector<IPCMessage>)> messages_handler) {
+    m_messages_handler = messages_handler;
+}
+
+void IPCServer::send_to(const IPCAddress &address, std::string_view data) const {
+    if (!address.can_reply()) {
+        return;
+    }
+
+    // Replies are best effort, a client that stopped listening must not stall the loop
+    if (sendto(m_fd_socket, data.data(), data.size(), MSG_DONTWAIT,
+               reinterpret_cast<const sockaddr*>(&address.address), address.length) < 0) {
+        perror("sendto");
+    }
+}
+
+FileDescriptor::FileDescriptor(int fd) : m_fd(fd) {
+}
+
+FileDescriptor::~FileDescriptor() {
+    close(m_fd);
+}
+
+int FileDescriptor::get() const {
+    return m_fd;
+}
+
+bool IPCAddress::can_reply() const {
+    return length > sizeof(sa_family_t);
 }
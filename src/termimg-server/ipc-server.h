@@ -6,11 +6,46 @@
 #define TERMIMG_IPC_SERVER_H
 
 #include <string>
+#include <string_view>
+#include <vector>
+#include <chrono>
+#include <memory>
 #include <functional>
 
+#include <sys/socket.h>
+#include <sys/un.h>
+
 #include "epoll.h"
 
 
+struct IPCAddress {
+    sockaddr_un address{};
+    socklen_t length = 0;
+
+    // Unbound senders cannot be replied to
+    [[nodiscard]] bool can_reply() const;
+};
+
+// Owns a file descriptor received with SCM_RIGHTS
+class FileDescriptor {
+private:
+    const int m_fd;
+
+public:
+    explicit FileDescriptor(int fd);
+    FileDescriptor(const FileDescriptor&) = delete;
+    ~FileDescriptor();
+
+    [[nodiscard]] int get() const;
+};
+
+struct IPCMessage {
+    std::string data;
+    std::vector<std::shared_ptr<FileDescriptor>> fds;
+    IPCAddress sender;
+    std::chrono::steady_clock::time_point received_at;
+};
+
 class IPCServer {
 private:
     int m_fd_socket;
@@ -18,7 +53,10 @@ private:
 
     Epoll &m_epoll;
 
-    std::function<void(const std::string_view)> m_message_handler;
+    // The kernel limit for SCM_RIGHTS
+    constexpr static size_t max_fds = 253;
+
+    std::function<void(std::vector<IPCMessage>)> m_messages_handler;
 
 
 public:
@@ -26,7 +64,10 @@ public:
     IPCServer(const IPCServer&) = delete;
     ~IPCServer();
 
-    void register_on_message_handler(std::function<void(const std::string_view)> message_handler);
+    // Called once per readiness event with every datagram that was pending on the socket
+    void register_on_messages_handler(std::function<void(std::vector<IPCMessage>)> messages_handler);
+
+    void send_to(const IPCAddress &address, std::string_view data) const;
 
 };
 
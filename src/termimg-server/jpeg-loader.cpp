@@ -0,0 +1,265 @@
+#include "jpeg-loader.h"
+
+#include <vector>
+#include <optional>
+#include <algorithm>
+#include <utility>
+#include <cmath>
+
+#include <cstdio>
+#include <cstdint>
+#include <csetjmp>
+
+#include <jpeglib.h>
+
+#include "log.h"
+
+
+// Previews only pay off when the full decode takes a while
+constexpr uint64_t preview_min_pixels = 2 * 1024 * 1024;
+// APP1 segments are at most 64 KiB, and the EXIF one comes right after SOI or JFIF
+constexpr size_t exif_search_bytes = 128 * 1024;
+
+enum class JpegScale {
+    // The smallest DCT scale still covering the target
+    Cover,
+    // 1/8, whatever the target
+    Smallest,
+    // Only read the header for the size
+    HeaderOnly,
+};
+
+struct JpegErrorManager {
+    jpeg_error_mgr manager;
+    std::jmp_buf jump_buffer;
+};
+
+static void jpeg_error_exit(j_common_ptr info) {
+    auto* error_manager = reinterpret_cast<JpegErrorManager*>(info->err);
+    char message[JMSG_LENGTH_MAX];
+    (*info->err->format_message)(info, message);
+    TERMIMG_LOG(Warning) << "libjpeg: " << message;
+    std::longjmp(error_manager->jump_buffer, 1);
+}
+
+static void jpeg_output_message(j_common_ptr) {
+    // Warnings about corrupt data are not worth a line per image
+}
+
+bool is_jpeg(const MappedFile &file) {
+    bool jpeg = false;
+    const bool complete = file.read([&]() {
+        const unsigned char* magic = file.data();
+        jpeg = file.size() >= 3 && magic[0] == 0xff && magic[1] == 0xd8 && magic[2] == 0xff;
+    });
+    return complete && jpeg;
+}
+
+static unsigned int choose_scale_denominator(unsigned int width, unsigned int height, int max_width, int max_height) {
+    const auto [target_width, target_height] = fit_size(static_cast<int>(width), static_cast<int>(height), max_width, max_height);
+
+    for (unsigned int denominator : {8u, 4u, 2u}) {
+        const auto scaled_width = static_cast<int>((width + denominator - 1) / denominator);
+        const auto scaled_height = static_cast<int>((height + denominator - 1) / denominator);
+        if (scaled_width >= target_width && scaled_height >= target_height) {
+            return denominator;
+        }
+    }
+
+    return 1;
+}
+
+static JpegImage decode_jpeg(const unsigned char* data, size_t size, int max_width, int max_height, JpegScale scale) {
+    jpeg_decompress_struct info{};
+    JpegErrorManager error_manager{};
+    info.err = jpeg_std_error(&error_manager.manager);
+    error_manager.manager.error_exit = jpeg_error_exit;
+    error_manager.manager.output_message = jpeg_output_message;
+
+    // Declared before setjmp so nothing with a destructor is skipped by the longjmp
+    auto pixels = std::make_shared<std::vector<uint32_t>>();
+    JSAMPROW row_pointer = nullptr;
+    JpegImage result{nullptr, 1, 0, 0};
+
+    if (setjmp(error_manager.jump_buffer)) {
+        jpeg_destroy_decompress(&info);
+        return {nullptr, 1, 0, 0};
+    }
+
+    jpeg_create_decompress(&info);
+    jpeg_mem_src(&info, data, size);
+    jpeg_read_header(&info, TRUE);
+
+    result.full_width = static_cast<int>(info.image_width);
+    result.full_height = static_cast<int>(info.image_height);
+
+    // libjpeg cannot convert these to RGB, Imlib2 can
+    if (scale == JpegScale::HeaderOnly || info.jpeg_color_space == JCS_CMYK || info.jpeg_color_space == JCS_YCCK) {
+        jpeg_destroy_decompress(&info);
+        return result;
+    }
+
+    result.scale_denominator = scale == JpegScale::Smallest
+        ? 8
+        : choose_scale_denominator(info.image_width, info.image_height, max_width, max_height);
+    info.scale_num = 1;
+    info.scale_denom = result.scale_denominator;
+    // In memory B, G, R, A is native endian ARGB, the layout Imlib2 uses
+    info.out_color_space = JCS_EXT_BGRA;
+    info.dct_method = scale == JpegScale::Smallest ? JDCT_IFAST : JDCT_ISLOW;
+
+    jpeg_start_decompress(&info);
+
+    const auto width = info.output_width;
+    const auto height = info.output_height;
+    pixels->resize(static_cast<size_t>(width) * height);
+    while (info.output_scanline < height) {
+        row_pointer = reinterpret_cast<JSAMPROW>(pixels->data() + static_cast<size_t>(info.output_scanline) * width);
+        jpeg_read_scanlines(&info, &row_pointer, 1);
+    }
+
+    jpeg_finish_decompress(&info);
+    jpeg_destroy_decompress(&info);
+
+    TERMIMG_LOG(Debug) << "Decoded JPEG at 1/" << result.scale_denominator << " width: " << width << " height: " << height;
+
+    result.image = image_from_pixels(std::move(pixels), static_cast<int>(width), static_cast<int>(height), false);
+    return result;
+}
+
+JpegImage load_jpeg_scaled(const MappedFile &file, int max_width, int max_height) {
+    JpegImage jpeg{nullptr, 1, 0, 0};
+    if (!file.read([&]() { jpeg = decode_jpeg(file.data(), file.size(), max_width, max_height, JpegScale::Cover); })) {
+        TERMIMG_LOG(Warning) << "JPEG shrank while it was decoded";
+        return {nullptr, 1, 0, 0};
+    }
+    return jpeg;
+}
+
+struct ByteRange {
+    const unsigned char* data;
+    size_t size;
+};
+
+// Finds the JPEG thumbnail that IFD1 of an EXIF APP1 segment points to
+static std::optional<ByteRange> find_exif_thumbnail(ByteRange prefix) {
+    size_t position = 2;
+    while (position + 4 <= prefix.size && prefix.data[position] == 0xff) {
+        const unsigned char marker = prefix.data[position + 1];
+        const size_t segment_size = static_cast<size_t>(prefix.data[position + 2]) << 8 | prefix.data[position + 3];
+        // Image data starts after SOS, there is no EXIF after that
+        if (marker == 0xda || segment_size < 2) {
+            return std::nullopt;
+        }
+
+        const size_t segment_start = position + 4;
+        const size_t segment_end = position + 2 + segment_size;
+        if (marker == 0xe1 && segment_end <= prefix.size && segment_size >= 2 + 6 + 8
+            && std::equal(prefix.data + segment_start, prefix.data + segment_start + 6, "Exif\0\0")) {
+            const unsigned char* tiff = prefix.data + segment_start + 6;
+            const size_t tiff_size = segment_end - segment_start - 6;
+            const bool little_endian = tiff[0] == 'I';
+
+            auto read16 = [&](size_t offset) -> uint32_t {
+                return little_endian ? (tiff[offset] | static_cast<uint32_t>(tiff[offset + 1]) << 8)
+                                     : (static_cast<uint32_t>(tiff[offset]) << 8 | tiff[offset + 1]);
+            };
+            auto read32 = [&](size_t offset) -> uint32_t {
+                return little_endian ? (read16(offset) | read16(offset + 2) << 16)
+                                     : (read16(offset) << 16 | read16(offset + 2));
+            };
+
+            if (read16(2) != 42) {
+                return std::nullopt;
+            }
+
+            const size_t ifd0 = read32(4);
+            if (ifd0 + 2 > tiff_size) {
+                return std::nullopt;
+            }
+            const size_t ifd0_entries = read16(ifd0);
+            const size_t next_ifd_offset = ifd0 + 2 + 12 * ifd0_entries;
+            if (next_ifd_offset + 4 > tiff_size) {
+                return std::nullopt;
+            }
+
+            const size_t ifd1 = read32(next_ifd_offset);
+            if (ifd1 == 0 || ifd1 + 2 > tiff_size) {
+                return std::nullopt;
+            }
+
+            size_t thumbnail_offset = 0;
+            size_t thumbnail_size = 0;
+            const size_t ifd1_entries = read16(ifd1);
+            for (size_t i = 0; i < ifd1_entries && ifd1 + 2 + 12 * (i + 1) <= tiff_size; ++i) {
+                const size_t entry = ifd1 + 2 + 12 * i;
+                const auto tag = read16(entry);
+                if (tag == 0x0201) {
+                    thumbnail_offset = read32(entry + 8);
+                }
+                else if (tag == 0x0202) {
+                    thumbnail_size = read32(entry + 8);
+                }
+            }
+
+            if (thumbnail_size == 0 || thumbnail_offset + thumbnail_size > tiff_size) {
+                return std::nullopt;
+            }
+            return ByteRange{tiff + thumbnail_offset, thumbnail_size};
+        }
+
+        position = segment_end;
+    }
+
+    return std::nullopt;
+}
+
+static std::shared_ptr<Image> decode_jpeg_preview(const MappedFile &file, int max_width, int max_height) {
+    const auto header = decode_jpeg(file.data(), file.size(), max_width, max_height, JpegScale::HeaderOnly);
+    const auto full_width = static_cast<unsigned int>(header.full_width);
+    const auto full_height = static_cast<unsigned int>(header.full_height);
+    if (static_cast<uint64_t>(full_width) * full_height < preview_min_pixels
+        || choose_scale_denominator(full_width, full_height, max_width, max_height) == 8) {
+        // The full decode is about as cheap as a preview
+        return nullptr;
+    }
+
+    const auto [width, height] = fit_size(header.full_width, header.full_height, max_width, max_height);
+
+    std::shared_ptr<Image> preview;
+    const auto thumbnail = find_exif_thumbnail({file.data(), std::min(file.size(), exif_search_bytes)});
+    if (thumbnail.has_value()) {
+        auto decoded = decode_jpeg(thumbnail->data, thumbnail->size, width, height, JpegScale::Cover);
+        // Letterboxed thumbnails would show bars that the final image does not have
+        const double full_aspect = static_cast<double>(full_width) / full_height;
+        if (decoded.image && std::abs(static_cast<double>(decoded.image->width()) / decoded.image->height() - full_aspect) < 0.05 * full_aspect) {
+            TERMIMG_LOG(Debug) << "Using EXIF thumbnail as preview";
+            preview = std::move(decoded.image);
+        }
+    }
+
+    if (!preview) {
+        preview = decode_jpeg(file.data(), file.size(), max_width, max_height, JpegScale::Smallest).image;
+    }
+
+    if (!preview) {
+        return nullptr;
+    }
+
+    // Shown at the final size, so the placement does not change size when the final image replaces it
+    return resize_image(*preview, width, height);
+}
+
+std::shared_ptr<Image> load_jpeg_preview(const std::string &path, int max_width, int max_height) {
+    const auto file = map_file(path);
+    if (!file || !is_jpeg(*file)) {
+        return nullptr;
+    }
+
+    // Skipping the preview is fine, the final decode reads by path if the file keeps shrinking
+    std::shared_ptr<Image> preview;
+    if (!file->read([&]() { preview = decode_jpeg_preview(*file, max_width, max_height); })) {
+        return nullptr;
+    }
+    return preview;
+}
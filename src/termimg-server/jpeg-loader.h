@@ -0,0 +1,30 @@
+#ifndef TERMIMG_JPEG_LOADER_H
+#define TERMIMG_JPEG_LOADER_H
+
+#include <string>
+#include <memory>
+
+#include "image.h"
+#include "mapped-file.h"
+
+
+struct JpegImage {
+    std::shared_ptr<Image> image;
+    // The image was decoded at 1 / scale_denominator of its size
+    unsigned int scale_denominator;
+    int full_width;
+    int full_height;
+};
+
+bool is_jpeg(const MappedFile &file);
+
+// Decodes a JPEG with libjpeg's DCT scaling at the smallest of 1/1, 1/2, 1/4 and 1/8
+// that still covers what scale_image would produce for max_width x max_height.
+// Returns a null image when the file cannot be handled here, so Imlib2 can take over.
+JpegImage load_jpeg_scaled(const MappedFile &file, int max_width, int max_height);
+// A cheap stand in at the final size, from the EXIF thumbnail or a 1/8 decode. Returns nullptr
+// for anything but large JPEGs, where the full decode is not much slower than the preview.
+std::shared_ptr<Image> load_jpeg_preview(const std::string &path, int max_width, int max_height);
+
+
+#endif //TERMIMG_JPEG_LOADER_H
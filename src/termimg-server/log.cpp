@@ -0,0 +1,61 @@
+#include "log.h"
+
+#include <string>
+#include <mutex>
+#include <atomic>
+
+#include <unistd.h>
+
+
+static std::atomic<LogLevel> configured_level = LogLevel::Info;
+static std::mutex log_mutex;
+static std::string log_buffer;
+
+// Written out early so a burst of debug lines does not pile up
+constexpr size_t log_buffer_limit = 64 * 1024;
+
+static void write_buffer() {
+    size_t written = 0;
+    while (written < log_buffer.size()) {
+        const ssize_t result = write(STDERR_FILENO, log_buffer.data() + written, log_buffer.size() - written);
+        if (result <= 0) {
+            break;
+        }
+        written += static_cast<size_t>(result);
+    }
+    log_buffer.clear();
+}
+
+std::optional<LogLevel> log_level_from_string(std::string_view name) {
+    if (name == "error") return LogLevel::Error;
+    if (name == "warning") return LogLevel::Warning;
+    if (name == "info") return LogLevel::Info;
+    if (name == "debug") return LogLevel::Debug;
+    return std::nullopt;
+}
+
+void configure_log(LogLevel level) {
+    configured_level = level;
+}
+
+bool log_enabled(LogLevel level) {
+    return level <= configured_level.load(std::memory_order_relaxed);
+}
+
+void flush_log() {
+    std::lock_guard lock(log_mutex);
+    write_buffer();
+}
+
+LogLine::LogLine(LogLevel level) : m_level(level) {
+}
+
+LogLine::~LogLine() {
+    m_stream << '\n';
+
+    std::lock_guard lock(log_mutex);
+    log_buffer += m_stream.view();
+    if (m_level == LogLevel::Error || log_buffer.size() >= log_buffer_limit) {
+        write_buffer();
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef TERMIMG_LOG_H
+#define TERMIMG_LOG_H
+
+#include <sstream>
+#include <optional>
+#include <string_view>
+
+
+enum class LogLevel {
+    Error,
+    Warning,
+    Info,
+    Debug,
+};
+
+std::optional<LogLevel> log_level_from_string(std::string_view name);
+void configure_log(LogLevel level);
+[[nodiscard]] bool log_enabled(LogLevel level);
+// Writes out everything buffered, the epoll loop does this once per wakeup
+void flush_log();
+
+// Formats one line and buffers it on destruction. Errors are written out right away.
+class LogLine {
+private:
+    const LogLevel m_level;
+    std::ostringstream m_stream;
+
+public:
+    explicit LogLine(LogLevel level);
+    LogLine(const LogLine&) = delete;
+    ~LogLine();
+
+    template<typename T>
+    LogLine& operator<<(const T &value) {
+        m_stream << value;
+        return *this;
+    }
+};
+
+// The operands are not evaluated when the level is disabled
+#define TERMIMG_LOG(level) if (!log_enabled(LogLevel::level)) {} else LogLine(LogLevel::level)
+
+
+#endif //TERMIMG_LOG_H
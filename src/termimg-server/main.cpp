@@ -1,13 +1,23 @@
 #include <iostream>
 #include <vector>
 #include <map>
+#include <set>
+#include <string>
 #include <string_view>
+#include <optional>
 #include <charconv>
-#include <sstream>
 #include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <algorithm>
+#include <chrono>
 
 #include <cassert>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 
 #include <X11/Xlib.h>
 #include <Imlib2.h>
@@ -19,6 +29,23 @@
 #include "term.h"
 #include "epoll.h"
 #include "ipc-server.h"
+#include "image.h"
+#include "image-cache.h"
+#include "disk-cache.h"
+#include "animation.h"
+#include "jpeg-loader.h"
+#include "pixmap-cache.h"
+#include "placements.h"
+#include "viewport.h"
+#include "tiles.h"
+#include "terminals.h"
+#include "worker-pool.h"
+#include "coalesce.h"
+#include "renderer.h"
+#include "scaler.h"
+#include "protocol.h"
+#include "log.h"
+#include "stats.h"
 
 const char* signal_to_string(uint32_t signal){
     switch(signal) {
@@ -32,237 +59,1210 @@ const char* signal_to_string(uint32_t signal){
 
 void print_usage(const char* argv0) {
     std::cerr << "USAGE: " << argv0 << ": <parent_pid>" << std::endl;
+    std::cerr << "       " << argv0 << ": --daemon" << std::endl;
+    std::cerr << "A daemon serves every terminal its clients name, and has no terminal of its own" << std::endl;
 }
-std::vector<std::string_view> split (const std::string_view s, const std::string_view delimiter) {
-    size_t pos_start = 0, pos_end, delim_len = delimiter.length();
-    std::string_view token;
-    std::vector<std::string_view> res;
-
-    while ((pos_end = s.find (delimiter, pos_start)) != std::string_view::npos) {
-        token = s.substr (pos_start, pos_end - pos_start);
-        pos_start = pos_end + delim_len;
-        res.push_back (token);
+
+// Set from the X error handler, which cannot call back into Xlib itself
+bool x_alloc_failed = false;
+
+int handle_x_error(Display* display, XErrorEvent* error_event) {
+    char error_text[256];
+    XGetErrorText(display, error_event->error_code, error_text, sizeof(error_text));
+    TERMIMG_LOG(Error) << "X error: " << error_text;
+
+    if (error_event->error_code == BadAlloc) {
+        x_alloc_failed = true;
+    }
+
+    return 0;
+}
+
+struct Request {
+    RequestHeader header;
+    std::string payload;
+    std::vector<std::shared_ptr<FileDescriptor>> fds;
+    IPCAddress sender;
+    std::chrono::steady_clock::time_point received_at;
+    // None when the terminal the request is for could not be found
+    Window terminal_window;
+};
+
+struct PixelGeometry {
+    int x;
+    int y;
+    int max_width;
+    int max_height;
+};
+
+using TimePoint = std::chrono::steady_clock::time_point;
+
+// Sends the one reply to a request. The first time the request showed pixels is kept
+// alongside, shared between copies so a preview can mark it before the final reply.
+class ReplyFunction {
+private:
+    std::function<void(ReplyStatus, std::optional<TimePoint>)> m_send;
+    std::shared_ptr<std::optional<TimePoint>> m_first_pixel_at;
+
+public:
+    explicit ReplyFunction(std::function<void(ReplyStatus, std::optional<TimePoint>)> send)
+        : m_send(std::move(send)), m_first_pixel_at(std::make_shared<std::optional<TimePoint>>()) {
+    }
+
+    // An Ok reply shows pixels itself, unless something was shown earlier
+    void operator()(ReplyStatus status) const {
+        if (status == ReplyStatus::Ok) {
+            mark_first_pixel(std::chrono::steady_clock::now());
+        }
+        m_send(status, *m_first_pixel_at);
+    }
+
+    // Only the first mark counts
+    void mark_first_pixel(TimePoint at) const {
+        if (!m_first_pixel_at->has_value()) {
+            *m_first_pixel_at = at;
+        }
+    }
+};
+
+// Animations are not cached, image holds their first frame. Tiled viewports have no image of their own.
+struct ProducedImage {
+    std::shared_ptr<Image> image;
+    std::shared_ptr<AnimatedImage> animation;
+    std::shared_ptr<TiledView> tiles{};
+};
+
+using ImageProducer = std::function<ProducedImage(const std::function<bool()> &superseded)>;
+
+constexpr uint32_t default_placement_id = 0;
+
+// Requests replacing the image of the same placement supersede each other, so only the newest one needs to run.
+// A Clear takes the slots of every placement of its terminal, the images it would remove are not shown at all.
+std::optional<std::string> get_request_slot(const Request &request) {
+    const auto terminal = "terminal " + std::to_string(request.terminal_window) + "/";
+    switch (static_cast<MessageType>(request.header.type)) {
+        case MessageType::Clear:
+            return terminal;
+        case MessageType::DisplayImage:
+        case MessageType::DisplayPixels:
+            return terminal + "placement " + std::to_string(default_placement_id);
+        case MessageType::CreatePlacement: {
+            const auto placement_request = parse_placement_payload(request.payload, true);
+            if (!placement_request.has_value()) {
+                return std::nullopt;
+            }
+            return terminal + "placement " + std::to_string(placement_request->payload.placement_id);
+        }
+        default:
+            return std::nullopt;
+    }
+}
+
+// Converts the cell based geometry of a display request to pixels
+PixelGeometry get_pixel_geometry(const TerminalSize &terminal_size, const DisplayPayload &payload) {
+    PixelGeometry geometry{};
+    geometry.x = static_cast<int>(static_cast<float>(payload.x) * (static_cast<float>(terminal_size.width) / static_cast<float>(terminal_size.columns)));
+    geometry.y = payload.y * (terminal_size.height / terminal_size.lines);
+    geometry.max_width = payload.max_columns * (terminal_size.width / terminal_size.columns);
+    geometry.max_height = payload.max_lines * (terminal_size.height / terminal_size.lines);
+
+    if (geometry.max_width == 0) geometry.max_width = INT32_MAX;
+    if (geometry.max_height == 0) geometry.max_height = INT32_MAX;
+
+    return geometry;
+}
+
+// How much of a placement at x, y the terminal window leaves visible, it clips the rest
+std::pair<int, int> get_visible_size(const TerminalSize &terminal_size, int x, int y) {
+    return {std::max(1, terminal_size.width - x), std::max(1, terminal_size.height - y)};
+}
+
+uint64_t to_microseconds(std::chrono::steady_clock::duration duration) {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+}
+
+// One reply for each image of a grid. Once all of them replied, send gets the first failure if there
+// was one and the payload with when each image first showed pixels and was done.
+std::vector<ReplyFunction> make_grid_replies(size_t count, TimePoint received_at, std::function<void(ReplyStatus, const std::string&)> send) {
+    struct GridState {
+        size_t remaining;
+        ReplyStatus status;
+        std::optional<TimePoint> first_pixel_at;
+        std::vector<GridItemReply> items;
+    };
+    auto state = std::make_shared<GridState>(GridState{count, ReplyStatus::Ok, std::nullopt, std::vector<GridItemReply>(count)});
+
+    std::vector<ReplyFunction> replies;
+    for (size_t i = 0; i < count; ++i) {
+        replies.emplace_back([state, i, received_at, send](ReplyStatus status, std::optional<TimePoint> first_pixel_at) {
+            auto &item = state->items[i];
+            item.status = static_cast<uint32_t>(status);
+            item.done_us = to_microseconds(std::chrono::steady_clock::now() - received_at);
+            if (first_pixel_at.has_value()) {
+                item.first_pixel_us = to_microseconds(first_pixel_at.value() - received_at);
+                if (!state->first_pixel_at.has_value() || first_pixel_at.value() < state->first_pixel_at.value()) {
+                    state->first_pixel_at = first_pixel_at;
+                }
+            }
+
+            if (state->status == ReplyStatus::Ok) {
+                state->status = status;
+            }
+            if (--state->remaining == 0) {
+                const auto first_pixel_us = state->first_pixel_at.has_value() ? to_microseconds(state->first_pixel_at.value() - received_at) : 0;
+                send(state->status, make_display_grid_reply_payload(first_pixel_us, state->items));
+            }
+        });
     }
+    return replies;
+}
 
-    res.push_back (s.substr (pos_start));
-    return res;
+// Ok replies to these carry the time to first pixel
+bool shows_image(MessageType type) {
+    switch (type) {
+        case MessageType::DisplayImage:
+        case MessageType::DisplayPixels:
+        case MessageType::CreatePlacement:
+        case MessageType::MovePlacement:
+        case MessageType::SetViewport:
+            return true;
+        default:
+            return false;
+    }
 }
 
-Imlib_Image scale_image(Imlib_Image image, int max_width, int max_height) {
-    imlib_context_set_image(image);
+size_t get_env_megabytes(const char* name, size_t default_megabytes) {
+    const char* value = std::getenv(name);
+    if (value == nullptr) {
+        return default_megabytes * 1024 * 1024;
+    }
 
-    const int img_width = imlib_image_get_width();
-    const int img_height = imlib_image_get_height();
+    size_t megabytes = 0;
+    const auto result = std::from_chars(value, value + std::strlen(value), megabytes, 10);
+    if (result.ec != std::errc()) {
+        TERMIMG_LOG(Warning) << "Invalid value for " << name << ": " << value;
+        return default_megabytes * 1024 * 1024;
+    }
 
-    const float aspect_ratio = static_cast<float>(img_width) / static_cast<float>(img_height);
-    const float aspect_ratio_inverse = 1.0f / aspect_ratio;
+    return megabytes * 1024 * 1024;
+}
 
-    const int raw_width = std::min(img_width, max_width);
-    const int raw_height = std::min(img_height, max_height);
+size_t get_env_count(const char* name, size_t default_count) {
+    const char* value = std::getenv(name);
+    if (value == nullptr) {
+        return default_count;
+    }
 
-    const int aspect_corrected_width = std::min(raw_width, static_cast<int>(static_cast<float>(raw_height) * aspect_ratio));
-    const int aspect_corrected_height = std::min(raw_height, static_cast<int>(static_cast<float>(raw_width) * aspect_ratio_inverse));
+    size_t count = 0;
+    const auto result = std::from_chars(value, value + std::strlen(value), count, 10);
+    if (result.ec != std::errc() || count == 0) {
+        TERMIMG_LOG(Warning) << "Invalid value for " << name << ": " << value;
+        return default_count;
+    }
+
+    return count;
+}
+
+bool get_env_flag(const char* name, bool default_value) {
+    const char* value = std::getenv(name);
+    if (value == nullptr) {
+        return default_value;
+    }
 
-    return imlib_create_cropped_scaled_image(0, 0, img_width, img_height, aspect_corrected_width, aspect_corrected_height);
+    return std::string_view(value) != "0";
 }
 
-const char* get_imlib_load_error(Imlib_Load_Error load_error) {
-    switch (load_error) {
-        case IMLIB_LOAD_ERROR_NONE: return "Error none";
-        case IMLIB_LOAD_ERROR_FILE_DOES_NOT_EXIST: return "File does not exist";
-        case IMLIB_LOAD_ERROR_FILE_IS_DIRECTORY: return "File is directory";
-        case IMLIB_LOAD_ERROR_PERMISSION_DENIED_TO_READ: return "Permission denied to read";
-        case IMLIB_LOAD_ERROR_NO_LOADER_FOR_FILE_FORMAT: return "No loader for file for file format";
-        case IMLIB_LOAD_ERROR_PATH_TOO_LONG: return "Path too long";
-        case IMLIB_LOAD_ERROR_PATH_COMPONENT_NON_EXISTANT: return "Path component non existant";
-        case IMLIB_LOAD_ERROR_PATH_COMPONENT_NOT_DIRECTORY: return "Path component not directory";
-        case IMLIB_LOAD_ERROR_PATH_POINTS_OUTSIDE_ADDRESS_SPACE: return "Path points outside address space";
-        case IMLIB_LOAD_ERROR_TOO_MANY_SYMBOLIC_LINKS: return "Too many symbolic links";
-        case IMLIB_LOAD_ERROR_OUT_OF_MEMORY: return "Out of memory";
-        case IMLIB_LOAD_ERROR_OUT_OF_FILE_DESCRIPTORS: return "Out of file descriptors";
-        case IMLIB_LOAD_ERROR_PERMISSION_DENIED_TO_WRITE: return "Permission denied to write";
-        case IMLIB_LOAD_ERROR_OUT_OF_DISK_SPACE: return "Out of disk space";
-        case IMLIB_LOAD_ERROR_UNKNOWN: return "Unknown error";
-        case IMLIB_LOAD_ERROR_IMAGE_READ: return "Image read";
-        case IMLIB_LOAD_ERROR_IMAGE_FRAME: return "Image frame";
-        default: return "WTF!";
+std::shared_ptr<Image> get_scaled_image(ImageCache &image_cache, DiskCache &disk_cache, const ImageKey &key, const std::function<bool()> &superseded) {
+    auto scaled_image = image_cache.get(key);
+    if (scaled_image) {
+        return scaled_image;
     }
+
+    // Scaled by this or another server before, mapping it beats a decode even with the original in memory
+    scaled_image = disk_cache.get(key);
+    if (scaled_image) {
+        image_cache.put(key, scaled_image);
+        return scaled_image;
+    }
+
+    auto image = image_cache.get(key.original());
+    if (!image) {
+        if (superseded()) {
+            return nullptr;
+        }
+
+        std::optional<StageTimer> decode_timer(Stage::Decode);
+        JpegImage jpeg{nullptr, 1, 0, 0};
+        {
+            // Both decoders read the one mapping, which is gone again before scaling
+            const auto file = map_file(key.path);
+            if (file && is_jpeg(*file)) {
+                jpeg = load_jpeg_scaled(*file, key.max_width, key.max_height);
+            }
+            if (!jpeg.image) {
+                image = load_image(key.path, file.get());
+            }
+        }
+        decode_timer.reset();
+
+        if (jpeg.image && jpeg.scale_denominator > 1) {
+            // A reduced decode is not the original, only the scaled result is cached
+            if (superseded()) {
+                return nullptr;
+            }
+            scaled_image = scale_image(*jpeg.image, key.max_width, key.max_height);
+            if (!scaled_image) {
+                return nullptr;
+            }
+            image_cache.put(key, scaled_image);
+            disk_cache.put(key, scaled_image);
+            return scaled_image;
+        }
+        if (jpeg.image) {
+            image = std::move(jpeg.image);
+        }
+
+        if (!image) {
+            return nullptr;
+        }
+        image_cache.put(key.original(), image);
+    }
+
+    TERMIMG_LOG(Debug) << "Original width: " << image->width() << " height: " << image->height();
+
+    // The decoded original is cached either way, so a later request for it is not wasted
+    if (superseded()) {
+        return nullptr;
+    }
+
+    scaled_image = scale_image(*image, key.max_width, key.max_height);
+    if (!scaled_image) {
+        return nullptr;
+    }
+    image_cache.put(key, scaled_image);
+    disk_cache.put(key, scaled_image);
+
+    return scaled_image;
+}
+
+// The full size decode, which get_scaled_image skips for JPEGs libjpeg can decode reduced
+std::shared_ptr<Image> get_original_image(ImageCache &image_cache, const ImageKey &key) {
+    auto image = image_cache.get(key.original());
+    if (image) {
+        return image;
+    }
+
+    const StageTimer timer(Stage::Decode);
+    {
+        const auto file = map_file(key.path);
+        if (file && is_jpeg(*file)) {
+            image = load_jpeg_scaled(*file, INT32_MAX, INT32_MAX).image;
+        }
+        if (!image) {
+            image = load_image(key.path, file.get());
+        }
+    }
+    if (image) {
+        image_cache.put(key.original(), image);
+    }
+
+    return image;
+}
+
+ProducedImage get_display_image(ImageCache &image_cache, DiskCache &disk_cache, const ImageKey &key, size_t animation_budget, const std::function<bool()> &superseded) {
+    auto scaled_image = image_cache.get(key);
+    if (scaled_image) {
+        return {scaled_image, nullptr};
+    }
+
+    if (may_be_animated(key.path)) {
+        const StageTimer timer(Stage::Decode);
+        auto animation = load_animation(key.path, key.max_width, key.max_height, animation_budget, superseded);
+        if (!animation) {
+            return {nullptr, nullptr};
+        }
+
+        auto first_frame = animation->frames[0].image;
+        if (animation->frames.size() == 1) {
+            image_cache.put(key, first_frame);
+            return {first_frame, nullptr};
+        }
+        return {first_frame, animation};
+    }
+
+    return {get_scaled_image(image_cache, disk_cache, key, superseded), nullptr};
 }
 
 int main(int argc, char* argv[]) {
+    const auto started_at = std::chrono::steady_clock::now();
+
     if (argc != 2) {
         print_usage(argv[0]);
         return EXIT_FAILURE;
     }
 
-    pid_t parent_pid = std::stoi(argv[1]);
+    const bool daemon = std::string_view(argv[1]) == "--daemon";
+
+    const char* log_level_name = std::getenv("TERMIMG_LOG_LEVEL");
+    const auto log_level = log_level_from_string(log_level_name != nullptr ? log_level_name : "info");
+    if (!log_level.has_value()) {
+        std::cerr << "Unknown log level " << log_level_name << ", expected error, warning, info or debug" << std::endl;
+    }
+    configure_log(log_level.value_or(LogLevel::Info));
 
     const std::shared_ptr<Display> display_ptr(XOpenDisplay(nullptr), [](Display* display) { XCloseDisplay(display); });
 
-    auto optional_term_tuple = get_term(display_ptr, parent_pid);
-    if (!optional_term_tuple.has_value()) {
-        std::cerr << "No terminal found!" << std::endl;
-        sleep(100000);
-        return EXIT_FAILURE;
-    }
+    const int screen = DefaultScreen(display_ptr.get());
 
-    const auto terminal_info = optional_term_tuple.value();
+    Terminals terminals(display_ptr, screen);
+    // Requests that do not name their terminal go here, a daemon has none
+    Window default_terminal_window = None;
 
-    //std::cerr << "Found terminal pid: " << term_pid << " window: " << std::hex << term_window << std::dec << " pty: " << pty << std::endl;
+    if (!daemon) {
+        pid_t parent_pid = std::stoi(argv[1]);
 
+        auto optional_term_tuple = get_term(display_ptr, parent_pid, get_env_window_id());
+        if (!optional_term_tuple.has_value()) {
+            TERMIMG_LOG(Error) << "No terminal found!";
+            sleep(100000);
+            return EXIT_FAILURE;
+        }
 
+        default_terminal_window = terminals.add(optional_term_tuple.value()).info.terminal_window();
+    }
+
+    XSetErrorHandler(handle_x_error);
+
+    //std::cerr << "Found terminal pid: " << term_pid << " window: " << std::hex << term_window << std::dec << " pty: " << pty << std::endl;
 
-    const int screen = DefaultScreen(display_ptr.get());
-    XSetWindowAttributes attributes;
-    attributes.event_mask = ExposureMask;
-    attributes.colormap = XCreateColormap(
-            display_ptr.get(), XDefaultRootWindow(display_ptr.get()),
-            XDefaultVisual(display_ptr.get(), screen), AllocNone);
-    attributes.background_pixel = 0;
-    attributes.border_pixel = 0;
-    Window window = XCreateWindow(
-        display_ptr.get(),
-        terminal_info.terminal_window(),
-        0, 0,
-        50, 50,
-        1,
-        DefaultDepth(display_ptr.get(), screen),
-        InputOutput,
-        XDefaultVisual(display_ptr.get(), screen),
-        CWEventMask | CWBackPixel | CWColormap | CWBorderPixel,
-        &attributes
-    );
 
 
     int fd_xorg = XConnectionNumber(display_ptr.get());
 
     Epoll epoll;
-    epoll.register_fd(fd_xorg, [&]() {
-        XEvent x_event;
-        XNextEvent(display_ptr.get(), &x_event);
 
-        if (x_event.type == Expose){
-            std::cerr << "Expose" << std::endl;
+    const char* scaler_name = std::getenv("TERMIMG_SCALER");
+    const auto scaler = scaler_from_string(scaler_name != nullptr ? scaler_name : "auto");
+    if (!scaler.has_value()) {
+        TERMIMG_LOG(Warning) << "Unknown scaler " << scaler_name << ", expected imlib, box or auto";
+    }
+    configure_scaler(scaler.value_or(Scaler::Auto), static_cast<unsigned int>(get_env_count("TERMIMG_SCALER_THREADS", std::max(1u, std::thread::hardware_concurrency()))));
+
+    ImageCache image_cache(get_env_megabytes("TERMIMG_CACHE_SIZE", 256));
+    // Declared before the worker pool, whose jobs use it until the pool is gone
+    DiskCache disk_cache(get_disk_cache_directory(), get_env_megabytes("TERMIMG_DISK_CACHE_SIZE", 1024));
+    PixmapCache pixmap_cache(display_ptr, DefaultDepth(display_ptr.get(), screen), get_env_megabytes("TERMIMG_PIXMAP_CACHE_SIZE", 64));
+    TileCache tile_cache(display_ptr, screen, get_env_megabytes("TERMIMG_TILE_CACHE_SIZE", 32));
+    Renderer renderer(display_ptr, screen, get_env_flag("TERMIMG_SHM", true));
+    const size_t animation_budget = get_env_megabytes("TERMIMG_ANIMATION_SIZE", 32);
+    // Shows a quick preview of large JPEGs before the final image
+    const bool progressive = get_env_flag("TERMIMG_PROGRESSIVE", true);
+
+    // Bumped by every prefetch and clear, so what is left of an older prefetch is dropped
+    std::atomic<uint64_t> prefetch_generation = 0;
+    uint64_t prefetched_images = 0;
+    WorkerPool worker_pool(epoll, get_env_count("TERMIMG_WORKERS", std::max(1u, std::thread::hardware_concurrency())));
+    // Freeing an Imlib2 image waits for whatever decode holds imlib_mutex, so the loop leaves it to a worker
+    set_image_releaser([&worker_pool](std::function<void()> release) {
+        worker_pool.submit([release = std::move(release)]() -> WorkerPool::Completion {
+            release();
+            return nullptr;
+        }, WorkerPool::Priority::Low);
+    });
+
+    uint64_t coalesced_requests = 0;
+
+    const char* socket_path = std::getenv("TERMIMG_SOCKET");
+    IPCServer ipc_server(socket_path != nullptr ? socket_path : "/tmp/termimg", epoll);
+
+    auto get_terminal_size = [&](const Terminal &terminal) -> std::optional<TerminalSize> {
+        const auto terminal_size = terminal.info.size();
+        if (!terminal_size.has_value()) {
+            TERMIMG_LOG(Warning) << "Terminal has no cells";
+        }
+        return terminal_size;
+    };
+
+    // Renders the image to a new pixmap and shows it, the pixmap is cached when there is a key for it
+    auto create_pixmap = [&](const Image &scaled_image) -> CachedPixmap {
+        const int img_width = scaled_image.width();
+        const int img_height = scaled_image.height();
+
+        assert(img_width >= 0);
+        assert(img_height >= 0);
+
+        const auto width = static_cast<unsigned int>(img_width);
+        const auto height = static_cast<unsigned int>(img_height);
+
+        TERMIMG_LOG(Debug) << "Cropped width: " << width << " height: " << height;
+
+        // Pixmaps are shared by every terminal on the screen, so they are not tied to any of their windows
+        const Pixmap pixmap = XCreatePixmap(display_ptr.get(), DefaultRootWindow(display_ptr.get()), width, height, static_cast<unsigned int>(DefaultDepth(display_ptr.get(), screen)));
+
+        const auto render_path = [&]() {
+            const StageTimer timer(Stage::Render);
+            return renderer.render(scaled_image, pixmap);
+        }();
+        TERMIMG_LOG(Debug) << "Rendered with " << render_path_to_string(render_path);
+
+        return {pixmap, width, height};
+    };
+
+    // Only what the terminal window leaves visible is uploaded, so a pixmap is never larger than the
+    // terminal. Cropped images are not cached, their key stands for the whole image.
+    auto render_image = [&](const Terminal &terminal, Placement &placement, const Image &scaled_image, std::optional<ImageKey> key) {
+        std::shared_ptr<Image> cropped_image;
+        const auto terminal_size = terminal.info.size();
+        if (terminal_size.has_value()) {
+            const auto [visible_width, visible_height] = get_visible_size(terminal_size.value(), placement.x(), placement.y());
+            if (scaled_image.width() > visible_width || scaled_image.height() > visible_height) {
+                const int width = std::min(scaled_image.width(), visible_width);
+                const int height = std::min(scaled_image.height(), visible_height);
+                TERMIMG_LOG(Debug) << "Cropping to the visible width: " << width << " height: " << height;
+                cropped_image = crop_scale_image(scaled_image, 0, 0, width, height, width, height);
+                key.reset();
+            }
+        }
+
+        const auto rendered_pixmap = create_pixmap(cropped_image ? *cropped_image : scaled_image);
+        const Pixmap pixmap = rendered_pixmap.pixmap;
+        {
+            const StageTimer timer(Stage::Flush);
+            placement.show(rendered_pixmap);
+        }
+        if (key.has_value()) {
+            pixmap_cache.put(key.value(), rendered_pixmap);
         }
         else {
-            std::cerr << "Unknown event" << std::endl;
+            XFreePixmap(display_ptr.get(), pixmap);
         }
-    });
 
-    Pixmap pixmap = -1ul;
+        const auto &pixmap_stats = pixmap_cache.stats();
+        TERMIMG_LOG(Debug) << "Pixmap cache hits: " << pixmap_stats.hits << " misses: " << pixmap_stats.misses
+                           << " evictions: " << pixmap_stats.evictions << " used: " << pixmap_stats.used_bytes;
+    };
+
+    // produce_image runs on a worker and returns the scaled image, or nullptr when it failed or was superseded.
+    // produce_preview, when set, runs first and returns a cheap image to show until the final one is ready.
+    // Destroying a terminal destroys its placements, which supersedes them, so the terminal
+    // is still there whenever a completion finds it is not superseded
+    auto display_async = [&](Terminal &terminal, uint32_t placement_id, ImageProducer produce_image, ImageProducer produce_preview, std::optional<ImageKey> key, ReplyFunction reply) {
+        auto &placement = terminal.placements.get_or_create(placement_id);
+        const auto generation_counter = placement.generation();
+        const auto generation = placement.supersede();
+        const auto final_shown = std::make_shared<bool>(false);
+
+        if (produce_preview) {
+            worker_pool.submit([&, &terminal = terminal, placement_id, generation, generation_counter, produce_preview, final_shown, reply]() -> WorkerPool::Completion {
+                auto superseded = [generation, generation_counter]() { return generation != *generation_counter; };
 
-    IPCServer ipc_server("/tmp/termimg", epoll);
-    ipc_server.register_on_message_handler([&](const std::string_view message) {
-        if (message == "clear") {
-            XUnmapWindow(display_ptr.get(), window);
-            XFlush(display_ptr.get());
+                const auto preview = produce_preview(superseded);
+                if (!preview.image) {
+                    return nullptr;
+                }
+
+                return [&, &terminal = terminal, placement_id, preview, final_shown, reply, superseded]() {
+                    if (superseded() || *final_shown) {
+                        return;
+                    }
+
+                    TERMIMG_LOG(Debug) << "Showing preview in placement " << placement_id;
+                    render_image(terminal, *terminal.placements.find(placement_id), *preview.image, std::nullopt);
+                    reply.mark_first_pixel(std::chrono::steady_clock::now());
+                };
+            });
         }
-        else if (message == "quit") {
-            epoll.exit_loop();
+
+        worker_pool.submit([&, &terminal = terminal, placement_id, generation, generation_counter, produce_image, final_shown, key, reply]() -> WorkerPool::Completion {
+            auto superseded = [generation, generation_counter]() { return generation != *generation_counter; };
+
+            const auto produced = produce_image(superseded);
+
+            return [&, &terminal = terminal, placement_id, generation, key, produced, final_shown, reply, superseded]() {
+                *final_shown = true;
+
+                // Removing the placement supersedes it, so it still exists when this is not superseded
+                if (superseded()) {
+                    TERMIMG_LOG(Debug) << "Dropping superseded display " << generation << " of placement " << placement_id;
+                    reply(ReplyStatus::Superseded);
+                    return;
+                }
+
+                auto &target = *terminal.placements.find(placement_id);
+                if (produced.tiles) {
+                    const auto composed_pixmap = tile_cache.compose(*produced.tiles, renderer);
+                    if (!composed_pixmap.has_value()) {
+                        reply(ReplyStatus::LoadFailed);
+                        return;
+                    }
+
+                    {
+                        const StageTimer timer(Stage::Flush);
+                        target.show(composed_pixmap.value());
+                    }
+                    XFreePixmap(display_ptr.get(), composed_pixmap->pixmap);
+                    reply(ReplyStatus::Ok);
+                    return;
+                }
+
+                if (!produced.image) {
+                    reply(ReplyStatus::LoadFailed);
+                    return;
+                }
+
+                if (produced.animation) {
+                    auto animation = std::make_unique<Animation>(
+                        epoll, display_ptr, renderer, target.window(), static_cast<unsigned int>(DefaultDepth(display_ptr.get(), screen)),
+                        produced.animation->frames, [&target](Pixmap pixmap) { target.show_frame(pixmap); }
+                    );
+                    target.show(animation->first_frame());
+                    target.play(std::move(animation));
+                    reply(ReplyStatus::Ok);
+                    return;
+                }
+
+                render_image(terminal, target, *produced.image, key);
+                reply(ReplyStatus::Ok);
+            };
+        });
+    };
+
+    // Crops and scales the visible part of the placement's image. The decoded image is the cached
+    // original, so viewport requests for a path decode again only once it was evicted. The visible part
+    // is put together from tiles, so a pan only scales and uploads the tiles coming into view.
+    auto show_viewport = [&](Terminal &terminal, uint32_t placement_id, const TerminalSize &terminal_size, const PixelGeometry &geometry, const ReplyFunction &reply) {
+        auto &placement = *terminal.placements.find(placement_id);
+        const auto key = make_image_key(placement.path().value(), 0, 0);
+        if (!key.has_value()) {
+            reply(ReplyStatus::LoadFailed);
+            return;
         }
-        else {
-            auto strs = split(message, "\n");
-            if (strs.size() != 6) {
-                std::cerr << "Not enough arguments" << std::endl;
-                return;
+
+        const auto [visible_width, visible_height] = get_visible_size(terminal_size, geometry.x, geometry.y);
+
+        // Workers cannot look at the tile cache, so they are told which tiles it had. Laid out the
+        // same way again on the worker, the tiles are the same.
+        std::set<std::pair<int, int>> cached_tiles;
+        const auto source = placement.viewport_source();
+        const auto image = source->peek(image_cache, key.value());
+        if (image) {
+            // Clamped right away, so panning back from past an edge starts moving at once
+            const auto rect = layout_viewport(placement.viewport(), image->width(), image->height(), geometry.max_width, geometry.max_height);
+            const auto view = make_tiled_view(key.value(), rect, image->width(), image->height(), visible_width, visible_height);
+            if (view.has_value()) {
+                for (const auto &tile : view->tiles) {
+                    if (tile_cache.contains({key.value(), rect.scale, tile.column, tile.row})) {
+                        cached_tiles.emplace(tile.column, tile.row);
+                    }
+                }
             }
+        }
+        placement.set_position(geometry.x, geometry.y);
 
-            auto command = strs[0];
-            if (command != "display") {
-                std::cerr << "Unrecognized command" << std::endl;
-                return;
+        display_async(terminal, placement_id, [&image_cache, key = key.value(), source, viewport = placement.viewport(), geometry, visible_width, visible_height, cached_tiles](const std::function<bool()> &superseded) -> ProducedImage {
+            const auto full_image = source->get(image_cache, key, [&]() { return get_original_image(image_cache, key); });
+            if (!full_image || superseded()) {
+                return {nullptr, nullptr};
             }
 
-            auto get_int = [](std::string_view str) {
-                int number = 0;
-                const auto result = std::from_chars(str.data(), str.data() + str.size(), number, 10);
+            auto visible = viewport;
+            const auto rect = layout_viewport(visible, full_image->width(), full_image->height(), geometry.max_width, geometry.max_height);
+            TERMIMG_LOG(Debug) << "Viewport x: " << rect.src_x << " y: " << rect.src_y << " width: " << rect.src_width
+                               << " height: " << rect.src_height << " scaled to width: " << rect.width << " height: " << rect.height;
+
+            auto view = make_tiled_view(key, rect, full_image->width(), full_image->height(), visible_width, visible_height);
+            if (!view.has_value()) {
+                const auto clipped = clip_viewport(rect, visible_width, visible_height);
+                return {crop_scale_image(*full_image, clipped.src_x, clipped.src_y, clipped.src_width, clipped.src_height, clipped.width, clipped.height), nullptr};
+            }
 
-                if (result.ec == std::errc::invalid_argument) {
-                    std::cerr << "Not an int" << std::endl;
-                    throw 1;
+            for (const auto &tile : view->tiles) {
+                if (superseded()) {
+                    return {nullptr, nullptr};
                 }
 
-                return number;
+                if (cached_tiles.count({tile.column, tile.row}) > 0) {
+                    view->scaled_tiles.push_back(nullptr);
+                    continue;
+                }
+
+                auto tile_image = crop_scale_image(*full_image, tile.src_x, tile.src_y, tile.src_width, tile.src_height, tile.width, tile.height);
+                if (!tile_image) {
+                    return {nullptr, nullptr};
+                }
+                view->scaled_tiles.push_back(std::move(tile_image));
+            }
+
+            view->image = full_image;
+            return {nullptr, nullptr, std::make_shared<TiledView>(std::move(view.value()))};
+        }, nullptr, std::nullopt, reply);
+    };
+
+    auto display_path = [&](Terminal &terminal, uint32_t placement_id, const DisplayPayload &payload, const TerminalSize &terminal_size, std::string path, const ReplyFunction &reply) {
+        const auto geometry = get_pixel_geometry(terminal_size, payload);
+
+        TERMIMG_LOG(Debug) << "Got message for placement " << placement_id << " with x: " << geometry.x << " y: " << geometry.y << " max_width: " << geometry.max_width << " max_height: " << geometry.max_height << " path: " << path;
+
+        auto &placement = terminal.placements.get_or_create(placement_id);
+        placement.set_request(payload, path);
+        placement.set_position(geometry.x, geometry.y);
+
+        // Moves and resizes keep the zoom and pan
+        if (!placement.viewport().is_default()) {
+            show_viewport(terminal, placement_id, terminal_size, geometry, reply);
+            return;
+        }
+
+        const auto key = make_image_key(path, geometry.max_width, geometry.max_height);
+        if (!key.has_value()) {
+            TERMIMG_LOG(Warning) << "Could not stat image " << path;
+            reply(ReplyStatus::LoadFailed);
+            return;
+        }
+
+        if (x_alloc_failed) {
+            x_alloc_failed = false;
+            pixmap_cache.shrink();
+            tile_cache.shrink();
+        }
+
+        const auto cached_pixmap = pixmap_cache.get(key.value());
+        if (cached_pixmap.has_value()) {
+            TERMIMG_LOG(Debug) << "Pixmap cache hit";
+            placement.supersede();
+            const StageTimer timer(Stage::Flush);
+            placement.show(cached_pixmap.value());
+            reply(ReplyStatus::Ok);
+            return;
+        }
+
+        ImageProducer produce_preview;
+        if (progressive) {
+            produce_preview = [&image_cache, &disk_cache, key = key.value()](const std::function<bool()> &superseded) -> ProducedImage {
+                if (superseded() || image_cache.contains(key) || image_cache.contains(key.original()) || disk_cache.contains(key)) {
+                    return {nullptr, nullptr};
+                }
+                return {load_jpeg_preview(key.path, key.max_width, key.max_height), nullptr};
             };
+        }
+
+        display_async(terminal, placement_id, [&image_cache, &disk_cache, animation_budget, key = key.value()](const std::function<bool()> &superseded) {
+            return get_display_image(image_cache, disk_cache, key, animation_budget, superseded);
+        }, produce_preview, key, reply);
+    };
+
+    auto handle_display = [&](Terminal &terminal, const Request &request, const ReplyFunction &reply) {
+        const auto display_request = parse_display_payload(request.payload);
+        if (!display_request.has_value()) {
+            TERMIMG_LOG(Warning) << "Malformed display request";
+            reply(ReplyStatus::InvalidRequest);
+            return;
+        }
+
+        const auto terminal_size = get_terminal_size(terminal);
+        if (!terminal_size.has_value()) {
+            reply(ReplyStatus::Failed);
+            return;
+        }
+
+        display_path(terminal, default_placement_id, display_request->payload, terminal_size.value(), std::string(display_request->path), reply);
+    };
+
+    auto handle_display_pixels = [&](Terminal &terminal, const Request &request, const ReplyFunction &reply) {
+        const auto payload = parse_display_pixels_payload(request.payload);
+        if (!payload.has_value() || payload->fd_index >= request.fds.size()) {
+            TERMIMG_LOG(Warning) << "Malformed display pixels request";
+            reply(ReplyStatus::InvalidRequest);
+            return;
+        }
 
-            const auto optional_winsize = terminal_info.get_tty_size();
-            if (!optional_winsize.has_value()) {
-                std::cerr << "Could not get tty size" << std::endl;
-                throw 1;
+        const auto terminal_size = get_terminal_size(terminal);
+        if (!terminal_size.has_value()) {
+            reply(ReplyStatus::Failed);
+            return;
+        }
+        const auto geometry = get_pixel_geometry(terminal_size.value(), payload->display);
+
+        TERMIMG_LOG(Debug) << "Got pixels width: " << payload->width << " height: " << payload->height;
+
+        auto &placement = terminal.placements.get_or_create(default_placement_id);
+        placement.set_request(payload->display, std::nullopt);
+        placement.set_position(geometry.x, geometry.y);
+
+        // The pixels are only mapped or copied here, the file descriptor can be closed with the request
+        const auto image = receive_pixels(request.fds[payload->fd_index]->get(), payload->width, payload->height, payload->offset);
+        if (!image) {
+            reply(ReplyStatus::LoadFailed);
+            return;
+        }
+
+        if (image->width() <= geometry.max_width && image->height() <= geometry.max_height) {
+            placement.supersede();
+            render_image(terminal, placement, *image, std::nullopt);
+            reply(ReplyStatus::Ok);
+            return;
+        }
+
+        display_async(terminal, default_placement_id, [image, geometry](const std::function<bool()> &superseded) -> ProducedImage {
+            if (superseded()) {
+                return {nullptr, nullptr};
             }
-            const auto &winsize = optional_winsize.value();
-            const auto columns = winsize.ws_col;
-            const auto lines = winsize.ws_row;
-            std::cerr << "Terminal size x: " << columns << " y: " << lines << std::endl;
-            XWindowAttributes attr {};
-            if (!XGetWindowAttributes(display_ptr.get(), terminal_info.terminal_window(), &attr)) {
-                std::cerr << "Could not get window attributes" << std::endl;
+            return {scale_image(*image, geometry.max_width, geometry.max_height), nullptr};
+        }, nullptr, std::nullopt, reply);
+    };
+
+    auto handle_create_placement = [&](Terminal &terminal, const Request &request, const ReplyFunction &reply) {
+        const auto placement_request = parse_placement_payload(request.payload, true);
+        if (!placement_request.has_value()) {
+            TERMIMG_LOG(Warning) << "Malformed create placement request";
+            reply(ReplyStatus::InvalidRequest);
+            return;
+        }
+
+        const auto terminal_size = get_terminal_size(terminal);
+        if (!terminal_size.has_value()) {
+            reply(ReplyStatus::Failed);
+            return;
+        }
+
+        display_path(terminal, placement_request->payload.placement_id, placement_request->payload.display, terminal_size.value(),
+                     std::string(placement_request->path), reply);
+    };
+
+    auto handle_move_placement = [&](Terminal &terminal, const Request &request, const ReplyFunction &reply) {
+        const auto placement_request = parse_placement_payload(request.payload, false);
+        if (!placement_request.has_value()) {
+            TERMIMG_LOG(Warning) << "Malformed move placement request";
+            reply(ReplyStatus::InvalidRequest);
+            return;
+        }
+
+        const auto placement_id = placement_request->payload.placement_id;
+        const auto &payload = placement_request->payload.display;
+        auto* placement = terminal.placements.find(placement_id);
+        if (placement == nullptr) {
+            TERMIMG_LOG(Warning) << "No placement " << placement_id << " to move";
+            reply(ReplyStatus::InvalidRequest);
+            return;
+        }
+
+        const auto terminal_size = get_terminal_size(terminal);
+        if (!terminal_size.has_value()) {
+            reply(ReplyStatus::Failed);
+            return;
+        }
+
+        // A new cell box needs the image scaled again, pixels are not kept around for that
+        const auto &previous = placement->request();
+        const bool resized = previous.max_columns != payload.max_columns || previous.max_lines != payload.max_lines;
+        if (resized && placement->path().has_value()) {
+            display_path(terminal, placement_id, payload, terminal_size.value(), placement->path().value(), reply);
+            return;
+        }
+
+        const auto geometry = get_pixel_geometry(terminal_size.value(), payload);
+        placement->set_request(payload, placement->path());
+        placement->move(geometry.x, geometry.y);
+        reply(ReplyStatus::Ok);
+    };
+
+    auto handle_viewport = [&](Terminal &terminal, const Request &request, const ReplyFunction &reply) {
+        const auto payload = parse_viewport_payload(request.payload);
+        if (!payload.has_value()) {
+            TERMIMG_LOG(Warning) << "Malformed viewport request";
+            reply(ReplyStatus::InvalidRequest);
+            return;
+        }
+
+        // Pixels are not kept around, so only placements showing a path have something to crop
+        auto* placement = terminal.placements.find(payload->placement_id);
+        if (placement == nullptr || !placement->path().has_value()) {
+            TERMIMG_LOG(Warning) << "No placement " << payload->placement_id << " showing a path";
+            reply(ReplyStatus::InvalidRequest);
+            return;
+        }
+
+        const auto terminal_size = get_terminal_size(terminal);
+        if (!terminal_size.has_value()) {
+            reply(ReplyStatus::Failed);
+            return;
+        }
+
+        const int cell_width = terminal_size->width / terminal_size->columns;
+        const int cell_height = terminal_size->height / terminal_size->lines;
+        apply_viewport_request(placement->viewport(), payload.value(), payload->pan_columns * cell_width, payload->pan_lines * cell_height);
+        show_viewport(terminal, payload->placement_id, terminal_size.value(), get_pixel_geometry(terminal_size.value(), placement->request()), reply);
+    };
+
+    auto handle_remove_placement = [&](Terminal &terminal, const Request &request, const ReplyFunction &reply) {
+        const auto payload = parse_placement_id_payload(request.payload);
+        if (!payload.has_value()) {
+            TERMIMG_LOG(Warning) << "Malformed remove placement request";
+            reply(ReplyStatus::InvalidRequest);
+            return;
+        }
+
+        if (!terminal.placements.remove(payload->placement_id)) {
+            TERMIMG_LOG(Warning) << "No placement " << payload->placement_id << " to remove";
+            reply(ReplyStatus::InvalidRequest);
+            return;
+        }
+
+        reply(ReplyStatus::Ok);
+    };
+
+    auto handle_animation = [&](Terminal &terminal, const Request &request, const ReplyFunction &reply, bool pause) {
+        const auto payload = parse_placement_id_payload(request.payload);
+        if (!payload.has_value()) {
+            TERMIMG_LOG(Warning) << "Malformed animation request";
+            reply(ReplyStatus::InvalidRequest);
+            return;
+        }
+
+        const auto* placement = terminal.placements.find(payload->placement_id);
+        if (placement == nullptr || placement->animation() == nullptr) {
+            TERMIMG_LOG(Warning) << "No animation in placement " << payload->placement_id;
+            reply(ReplyStatus::InvalidRequest);
+            return;
+        }
+
+        if (pause) {
+            placement->animation()->pause();
+        }
+        else {
+            placement->animation()->resume();
+        }
+        reply(ReplyStatus::Ok);
+    };
+
+    auto handle_prefetch = [&](Terminal &terminal, const Request &request, const ReplyFunction &reply) {
+        const auto items = parse_prefetch_payload(request.payload);
+        if (!items.has_value()) {
+            TERMIMG_LOG(Warning) << "Malformed prefetch request";
+            reply(ReplyStatus::InvalidRequest);
+            return;
+        }
+
+        const auto terminal_size = get_terminal_size(terminal);
+        if (!terminal_size.has_value()) {
+            reply(ReplyStatus::Failed);
+            return;
+        }
+
+        const auto generation = ++prefetch_generation;
+        size_t queued = 0;
+        for (const auto &item : items.value()) {
+            const auto geometry = get_pixel_geometry(terminal_size.value(), DisplayPayload{0, 0, item.max_columns, item.max_lines});
+            const auto key = make_image_key(std::string(item.path), geometry.max_width, geometry.max_height);
+            if (!key.has_value() || pixmap_cache.contains(key.value())) {
+                continue;
             }
-            const int win_width = attr.width;
-            const int win_height = attr.height;
-            std::cerr << "Window width: " << win_width << " height: " << win_height << std::endl;
-            const int x = static_cast<int>(static_cast<float>(get_int(strs[1])) * (static_cast<float>(win_width) / static_cast<float>(columns)));
-            const int y = get_int(strs[2]) * (win_height / lines);
-            int max_width = get_int(strs[3]) * (win_width / columns);
-            int max_height = get_int(strs[4]) * (win_height / lines);
 
-            if (max_width == 0) max_width = INT32_MAX;
-            if (max_height == 0) max_height = INT32_MAX;
+            worker_pool.submit([&, generation, key = key.value()]() -> WorkerPool::Completion {
+                // Gives way to displays, which would otherwise wait for a whole decode
+                auto cancelled = [&, generation]() { return generation != prefetch_generation || worker_pool.has_waiting_jobs(); };
+                if (cancelled() || may_be_animated(key.path)) {
+                    return nullptr;
+                }
+
+                const auto scaled_image = get_scaled_image(image_cache, disk_cache, key, cancelled);
+                if (!scaled_image) {
+                    return nullptr;
+                }
 
-            std::string path = std::string(strs[5]);
+                return [&, generation, key, scaled_image]() {
+                    if (generation != prefetch_generation || pixmap_cache.contains(key)) {
+                        return;
+                    }
+
+                    pixmap_cache.put(key, create_pixmap(*scaled_image));
+                    ++prefetched_images;
+                    TERMIMG_LOG(Debug) << "Prefetched " << key.path << ", " << prefetched_images << " in total";
+                };
+            }, WorkerPool::Priority::Low);
+            ++queued;
+        }
 
+        TERMIMG_LOG(Debug) << "Queued " << queued << " of " << items->size() << " images for prefetch";
+        reply(ReplyStatus::Ok);
+    };
+
+    // Every cell is a job of its own. JPEG decodes and box scales of the cells run in parallel, Imlib2
+    // is not thread safe, so cells of other formats still decode one at a time under imlib_mutex.
+    auto handle_display_grid = [&](Terminal &terminal, const Request &request, const ReplyFunction &reply) {
+        const auto grid = parse_display_grid_payload(request.payload);
+        if (!grid.has_value()) {
+            TERMIMG_LOG(Warning) << "Malformed display grid request";
+            reply(ReplyStatus::InvalidRequest);
+            return;
+        }
+
+        const auto terminal_size = get_terminal_size(terminal);
+        if (!terminal_size.has_value()) {
+            reply(ReplyStatus::Failed);
+            return;
+        }
 
-            std::cerr << "Got message with x: " << x << " y: " << y << " max_width: " << max_width << " max_height: " << max_height << " path: " << path << std::endl;
+        const auto &payload = grid->payload;
+        TERMIMG_LOG(Debug) << "Got grid of " << payload.count << " images, " << payload.grid_columns << " to a row";
 
-            Imlib_Load_Error load_error;
-            Imlib_Image image = imlib_load_image_with_error_return(path.data(), &load_error);
-            if (!image) {
-                std::cerr << "Image loading failed for image " << path <<  std::endl;
-                std::cerr << get_imlib_load_error(load_error) << std::endl;
+        // Replied to here rather than through reply, which only knows about a single image
+        const auto cell_replies = make_grid_replies(grid->paths.size(), request.received_at, [&ipc_server, sender = request.sender, request_id = request.header.request_id, received_at = request.received_at](ReplyStatus status, const std::string &reply_payload) {
+            ipc_server.send_to(sender, make_reply(request_id, status, to_microseconds(std::chrono::steady_clock::now() - received_at), reply_payload));
+        });
+        for (size_t i = 0; i < grid->paths.size(); ++i) {
+            const auto index = static_cast<int32_t>(i);
+            const DisplayPayload cell{
+                payload.x + (index % payload.grid_columns) * payload.cell_columns,
+                payload.y + (index / payload.grid_columns) * payload.cell_lines,
+                payload.cell_columns,
+                payload.cell_lines
+            };
+            display_path(terminal, payload.first_placement_id + static_cast<uint32_t>(i), cell, terminal_size.value(), std::string(grid->paths[i]), cell_replies[i]);
+        }
+    };
+
+    // Replies with the stage histograms and counters as JSON
+    auto handle_stats = [&](const Request &request) {
+        const auto image_stats = image_cache.stats();
+        const auto disk_stats = disk_cache.stats();
+        const auto &pixmap_stats = pixmap_cache.stats();
+        const auto &tile_stats = tile_cache.stats();
+        const auto &renderer_stats = renderer.stats();
+        const auto json = stats().to_json({
+            {"image_cache_hits", image_stats.hits},
+            {"image_cache_misses", image_stats.misses},
+            {"image_cache_evictions", image_stats.evictions},
+            {"image_cache_bytes", image_stats.used_bytes},
+            {"disk_cache_hits", disk_stats.hits},
+            {"disk_cache_misses", disk_stats.misses},
+            {"disk_cache_writes", disk_stats.writes},
+            {"disk_cache_evictions", disk_stats.evictions},
+            {"disk_cache_bytes", disk_stats.used_bytes},
+            {"pixmap_cache_hits", pixmap_stats.hits},
+            {"pixmap_cache_misses", pixmap_stats.misses},
+            {"pixmap_cache_evictions", pixmap_stats.evictions},
+            {"pixmap_cache_bytes", pixmap_stats.used_bytes},
+            {"tile_cache_hits", tile_stats.hits},
+            {"tile_cache_misses", tile_stats.misses},
+            {"tile_cache_evictions", tile_stats.evictions},
+            {"tile_cache_bytes", tile_stats.used_bytes},
+            {"uploaded_bytes", renderer_stats.uploaded_bytes},
+            {"imlib_renders", renderer_stats.imlib_renders},
+            {"shm_renders", renderer_stats.shm_renders},
+            {"put_renders", renderer_stats.put_renders},
+            {"coalesced_requests", coalesced_requests},
+            {"prefetched_images", prefetched_images},
+            {"terminals", terminals.size()},
+        });
+
+        const auto elapsed = std::chrono::steady_clock::now() - request.received_at;
+        const auto elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        ipc_server.send_to(request.sender, make_reply(request.header.request_id, ReplyStatus::Ok, static_cast<uint64_t>(elapsed_us), json));
+    };
+
+    auto handle_request = [&](const Request &request) {
+        const ReplyFunction reply([&ipc_server, request](ReplyStatus status, std::optional<TimePoint> first_pixel_at) {
+            const auto elapsed = std::chrono::steady_clock::now() - request.received_at;
+            const auto elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+
+            std::string payload;
+            if (status == ReplyStatus::Ok && first_pixel_at.has_value() && shows_image(static_cast<MessageType>(request.header.type))) {
+                const auto first_pixel = first_pixel_at.value() - request.received_at;
+                const auto first_pixel_us = std::chrono::duration_cast<std::chrono::microseconds>(first_pixel).count();
+                payload = make_display_reply_payload(static_cast<uint64_t>(first_pixel_us));
+            }
+
+            ipc_server.send_to(request.sender, make_reply(request.header.request_id, status, static_cast<uint64_t>(elapsed_us), payload));
+        });
+
+        if (request.header.version != protocol_version) {
+            TERMIMG_LOG(Warning) << "Unsupported protocol version " << request.header.version;
+            reply(ReplyStatus::UnsupportedVersion);
+            return;
+        }
+
+        // Quitting stops the server for every terminal, so it needs none, and stats are for all of them
+        if (static_cast<MessageType>(request.header.type) == MessageType::Quit) {
+            epoll.exit_loop();
+            reply(ReplyStatus::Ok);
+            return;
+        }
+        if (static_cast<MessageType>(request.header.type) == MessageType::Stats) {
+            handle_stats(request);
+            return;
+        }
+
+        auto* terminal_ptr = terminals.find(request.terminal_window);
+        if (terminal_ptr == nullptr) {
+            TERMIMG_LOG(Warning) << "No terminal for request " << request.header.request_id;
+            reply(ReplyStatus::NoTerminal);
+            return;
+        }
+        auto &terminal = *terminal_ptr;
+
+        switch (static_cast<MessageType>(request.header.type)) {
+            case MessageType::Clear:
+                ++prefetch_generation;
+                terminal.placements.clear();
+                reply(ReplyStatus::Ok);
+                return;
+            case MessageType::DisplayImage:
+                handle_display(terminal, request, reply);
                 return;
+            case MessageType::DisplayPixels:
+                handle_display_pixels(terminal, request, reply);
+                return;
+            case MessageType::CreatePlacement:
+                handle_create_placement(terminal, request, reply);
+                return;
+            case MessageType::MovePlacement:
+                handle_move_placement(terminal, request, reply);
+                return;
+            case MessageType::RemovePlacement:
+                handle_remove_placement(terminal, request, reply);
+                return;
+            case MessageType::DisplayGrid:
+                handle_display_grid(terminal, request, reply);
+                return;
+            case MessageType::PauseAnimation:
+                handle_animation(terminal, request, reply, true);
+                return;
+            case MessageType::ResumeAnimation:
+                handle_animation(terminal, request, reply, false);
+                return;
+            case MessageType::Prefetch:
+                handle_prefetch(terminal, request, reply);
+                return;
+            case MessageType::SetViewport:
+                handle_viewport(terminal, request, reply);
+                return;
+            default:
+                TERMIMG_LOG(Warning) << "Unrecognized command " << request.header.type;
+                reply(ReplyStatus::InvalidRequest);
+                return;
+        }
+    };
+
+    // Shows every placement again at the positions and sizes its cells now have
+    auto relayout_placements = [&](Terminal &terminal) {
+        const auto terminal_size = get_terminal_size(terminal);
+        if (!terminal_size.has_value()) {
+            return;
+        }
+
+        const ReplyFunction no_reply([](ReplyStatus, std::optional<TimePoint>) {});
+        for (const auto placement_id : terminal.placements.ids()) {
+            auto* placement = terminal.placements.find(placement_id);
+            const auto request = placement->request();
+            if (placement->path().has_value()) {
+                display_path(terminal, placement_id, request, terminal_size.value(), placement->path().value(), no_reply);
             }
+            else {
+                const auto geometry = get_pixel_geometry(terminal_size.value(), request);
+                placement->move(geometry.x, geometry.y);
+            }
+        }
+        TERMIMG_LOG(Debug) << "Laid out " << terminal.placements.size() << " placements again";
+    };
 
-            imlib_context_set_image(image);
-            std::cerr << "Original width: " << imlib_image_get_width() << " height: " << imlib_image_get_height() << std::endl;
+    // Xlib may already have read events into its queue, so everything queued is handled every time.
+    // QueuedAfterReading only reads the socket once the queue is empty and never flushes, unlike XPending.
+    auto process_x_events = [&]() {
+        std::vector<Window> resized;
+        while (XEventsQueued(display_ptr.get(), QueuedAfterReading) > 0) {
+            XEvent x_event;
+            XNextEvent(display_ptr.get(), &x_event);
+
+            if (x_event.type == ConfigureNotify) {
+                auto* terminal = terminals.find(x_event.xconfigure.window);
+                if (terminal != nullptr && terminal->info.on_configure(x_event.xconfigure)
+                    && std::find(resized.begin(), resized.end(), x_event.xconfigure.window) == resized.end()) {
+                    resized.push_back(x_event.xconfigure.window);
+                }
+            }
+            else if (x_event.type == DestroyNotify && terminals.remove(x_event.xdestroywindow.window)) {
+                // Without a terminal of its own there is nothing left to serve
+                if (x_event.xdestroywindow.window == default_terminal_window) {
+                    epoll.exit_loop();
+                }
+            }
+        }
 
-            Imlib_Image cropped_image = scale_image(image, max_width, max_height);
-            imlib_free_image();
-            imlib_context_set_image(cropped_image);
+        // Resizes come in bursts, only the final size is laid out
+        for (const auto window : resized) {
+            auto* terminal = terminals.find(window);
+            if (terminal != nullptr) {
+                terminal->info.refresh_tty_size();
+                relayout_placements(*terminal);
+            }
+        }
+    };
 
-            const int img_width = imlib_image_get_width();
-            const int img_height = imlib_image_get_height();
+    epoll.register_fd(fd_xorg, [&]() {
+        process_x_events();
+    });
 
-            assert(img_width >= 0);
-            assert(img_height >= 0);
+    ipc_server.register_on_messages_handler([&](std::vector<IPCMessage> messages) {
+        std::optional<StageTimer> parse_timer(Stage::Parse);
+        std::vector<Request> requests;
+        std::vector<Window> batch_terminals;
+        for (const auto &message : messages) {
+            const auto frames = parse_request_frames(message.data);
+            if (!frames.has_value()) {
+                TERMIMG_LOG(Warning) << "Dropping malformed datagram of " << message.data.size() << " bytes";
+                continue;
+            }
 
-            const auto width = static_cast<unsigned int>(img_width);
-            const auto height = static_cast<unsigned int>(img_height);
+            Window terminal_window = default_terminal_window;
+            for (const auto &frame : frames.value()) {
+                if (static_cast<MessageType>(frame.header.type) == MessageType::SetTerminal) {
+                    // Clients always name their terminal. A server started for one terminal serves only
+                    // that one, and must not run the window discovery for every shell that talks to it.
+                    if (!daemon) {
+                        continue;
+                    }
 
-            std::cerr << "Cropped width: " << width << " height: " << height << std::endl;
+                    const auto terminal_payload = parse_terminal_payload(frame.payload);
+                    const Terminal* terminal = nullptr;
+                    if (terminal_payload.has_value()) {
+                        const auto window_id = terminal_payload->window_id != 0 ? std::optional<Window>(terminal_payload->window_id) : std::nullopt;
+                        terminal = terminals.find_for_pid(terminal_payload->pid, window_id);
+                    }
+                    terminal_window = terminal != nullptr ? terminal->info.terminal_window() : None;
+                    continue;
+                }
 
-            if (pixmap != -1ul) {
-                XFreePixmap(display_ptr.get(), pixmap);
-                pixmap = -1ul;
+                requests.push_back({frame.header, std::string(frame.payload), message.fds, message.sender, message.received_at, terminal_window});
+                if (std::find(batch_terminals.begin(), batch_terminals.end(), terminal_window) == batch_terminals.end()) {
+                    batch_terminals.push_back(terminal_window);
+                }
             }
+        }
 
-            pixmap = XCreatePixmap(display_ptr.get(), window, width, height, static_cast<unsigned int>(DefaultDepth(display_ptr.get(), screen)));
-            XResizeWindow(display_ptr.get(), window, width, height);
-            XMoveWindow(display_ptr.get(), window, x, y);
+        const auto dropped = coalesce(requests, get_request_slot, [&](const Request &request) {
+            ipc_server.send_to(request.sender, make_reply(request.header.request_id, ReplyStatus::Superseded, 0));
+        });
+        if (dropped > 0) {
+            coalesced_requests += dropped;
+            TERMIMG_LOG(Debug) << "Coalesced " << dropped << " requests, " << coalesced_requests << " in total";
+        }
 
-            imlib_context_set_display(display_ptr.get());
-            imlib_context_set_visual(DefaultVisual(display_ptr.get(), screen));
-            imlib_context_set_colormap(DefaultColormap(display_ptr.get(), screen));
-            imlib_context_set_drawable(pixmap);
+        parse_timer.reset();
 
-            imlib_render_image_on_drawable(0, 0);
-            imlib_free_image();
+        // Font size changes resize the cells without resizing the window
+        for (const auto window : batch_terminals) {
+            auto* terminal = terminals.find(window);
+            if (terminal != nullptr && terminal->info.refresh_tty_size()) {
+                relayout_placements(*terminal);
+            }
+        }
 
-            XSetWindowBackgroundPixmap(display_ptr.get(), window, pixmap);
-            XUnmapWindow(display_ptr.get(), window);
-            XMapRaised(display_ptr.get(), window);
-            XFlushGC(display_ptr.get(), DefaultGC(display_ptr.get(), screen));
-            XFlush(display_ptr.get());
+        for (const auto &request : requests) {
+            handle_request(request);
         }
+
+        process_x_events();
     });
 
     sigset_t mask;
@@ -290,17 +1290,20 @@ int main(int argc, char* argv[]) {
             throw 1;
         }
 
-        std::cerr << "Got signal " << signal_to_string(siginfo.ssi_signo) << std::endl;
+        TERMIMG_LOG(Info) << "Got signal " << signal_to_string(siginfo.ssi_signo);
         epoll.exit_loop();
     });
 
-    XSelectInput(display_ptr.get(), window, ExposureMask);
+    const auto startup = std::chrono::steady_clock::now() - started_at;
+    TERMIMG_LOG(Info) << "Started in " << std::chrono::duration_cast<std::chrono::milliseconds>(startup).count() << "ms";
 
     epoll.run_loop();
-
-    if (pixmap != -1ul) {
-        XFreePixmap(display_ptr.get(), pixmap);
-    }
+    // Terminals is declared first to find the terminal at startup. Its animations unregister from
+    // the epoll and render with the renderer, so they go while those are still there.
+    terminals.clear();
+    // The worker pool goes before the caches holding the other images
+    set_image_releaser(nullptr);
+    flush_log();
 
     return EXIT_SUCCESS;
 }
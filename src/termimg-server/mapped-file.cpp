@@ -0,0 +1,103 @@
+#include "mapped-file.h"
+
+#include <algorithm>
+#include <mutex>
+#include <utility>
+
+#include <cstdint>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// Read ahead of the decoder up front, the kernel's sequential read ahead covers the rest of huge files
+constexpr size_t willneed_bytes = 64 * 1024 * 1024;
+
+// The file the current thread is reading in MappedFile::read
+static thread_local const MappedFile* guarded_file = nullptr;
+static size_t page_size = 4096;
+
+MappedFile::MappedFile(void* mapping, size_t size) : m_mapping(mapping), m_size(size) {}
+
+MappedFile::~MappedFile() {
+    munmap(m_mapping, m_size);
+}
+
+const unsigned char* MappedFile::data() const {
+    return static_cast<const unsigned char*>(m_mapping);
+}
+
+size_t MappedFile::size() const {
+    return m_size;
+}
+
+void MappedFile::handle_sigbus(int, siginfo_t* info, void*) {
+    const MappedFile* file = guarded_file;
+    const auto address = reinterpret_cast<uintptr_t>(info->si_addr);
+    const auto begin = reinterpret_cast<uintptr_t>(file != nullptr ? file->m_mapping : nullptr);
+    if (file == nullptr || address < begin || address >= begin + file->m_size) {
+        // Not a read of a guarded file, the fault repeats once this returns and kills as it always did
+        signal(SIGBUS, SIG_DFL);
+        return;
+    }
+
+    // Zero pages over what is gone let the decoder run to its end, its result is thrown away
+    const uintptr_t page = address - (address - begin) % page_size;
+    if (mmap(reinterpret_cast<void*>(page), file->m_size - (page - begin), PROT_READ, MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0) == MAP_FAILED) {
+        signal(SIGBUS, SIG_DFL);
+        return;
+    }
+    file->m_truncated = 1;
+}
+
+bool MappedFile::read(const std::function<void()> &reader) const {
+    static std::once_flag handler_installed;
+    std::call_once(handler_installed, []() {
+        page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        struct sigaction action{};
+        action.sa_sigaction = handle_sigbus;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGBUS, &action, nullptr) == -1) {
+            perror("sigaction");
+        }
+    });
+
+    // Decoders may nest reads of the same file
+    const MappedFile* outer_file = std::exchange(guarded_file, this);
+    reader();
+    guarded_file = outer_file;
+
+    return m_truncated == 0;
+}
+
+std::unique_ptr<MappedFile> map_file(const std::string &path) {
+    // Failing to open is left to the loaders, which report it with the reason
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return nullptr;
+    }
+
+    struct stat s{};
+    if (fstat(fd, &s) == -1 || !S_ISREG(s.st_mode) || s.st_size <= 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    const auto size = static_cast<size_t>(s.st_size);
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file referenced
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror("mmap");
+        return nullptr;
+    }
+
+    madvise(mapping, size, MADV_SEQUENTIAL);
+    madvise(mapping, std::min(size, willneed_bytes), MADV_WILLNEED);
+
+    return std::make_unique<MappedFile>(mapping, size);
+}
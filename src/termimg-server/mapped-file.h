@@ -0,0 +1,40 @@
+#ifndef TERMIMG_MAPPED_FILE_H
+#define TERMIMG_MAPPED_FILE_H
+
+#include <string>
+#include <memory>
+#include <functional>
+
+#include <csignal>
+#include <cstddef>
+
+
+// A read only mapping of a whole file. Decoders read straight from the page cache instead of
+// through a stdio buffer, and the pages leave the process as soon as the mapping is dropped.
+// Reading a page past the end of a file that shrank raises SIGBUS, so all reads go through read.
+class MappedFile {
+    void* m_mapping;
+    size_t m_size;
+    // Set from the SIGBUS handler, the rest of the mapping reads as zeros after that
+    mutable volatile sig_atomic_t m_truncated = 0;
+
+    static void handle_sigbus(int signal_number, siginfo_t* info, void* context);
+
+public:
+    MappedFile(void* mapping, size_t size);
+    MappedFile(const MappedFile&) = delete;
+    MappedFile(MappedFile&&) = delete;
+    ~MappedFile();
+
+    [[nodiscard]] const unsigned char* data() const;
+    [[nodiscard]] size_t size() const;
+    // Runs reader, which may read the mapping on this thread. Returns false when the file shrank
+    // under it, whatever reader made of the data is garbage then and the file has to be read by path.
+    bool read(const std::function<void()> &reader) const;
+};
+
+// Returns nullptr for files that cannot be mapped, like empty ones, so callers read by path instead
+std::unique_ptr<MappedFile> map_file(const std::string &path);
+
+
+#endif //TERMIMG_MAPPED_FILE_H
@@ -0,0 +1,117 @@
+#include "pixmap-cache.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "log.h"
+#include "tiles.h"
+
+
+// Pixmaps put after a shrink before the budget grows back by a step
+constexpr size_t puts_per_budget_step = 32;
+// The budget shrinks no lower than, and grows back in steps of, this part of the configured budget
+constexpr size_t budget_step_divisor = 8;
+
+template<typename Key>
+BasicPixmapCache<Key>::BasicPixmapCache(std::shared_ptr<Display> display, int depth, size_t budget_bytes)
+    : m_display(std::move(display)), m_bytes_per_pixel(depth > 16 ? 4 : depth > 8 ? 2 : 1),
+      m_configured_budget_bytes(budget_bytes), m_budget_bytes(budget_bytes) {
+}
+
+template<typename Key>
+BasicPixmapCache<Key>::~BasicPixmapCache() {
+    for (const auto &[key, cached_pixmap] : m_lru) {
+        XFreePixmap(m_display.get(), cached_pixmap.pixmap);
+    }
+}
+
+template<typename Key>
+std::optional<CachedPixmap> BasicPixmapCache<Key>::get(const Key &key) {
+    const auto it = m_index.find(key);
+    if (it == m_index.end()) {
+        ++m_stats.misses;
+        return std::nullopt;
+    }
+
+    ++m_stats.hits;
+    m_lru.splice(m_lru.begin(), m_lru, it->second);
+    return it->second->second;
+}
+
+template<typename Key>
+void BasicPixmapCache<Key>::put(const Key &key, CachedPixmap cached_pixmap) {
+    regrow();
+
+    const auto bytes = size_bytes(cached_pixmap);
+    if (bytes > m_budget_bytes) {
+        XFreePixmap(m_display.get(), cached_pixmap.pixmap);
+        return;
+    }
+
+    const auto it = m_index.find(key);
+    if (it != m_index.end()) {
+        m_stats.used_bytes -= size_bytes(it->second->second);
+        XFreePixmap(m_display.get(), it->second->second.pixmap);
+        m_lru.erase(it->second);
+        m_index.erase(it);
+    }
+
+    evict_until_fits(bytes);
+
+    m_lru.emplace_front(key, cached_pixmap);
+    m_index.insert({key, m_lru.begin()});
+    m_stats.used_bytes += bytes;
+    m_stats.entries = m_lru.size();
+}
+
+template<typename Key>
+bool BasicPixmapCache<Key>::contains(const Key &key) const {
+    return m_index.count(key) > 0;
+}
+
+template<typename Key>
+void BasicPixmapCache<Key>::shrink() {
+    m_budget_bytes = std::max(m_stats.used_bytes / 2, m_configured_budget_bytes / budget_step_divisor);
+    m_puts_since_resize = 0;
+    TERMIMG_LOG(Warning) << "Shrinking pixmap cache to " << m_budget_bytes << " bytes";
+    evict_until_fits(0);
+}
+
+template<typename Key>
+void BasicPixmapCache<Key>::regrow() {
+    if (m_budget_bytes >= m_configured_budget_bytes || ++m_puts_since_resize < puts_per_budget_step) {
+        return;
+    }
+
+    m_budget_bytes = std::min(m_budget_bytes + m_configured_budget_bytes / budget_step_divisor, m_configured_budget_bytes);
+    m_puts_since_resize = 0;
+    TERMIMG_LOG(Info) << "Growing pixmap cache back to " << m_budget_bytes << " bytes";
+}
+
+template<typename Key>
+const PixmapCacheStats& BasicPixmapCache<Key>::stats() const {
+    return m_stats;
+}
+
+template<typename Key>
+size_t BasicPixmapCache<Key>::size_bytes(const CachedPixmap &cached_pixmap) const {
+    return static_cast<size_t>(cached_pixmap.width) * static_cast<size_t>(cached_pixmap.height) * m_bytes_per_pixel;
+}
+
+template<typename Key>
+void BasicPixmapCache<Key>::evict_until_fits(size_t bytes) {
+    while (!m_lru.empty() && m_stats.used_bytes + bytes > m_budget_bytes) {
+        const auto &[key, cached_pixmap] = m_lru.back();
+        m_stats.used_bytes -= size_bytes(cached_pixmap);
+        // Windows keep their own reference to a background pixmap, so this is safe while it is displayed
+        XFreePixmap(m_display.get(), cached_pixmap.pixmap);
+        m_index.erase(key);
+        m_lru.pop_back();
+        ++m_stats.evictions;
+    }
+
+    m_stats.entries = m_lru.size();
+}
+
+template class BasicPixmapCache<ImageKey>;
+template class BasicPixmapCache<TileKey>;
@@ -0,0 +1,73 @@
+#ifndef TERMIMG_PIXMAP_CACHE_H
+#define TERMIMG_PIXMAP_CACHE_H
+
+#include <list>
+#include <map>
+#include <memory>
+#include <optional>
+#include <utility>
+
+#include <cstddef>
+#include <cstdint>
+
+#include <X11/Xlib.h>
+
+#include "image.h"
+
+
+struct CachedPixmap {
+    Pixmap pixmap;
+    unsigned int width;
+    unsigned int height;
+};
+
+struct PixmapCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t used_bytes = 0;
+    size_t entries = 0;
+};
+
+// LRU pool of rendered server side pixmaps bounded by the X server memory they occupy.
+// Instantiated for whole images by ImageKey and for tiles by TileKey.
+template<typename Key>
+class BasicPixmapCache {
+private:
+    using Entry = std::pair<Key, CachedPixmap>;
+
+    const std::shared_ptr<Display> m_display;
+    const size_t m_bytes_per_pixel;
+    const size_t m_configured_budget_bytes;
+    // Lowered by shrink, it grows back as pixmaps keep being created without running out
+    size_t m_budget_bytes;
+    size_t m_puts_since_resize = 0;
+    std::list<Entry> m_lru;
+    std::map<Key, typename std::list<Entry>::iterator> m_index;
+    PixmapCacheStats m_stats;
+
+    [[nodiscard]] size_t size_bytes(const CachedPixmap &cached_pixmap) const;
+    void evict_until_fits(size_t bytes);
+    void regrow();
+
+public:
+    BasicPixmapCache(std::shared_ptr<Display> display, int depth, size_t budget_bytes);
+    BasicPixmapCache(const BasicPixmapCache&) = delete;
+    ~BasicPixmapCache();
+
+    std::optional<CachedPixmap> get(const Key &key);
+    // Takes ownership of the pixmap, it is freed right away if it does not fit the budget
+    void put(const Key &key, CachedPixmap cached_pixmap);
+    // Does not count as a use of the entry
+    [[nodiscard]] bool contains(const Key &key) const;
+    // Evicts down to half the current usage and lowers the budget accordingly, though never below
+    // an eighth of the configured budget
+    void shrink();
+
+    [[nodiscard]] const PixmapCacheStats& stats() const;
+};
+
+using PixmapCache = BasicPixmapCache<ImageKey>;
+
+
+#endif //TERMIMG_PIXMAP_CACHE_H
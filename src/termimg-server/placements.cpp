@@ -0,0 +1,172 @@
+#include "placements.h"
+
+#include <utility>
+
+#include "log.h"
+
+
+Placement::Placement(std::shared_ptr<Display> display, Window parent, int screen, Colormap colormap)
+    : m_display(std::move(display)),
+      m_window([&]() {
+          // No ExposureMask, the server repaints exposed areas from the background pixmap by itself
+          XSetWindowAttributes attributes;
+          attributes.colormap = colormap;
+          attributes.background_pixel = 0;
+          attributes.border_pixel = 0;
+          return XCreateWindow(
+              m_display.get(),
+              parent,
+              0, 0,
+              50, 50,
+              1,
+              DefaultDepth(m_display.get(), screen),
+              InputOutput,
+              XDefaultVisual(m_display.get(), screen),
+              CWBackPixel | CWColormap | CWBorderPixel,
+              &attributes
+          );
+      }()),
+      m_generation(std::make_shared<std::atomic<uint64_t>>(0)),
+      m_viewport_source(std::make_shared<ViewportSource>()) {
+}
+
+Placement::~Placement() {
+    // Whatever is still decoding for this placement is no longer wanted
+    ++*m_generation;
+    XDestroyWindow(m_display.get(), m_window);
+    XFlush(m_display.get());
+}
+
+Window Placement::window() const {
+    return m_window;
+}
+
+std::shared_ptr<std::atomic<uint64_t>> Placement::generation() const {
+    return m_generation;
+}
+
+uint64_t Placement::supersede() {
+    return ++*m_generation;
+}
+
+void Placement::set_request(const DisplayPayload &request, std::optional<std::string> path) {
+    if (path != m_path) {
+        m_viewport = Viewport{};
+        m_viewport_source = std::make_shared<ViewportSource>();
+    }
+    m_request = request;
+    m_path = std::move(path);
+}
+
+const DisplayPayload& Placement::request() const {
+    return m_request;
+}
+
+const std::optional<std::string>& Placement::path() const {
+    return m_path;
+}
+
+void Placement::set_position(int x, int y) {
+    m_x = x;
+    m_y = y;
+}
+
+int Placement::x() const {
+    return m_x;
+}
+
+int Placement::y() const {
+    return m_y;
+}
+
+void Placement::show(const CachedPixmap &cached_pixmap) {
+    m_animation.reset();
+    XSetWindowBackgroundPixmap(m_display.get(), m_window, cached_pixmap.pixmap);
+    XMoveResizeWindow(m_display.get(), m_window, m_x, m_y, cached_pixmap.width, cached_pixmap.height);
+    if (m_mapped) {
+        // Unmapping would expose the terminal below, which would redraw its text just to have it covered again
+        XRaiseWindow(m_display.get(), m_window);
+        XClearWindow(m_display.get(), m_window);
+    }
+    else {
+        XMapRaised(m_display.get(), m_window);
+        m_mapped = true;
+    }
+    XFlush(m_display.get());
+}
+
+void Placement::move(int x, int y) {
+    set_position(x, y);
+    XMoveWindow(m_display.get(), m_window, x, y);
+    XFlush(m_display.get());
+}
+
+void Placement::play(std::unique_ptr<Animation> animation) {
+    m_animation = std::move(animation);
+    m_animation->start();
+}
+
+void Placement::show_frame(Pixmap pixmap) {
+    XSetWindowBackgroundPixmap(m_display.get(), m_window, pixmap);
+    XClearWindow(m_display.get(), m_window);
+    XFlush(m_display.get());
+}
+
+Animation* Placement::animation() const {
+    return m_animation.get();
+}
+
+Viewport& Placement::viewport() {
+    return m_viewport;
+}
+
+std::shared_ptr<ViewportSource> Placement::viewport_source() const {
+    return m_viewport_source;
+}
+
+Placements::Placements(std::shared_ptr<Display> display, Window parent, int screen)
+    : m_display(std::move(display)), m_parent(parent), m_screen(screen),
+      m_colormap(XCreateColormap(m_display.get(), XDefaultRootWindow(m_display.get()),
+                                 XDefaultVisual(m_display.get(), m_screen), AllocNone)) {
+}
+
+Placements::~Placements() {
+    m_placements.clear();
+    XFreeColormap(m_display.get(), m_colormap);
+}
+
+Placement& Placements::get_or_create(uint32_t placement_id) {
+    auto &placement = m_placements[placement_id];
+    if (!placement) {
+        placement = std::make_unique<Placement>(m_display, m_parent, m_screen, m_colormap);
+        TERMIMG_LOG(Debug) << "Created placement " << placement_id << ", " << m_placements.size() << " in total";
+    }
+
+    return *placement;
+}
+
+Placement* Placements::find(uint32_t placement_id) {
+    const auto it = m_placements.find(placement_id);
+    return it != m_placements.end() ? it->second.get() : nullptr;
+}
+
+bool Placements::remove(uint32_t placement_id) {
+    return m_placements.erase(placement_id) > 0;
+}
+
+void Placements::clear() {
+    m_placements.clear();
+}
+
+std::vector<uint32_t> Placements::ids() const {
+    std::vector<uint32_t> placement_ids;
+    placement_ids.reserve(m_placements.size());
+    for (const auto &[placement_id, placement] : m_placements) {
+        placement_ids.push_back(placement_id);
+    }
+    return placement_ids;
+}
+
+size_t Placements::size() const {
+    return m_placements.size();
+}
@@ -0,0 +1,98 @@
+#ifndef TERMIMG_PLACEMENTS_H
+#define TERMIMG_PLACEMENTS_H
+
+#include <string>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <atomic>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+#include <X11/Xlib.h>
+
+#include "animation.h"
+#include "pixmap-cache.h"
+#include "protocol.h"
+#include "viewport.h"
+
+
+// A child window of the terminal showing one image
+class Placement {
+private:
+    const std::shared_ptr<Display> m_display;
+    const Window m_window;
+    // Bumped whenever the content changes, so in-flight decodes can tell they are no longer wanted.
+    // Shared so workers can still check it after the placement is removed.
+    const std::shared_ptr<std::atomic<uint64_t>> m_generation;
+    // What was last requested, a move to a new cell box displays it again at the new size
+    DisplayPayload m_request{};
+    std::optional<std::string> m_path;
+    int m_x = 0;
+    int m_y = 0;
+    bool m_mapped = false;
+    std::unique_ptr<Animation> m_animation;
+    Viewport m_viewport;
+    // Replaced along with the path, so workers still decoding the old one do not fill the new one
+    std::shared_ptr<ViewportSource> m_viewport_source;
+
+public:
+    Placement(std::shared_ptr<Display> display, Window parent, int screen, Colormap colormap);
+    Placement(const Placement&) = delete;
+    ~Placement();
+
+    [[nodiscard]] Window window() const;
+    [[nodiscard]] std::shared_ptr<std::atomic<uint64_t>> generation() const;
+    // Bumps the generation and returns the new one
+    uint64_t supersede();
+
+    // A different path starts over with the default viewport
+    void set_request(const DisplayPayload &request, std::optional<std::string> path);
+    [[nodiscard]] const DisplayPayload& request() const;
+    [[nodiscard]] const std::optional<std::string>& path() const;
+
+    // Where the next image is shown, without moving what is shown now
+    void set_position(int x, int y);
+    [[nodiscard]] int x() const;
+    [[nodiscard]] int y() const;
+    // Replaces whatever is shown, stopping a running animation
+    void show(const CachedPixmap &cached_pixmap);
+    void move(int x, int y);
+
+    // The first frame has to be shown already
+    void play(std::unique_ptr<Animation> animation);
+    // Swaps the background for the next frame of an animation of the same size
+    void show_frame(Pixmap pixmap);
+    [[nodiscard]] Animation* animation() const;
+
+    [[nodiscard]] Viewport& viewport();
+    [[nodiscard]] std::shared_ptr<ViewportSource> viewport_source() const;
+};
+
+// Placements by the id clients gave them, id 0 is the default used by display and display pixels
+class Placements {
+private:
+    const std::shared_ptr<Display> m_display;
+    const Window m_parent;
+    const int m_screen;
+    const Colormap m_colormap;
+    std::unordered_map<uint32_t, std::unique_ptr<Placement>> m_placements;
+
+public:
+    Placements(std::shared_ptr<Display> display, Window parent, int screen);
+    Placements(const Placements&) = delete;
+    ~Placements();
+
+    Placement& get_or_create(uint32_t placement_id);
+    Placement* find(uint32_t placement_id);
+    bool remove(uint32_t placement_id);
+    void clear();
+
+    [[nodiscard]] std::vector<uint32_t> ids() const;
+    [[nodiscard]] size_t size() const;
+};
+
+
+#endif //TERMIMG_PLACEMENTS_H
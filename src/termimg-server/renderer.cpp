@@ -0,0 +1,292 @@
+#include "renderer.h"
+
+#include <string_view>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include <bit>
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/Xutil.h>
+
+#include "log.h"
+
+
+static bool shm_attach_failed = false;
+
+static int trap_shm_error(Display*, XErrorEvent*) {
+    shm_attach_failed = true;
+    return 0;
+}
+
+static bool is_local_display(Display* display) {
+    const std::string_view display_string = DisplayString(display);
+    return display_string.starts_with(":") || display_string.starts_with("unix:");
+}
+
+// Imlib2 blends an image with alpha onto what the drawable holds, and the pixmaps rendered to are new
+// with undefined contents. Both paths flatten alpha onto black instead, rounded the way Imlib2 blends.
+static uint32_t flatten_pixel(uint32_t pixel) {
+    const uint32_t alpha = pixel >> 24;
+    uint32_t result = 0xff000000;
+    for (const int shift : {16, 8, 0}) {
+        const uint32_t product = ((pixel >> shift) & 0xff) * alpha + 0x80;
+        result |= ((product + (product >> 8)) >> 8) << shift;
+    }
+
+    return result;
+}
+
+static void copy_pixels(uint32_t* destination, const DATA32* source, size_t count, bool flatten) {
+    if (!flatten) {
+        std::memcpy(destination, source, count * 4);
+        return;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        destination[i] = flatten_pixel(static_cast<uint32_t>(source[i]));
+    }
+}
+
+const char* render_path_to_string(RenderPath render_path) {
+    switch (render_path) {
+        case RenderPath::Imlib: return "imlib";
+        case RenderPath::Shm: return "MIT-SHM";
+        case RenderPath::Put: return "XPutImage";
+        default: return "unknown";
+    }
+}
+
+Renderer::Renderer(std::shared_ptr<Display> display, int screen, bool use_shm) : m_display(std::move(display)), m_screen(screen), m_argb_visual(visual_matches_argb()) {
+    if (!use_shm) {
+        TERMIMG_LOG(Info) << "MIT-SHM disabled";
+    }
+    else if (!is_local_display(m_display.get())) {
+        TERMIMG_LOG(Warning) << "MIT-SHM unavailable, display is not local";
+    }
+    else if (!XShmQueryExtension(m_display.get())) {
+        TERMIMG_LOG(Warning) << "MIT-SHM unavailable, extension missing";
+    }
+    else if (!m_argb_visual) {
+        TERMIMG_LOG(Warning) << "MIT-SHM unavailable, visual does not match ARGB";
+    }
+    else {
+        m_shm_available = true;
+    }
+
+    m_segment.shmid = -1;
+    const auto small_render_path = m_argb_visual ? RenderPath::Put : RenderPath::Imlib;
+    TERMIMG_LOG(Info) << "Render path for large images: " << render_path_to_string(m_shm_available ? RenderPath::Shm : small_render_path)
+                      << " for small images: " << render_path_to_string(small_render_path);
+}
+
+Renderer::~Renderer() {
+    destroy_segment();
+}
+
+RenderPath Renderer::render(const Image &image, Drawable drawable) {
+    const auto pixels = static_cast<size_t>(image.width()) * static_cast<size_t>(image.height());
+    m_stats.uploaded_bytes += image.size_bytes();
+    if (m_shm_available && pixels >= shm_min_pixels && render_shm(image, drawable)) {
+        ++m_stats.shm_renders;
+        return RenderPath::Shm;
+    }
+
+    if (m_argb_visual && render_put(image, drawable)) {
+        ++m_stats.put_renders;
+        return RenderPath::Put;
+    }
+
+    render_imlib(image, drawable);
+    ++m_stats.imlib_renders;
+    return RenderPath::Imlib;
+}
+
+const RendererStats& Renderer::stats() const {
+    return m_stats;
+}
+
+// Imlib2 stores pixels as native endian ARGB, which a 24 or 32 bit TrueColor
+// ZPixmap with these masks and the host byte order can take as is
+bool Renderer::visual_matches_argb() const {
+    const Visual* visual = DefaultVisual(m_display.get(), m_screen);
+    const int depth = DefaultDepth(m_display.get(), m_screen);
+    const int host_byte_order = std::endian::native == std::endian::little ? LSBFirst : MSBFirst;
+
+    return (depth == 24 || depth == 32)
+        && visual->red_mask == 0xff0000
+        && visual->green_mask == 0x00ff00
+        && visual->blue_mask == 0x0000ff
+        && ImageByteOrder(m_display.get()) == host_byte_order;
+}
+
+bool Renderer::ensure_segment(size_t size) {
+    if (m_segment_in_use) {
+        // Make sure the X server is done reading the previous image before overwriting it
+        XSync(m_display.get(), False);
+        m_segment_in_use = false;
+    }
+
+    if (size <= m_segment_size) {
+        return true;
+    }
+
+    destroy_segment();
+
+    m_segment.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+    if (m_segment.shmid == -1) {
+        perror("shmget");
+        return false;
+    }
+
+    m_segment.shmaddr = static_cast<char*>(shmat(m_segment.shmid, nullptr, 0));
+    if (m_segment.shmaddr == reinterpret_cast<char*>(-1)) {
+        perror("shmat");
+        shmctl(m_segment.shmid, IPC_RMID, nullptr);
+        m_segment.shmid = -1;
+        return false;
+    }
+    m_segment.readOnly = True;
+
+    shm_attach_failed = false;
+    XSync(m_display.get(), False);
+    const auto previous_handler = XSetErrorHandler(trap_shm_error);
+    XShmAttach(m_display.get(), &m_segment);
+    XSync(m_display.get(), False);
+    XSetErrorHandler(previous_handler);
+
+    // Marked for removal right away, it goes away once both ends have detached
+    shmctl(m_segment.shmid, IPC_RMID, nullptr);
+
+    if (shm_attach_failed) {
+        TERMIMG_LOG(Warning) << "XShmAttach failed, falling back to imlib rendering";
+        shmdt(m_segment.shmaddr);
+        m_segment.shmid = -1;
+        m_shm_available = false;
+        return false;
+    }
+
+    m_segment_size = size;
+    return true;
+}
+
+void Renderer::destroy_segment() {
+    if (m_segment.shmid == -1) {
+        return;
+    }
+
+    if (m_segment_size > 0) {
+        XShmDetach(m_display.get(), &m_segment);
+        XSync(m_display.get(), False);
+    }
+    shmdt(m_segment.shmaddr);
+    m_segment.shmid = -1;
+    m_segment_size = 0;
+    m_segment_in_use = false;
+}
+
+bool Renderer::render_shm(const Image &image, Drawable drawable) {
+    const auto width = static_cast<unsigned int>(image.width());
+    const auto height = static_cast<unsigned int>(image.height());
+
+    XImage* x_image = XShmCreateImage(
+            m_display.get(),
+            DefaultVisual(m_display.get(), m_screen),
+            static_cast<unsigned int>(DefaultDepth(m_display.get(), m_screen)),
+            ZPixmap,
+            nullptr,
+            &m_segment,
+            width,
+            height);
+    if (x_image == nullptr) {
+        return false;
+    }
+
+    const auto bytes_per_line = static_cast<size_t>(x_image->bytes_per_line);
+    if (x_image->bits_per_pixel != 32 || !ensure_segment(bytes_per_line * height)) {
+        XDestroyImage(x_image);
+        return false;
+    }
+    x_image->data = m_segment.shmaddr;
+
+    for (unsigned int row = 0; row < height; ++row) {
+        copy_pixels(reinterpret_cast<uint32_t*>(m_segment.shmaddr + row * bytes_per_line), image.pixels() + static_cast<size_t>(row) * width, width, image.has_alpha());
+    }
+
+    XShmPutImage(m_display.get(), drawable, DefaultGC(m_display.get(), m_screen), x_image, 0, 0, 0, 0, width, height, False);
+    m_segment_in_use = true;
+
+    // The data belongs to the segment, XDestroyImage must not free it
+    x_image->data = nullptr;
+    XDestroyImage(x_image);
+    return true;
+}
+
+bool Renderer::render_put(const Image &image, Drawable drawable) {
+    const auto width = static_cast<unsigned int>(image.width());
+    const auto height = static_cast<unsigned int>(image.height());
+
+    // Without alpha the pixels go out as they are, XPutImage only reads them
+    std::vector<uint32_t> flattened_pixels;
+    auto* data = const_cast<DATA32*>(image.pixels());
+    if (image.has_alpha()) {
+        flattened_pixels.resize(static_cast<size_t>(width) * height);
+        copy_pixels(flattened_pixels.data(), image.pixels(), flattened_pixels.size(), true);
+        data = flattened_pixels.data();
+    }
+
+    XImage* x_image = XCreateImage(
+            m_display.get(),
+            DefaultVisual(m_display.get(), m_screen),
+            static_cast<unsigned int>(DefaultDepth(m_display.get(), m_screen)),
+            ZPixmap,
+            0,
+            reinterpret_cast<char*>(data),
+            width,
+            height,
+            32,
+            static_cast<int>(width * 4));
+    if (x_image == nullptr) {
+        return false;
+    }
+
+    const bool matches = x_image->bits_per_pixel == 32;
+    if (matches) {
+        XPutImage(m_display.get(), drawable, DefaultGC(m_display.get(), m_screen), x_image, 0, 0, 0, 0, width, height);
+    }
+
+    // The data belongs to the image, XDestroyImage must not free it
+    x_image->data = nullptr;
+    XDestroyImage(x_image);
+    return matches;
+}
+
+void Renderer::render_imlib(const Image &image, Drawable drawable) {
+    std::shared_ptr<Image> flattened;
+    if (image.has_alpha()) {
+        auto flattened_pixels = std::make_shared<std::vector<uint32_t>>(static_cast<size_t>(image.width()) * static_cast<size_t>(image.height()));
+        copy_pixels(flattened_pixels->data(), image.pixels(), flattened_pixels->size(), true);
+        flattened = image_from_pixels(std::move(flattened_pixels), image.width(), image.height(), false);
+    }
+    const Image &rendered = flattened ? *flattened : image;
+
+    std::lock_guard lock(imlib_mutex());
+    const Imlib_Image rendered_image = rendered.get();
+    if (!rendered_image) {
+        TERMIMG_LOG(Warning) << "Could not create an Imlib2 image to render";
+        return;
+    }
+
+    imlib_context_set_display(m_display.get());
+    imlib_context_set_visual(DefaultVisual(m_display.get(), m_screen));
+    imlib_context_set_colormap(DefaultColormap(m_display.get(), m_screen));
+    imlib_context_set_drawable(drawable);
+    imlib_context_set_image(rendered_image);
+
+    imlib_render_image_on_drawable(0, 0);
+}
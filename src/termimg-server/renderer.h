@@ -0,0 +1,67 @@
+#ifndef TERMIMG_RENDERER_H
+#define TERMIMG_RENDERER_H
+
+#include <memory>
+
+#include <cstddef>
+#include <cstdint>
+
+#include <X11/Xlib.h>
+#include <X11/extensions/XShm.h>
+
+#include "image.h"
+
+
+enum class RenderPath {
+    Imlib,
+    Shm,
+    Put,
+};
+
+const char* render_path_to_string(RenderPath render_path);
+
+struct RendererStats {
+    uint64_t imlib_renders = 0;
+    uint64_t shm_renders = 0;
+    uint64_t put_renders = 0;
+    // Pixel data sent to the X server, through either path
+    uint64_t uploaded_bytes = 0;
+};
+
+// Uploads images to pixmaps. Large images go through a reused MIT-SHM segment when
+// the X server is local and supports it, everything else through XPutImage. Only visuals
+// that do not take ARGB pixels as they are need Imlib2, and with it imlib_mutex.
+class Renderer {
+private:
+    const std::shared_ptr<Display> m_display;
+    const int m_screen;
+    const bool m_argb_visual;
+    bool m_shm_available = false;
+    XShmSegmentInfo m_segment{};
+    size_t m_segment_size = 0;
+    // Set after XShmPutImage, the X server may still be reading the segment until the next sync
+    bool m_segment_in_use = false;
+    RendererStats m_stats;
+
+    // Below this many pixels the protocol stream is cheaper than syncing on the segment
+    constexpr static size_t shm_min_pixels = 128 * 128;
+
+    [[nodiscard]] bool visual_matches_argb() const;
+    bool ensure_segment(size_t size);
+    void destroy_segment();
+    bool render_shm(const Image &image, Drawable drawable);
+    bool render_put(const Image &image, Drawable drawable);
+    void render_imlib(const Image &image, Drawable drawable);
+
+public:
+    Renderer(std::shared_ptr<Display> display, int screen, bool use_shm);
+    Renderer(const Renderer&) = delete;
+    ~Renderer();
+
+    RenderPath render(const Image &image, Drawable drawable);
+
+    [[nodiscard]] const RendererStats& stats() const;
+};
+
+
+#endif //TERMIMG_RENDERER_H
@@ -0,0 +1,141 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+
+#include <Imlib2.h>
+
+#include "scaler.h"
+
+
+// The box filter snaps boxes to whole source pixels where Imlib2 weighs partial ones,
+// on smooth images that moves a channel by a few steps at most
+constexpr int max_channel_difference = 5;
+
+struct TestImage {
+    const char* name;
+    int width;
+    int height;
+    uint32_t (*pixel)(int x, int y, int width, int height);
+};
+
+static uint32_t argb(uint32_t a, uint32_t r, uint32_t g, uint32_t b) {
+    return a << 24 | r << 16 | g << 8 | b;
+}
+
+static uint32_t channel(double value) {
+    return static_cast<uint32_t>(std::clamp(std::lround(value), 0L, 255L));
+}
+
+static uint32_t gradient(int x, int y, int width, int height) {
+    const double fx = static_cast<double>(x) / width;
+    const double fy = static_cast<double>(y) / height;
+    return argb(255, channel(255 * fx), channel(255 * fy), channel(255 * (1 - fx) * fy));
+}
+
+static uint32_t waves(int x, int y, int width, int height) {
+    const double fx = static_cast<double>(x) / width;
+    const double fy = static_cast<double>(y) / height;
+    return argb(255, channel(127.5 + 127.5 * std::sin(6.28 * fx)), channel(127.5 + 127.5 * std::cos(6.28 * fy)), channel(127.5 + 127.5 * std::sin(6.28 * (fx + fy))));
+}
+
+// Imlib2 weighs colors by alpha, which only matches a plain average when alpha is the same everywhere
+static uint32_t translucent(int x, int y, int width, int height) {
+    return (gradient(x, y, width, height) & 0x00ffffff) | argb(128, 0, 0, 0);
+}
+
+static std::vector<uint32_t> imlib_downscale(std::vector<uint32_t> &pixels, int src_width, int src_height, int dst_width, int dst_height, bool has_alpha) {
+    const Imlib_Image image = imlib_create_image_using_data(src_width, src_height, pixels.data());
+    imlib_context_set_image(image);
+    imlib_image_set_has_alpha(has_alpha ? 1 : 0);
+    imlib_context_set_anti_alias(1);
+
+    const Imlib_Image scaled = imlib_create_cropped_scaled_image(0, 0, src_width, src_height, dst_width, dst_height);
+    imlib_context_set_image(scaled);
+    const DATA32* scaled_pixels = imlib_image_get_data_for_reading_only();
+    std::vector<uint32_t> result(scaled_pixels, scaled_pixels + static_cast<size_t>(dst_width) * static_cast<size_t>(dst_height));
+    imlib_free_image();
+
+    imlib_context_set_image(image);
+    imlib_free_image();
+    return result;
+}
+
+static int max_difference(const std::vector<uint32_t> &a, const std::vector<uint32_t> &b, bool has_alpha) {
+    int difference = 0;
+    for (size_t i = 0; i < a.size(); ++i) {
+        for (int shift = 0; shift < (has_alpha ? 32 : 24); shift += 8) {
+            const int channel_a = static_cast<int>((a[i] >> shift) & 0xff);
+            const int channel_b = static_cast<int>((b[i] >> shift) & 0xff);
+            difference = std::max(difference, std::abs(channel_a - channel_b));
+        }
+    }
+    return difference;
+}
+
+int main() {
+    const TestImage images[] = {
+        {"gradient", 1000, 700, gradient},
+        {"waves", 1536, 1024, waves},
+        {"translucent", 640, 480, translucent},
+        // Large enough for box_downscale to split it into bands for four threads
+        {"waves", 2560, 1800, waves},
+    };
+    const struct {
+        int width;
+        int height;
+    } sizes[] = {{500, 350}, {333, 211}, {97, 61}, {10, 7}};
+
+    // Only kernels the CPU can run
+    std::vector<BoxKernel> kernels = {BoxKernel::Scalar};
+    const auto best_kernel = detect_box_kernel();
+    if (best_kernel == BoxKernel::Sse2 || best_kernel == BoxKernel::Avx2) {
+        kernels.push_back(BoxKernel::Sse2);
+    }
+    if (best_kernel == BoxKernel::Avx2) {
+        kernels.push_back(BoxKernel::Avx2);
+    }
+
+    bool ok = true;
+    for (const auto &test_image : images) {
+        std::vector<uint32_t> pixels(static_cast<size_t>(test_image.width) * static_cast<size_t>(test_image.height));
+        for (int y = 0; y < test_image.height; ++y) {
+            for (int x = 0; x < test_image.width; ++x) {
+                pixels[static_cast<size_t>(y) * static_cast<size_t>(test_image.width) + static_cast<size_t>(x)] = test_image.pixel(x, y, test_image.width, test_image.height);
+            }
+        }
+        const bool has_alpha = test_image.pixel == translucent;
+
+        for (const auto &size : sizes) {
+            const auto expected = imlib_downscale(pixels, test_image.width, test_image.height, size.width, size.height, has_alpha);
+
+            for (const auto kernel : kernels) {
+                std::vector<uint32_t> single_band;
+                for (const unsigned int thread_count : {1u, 4u}) {
+                    std::vector<uint32_t> scaled(expected.size());
+                    box_downscale(pixels.data(), test_image.width, test_image.height, static_cast<size_t>(test_image.width),
+                                  scaled.data(), size.width, size.height, kernel, thread_count);
+
+                    const int difference = max_difference(expected, scaled, has_alpha);
+                    // Every band sums the same boxes, so splitting must not change a single bit
+                    const bool same_as_single_band = single_band.empty() || scaled == single_band;
+                    const bool passed = difference <= max_channel_difference && same_as_single_band;
+                    ok = ok && passed;
+                    std::cout << (passed ? "ok   " : "FAIL ") << test_image.name << " " << test_image.width << "x" << test_image.height
+                              << " to " << size.width << "x" << size.height << " " << box_kernel_to_string(kernel)
+                              << " threads: " << thread_count << " max difference: " << difference
+                              << (same_as_single_band ? "" : " differs from one thread") << std::endl;
+
+                    if (single_band.empty()) {
+                        single_band = std::move(scaled);
+                    }
+                }
+            }
+        }
+    }
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
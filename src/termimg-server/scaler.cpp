@@ -0,0 +1,209 @@
+#include "scaler.h"
+
+#include <vector>
+#include <thread>
+#include <algorithm>
+
+#include <cassert>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TERMIMG_X86 1
+#endif
+
+
+// Source pixels covered by one destination pixel, 255 * this has to fit an int32
+constexpr uint64_t max_box_area = 8u * 1024 * 1024;
+
+// Below this many source pixels starting threads costs more than it saves
+constexpr uint64_t min_pixels_per_thread = 1024 * 1024;
+
+std::optional<Scaler> scaler_from_string(std::string_view name) {
+    if (name == "imlib") return Scaler::Imlib;
+    if (name == "box") return Scaler::Box;
+    if (name == "auto") return Scaler::Auto;
+    return std::nullopt;
+}
+
+const char* box_kernel_to_string(BoxKernel kernel) {
+    switch (kernel) {
+        case BoxKernel::Scalar: return "scalar";
+        case BoxKernel::Sse2: return "SSE2";
+        case BoxKernel::Avx2: return "AVX2";
+        default: return "unknown";
+    }
+}
+
+BoxKernel detect_box_kernel() {
+#ifdef TERMIMG_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return BoxKernel::Avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return BoxKernel::Sse2;
+    }
+#endif
+    return BoxKernel::Scalar;
+}
+
+bool can_box_downscale(int src_width, int src_height, int dst_width, int dst_height) {
+    if (dst_width <= 0 || dst_height <= 0 || dst_width > src_width || dst_height > src_height) {
+        return false;
+    }
+
+    const auto box_width = static_cast<uint64_t>((src_width + dst_width - 1) / dst_width);
+    const auto box_height = static_cast<uint64_t>((src_height + dst_height - 1) / dst_height);
+    return box_width * box_height <= max_box_area;
+}
+
+// First source pixel covered by destination pixel i
+static int box_start(int i, int src_size, int dst_size) {
+    return static_cast<int>(static_cast<int64_t>(i) * src_size / dst_size);
+}
+
+// Adds every channel of a row of pixels to the 32-bit per channel accumulators
+static void accumulate_row_scalar(uint32_t* acc, const uint32_t* row, int width) {
+    for (int x = 0; x < width; ++x) {
+        const uint32_t pixel = row[x];
+        acc[x * 4 + 0] += pixel & 0xff;
+        acc[x * 4 + 1] += (pixel >> 8) & 0xff;
+        acc[x * 4 + 2] += (pixel >> 16) & 0xff;
+        acc[x * 4 + 3] += pixel >> 24;
+    }
+}
+
+static void reduce_row_scalar(const uint32_t* acc, uint32_t* dst, int src_width, int dst_width, int rows) {
+    for (int dx = 0; dx < dst_width; ++dx) {
+        const int x0 = box_start(dx, src_width, dst_width);
+        const int x1 = box_start(dx + 1, src_width, dst_width);
+        const auto area = static_cast<uint32_t>((x1 - x0) * rows);
+
+        uint32_t sums[4] = {0, 0, 0, 0};
+        for (int x = x0; x < x1; ++x) {
+            for (int c = 0; c < 4; ++c) {
+                sums[c] += acc[x * 4 + c];
+            }
+        }
+
+        uint32_t pixel = 0;
+        for (int c = 0; c < 4; ++c) {
+            pixel |= ((sums[c] + area / 2) / area) << (c * 8);
+        }
+        dst[dx] = pixel;
+    }
+}
+
+#ifdef TERMIMG_X86
+static void accumulate_row_sse2(uint32_t* acc, const uint32_t* row, int width) {
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+    for (; x + 4 <= width; x += 4) {
+        const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + x));
+        const __m128i low = _mm_unpacklo_epi8(pixels, zero);
+        const __m128i high = _mm_unpackhi_epi8(pixels, zero);
+
+        __m128i* out = reinterpret_cast<__m128i*>(acc + x * 4);
+        _mm_storeu_si128(out + 0, _mm_add_epi32(_mm_loadu_si128(out + 0), _mm_unpacklo_epi16(low, zero)));
+        _mm_storeu_si128(out + 1, _mm_add_epi32(_mm_loadu_si128(out + 1), _mm_unpackhi_epi16(low, zero)));
+        _mm_storeu_si128(out + 2, _mm_add_epi32(_mm_loadu_si128(out + 2), _mm_unpacklo_epi16(high, zero)));
+        _mm_storeu_si128(out + 3, _mm_add_epi32(_mm_loadu_si128(out + 3), _mm_unpackhi_epi16(high, zero)));
+    }
+    accumulate_row_scalar(acc + x * 4, row + x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void accumulate_row_avx2(uint32_t* acc, const uint32_t* row, int width) {
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        const __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + x));
+        const __m128i low = _mm256_castsi256_si128(pixels);
+        const __m128i high = _mm256_extracti128_si256(pixels, 1);
+
+        // Each conversion widens two pixels, eight channels, to 32 bits
+        __m256i* out = reinterpret_cast<__m256i*>(acc + x * 4);
+        _mm256_storeu_si256(out + 0, _mm256_add_epi32(_mm256_loadu_si256(out + 0), _mm256_cvtepu8_epi32(low)));
+        _mm256_storeu_si256(out + 1, _mm256_add_epi32(_mm256_loadu_si256(out + 1), _mm256_cvtepu8_epi32(_mm_srli_si128(low, 8))));
+        _mm256_storeu_si256(out + 2, _mm256_add_epi32(_mm256_loadu_si256(out + 2), _mm256_cvtepu8_epi32(high)));
+        _mm256_storeu_si256(out + 3, _mm256_add_epi32(_mm256_loadu_si256(out + 3), _mm256_cvtepu8_epi32(_mm_srli_si128(high, 8))));
+    }
+    accumulate_row_sse2(acc + x * 4, row + x, width - x);
+}
+
+static void reduce_row_sse2(const uint32_t* acc, uint32_t* dst, int src_width, int dst_width, int rows) {
+    for (int dx = 0; dx < dst_width; ++dx) {
+        const int x0 = box_start(dx, src_width, dst_width);
+        const int x1 = box_start(dx + 1, src_width, dst_width);
+
+        __m128i sums = _mm_setzero_si128();
+        for (int x = x0; x < x1; ++x) {
+            sums = _mm_add_epi32(sums, _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + x * 4)));
+        }
+
+        const __m128 inverse_area = _mm_set1_ps(1.0f / static_cast<float>((x1 - x0) * rows));
+        const __m128i averages = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(sums), inverse_area));
+        const __m128i packed = _mm_packus_epi16(_mm_packs_epi32(averages, averages), averages);
+        dst[dx] = static_cast<uint32_t>(_mm_cvtsi128_si32(packed));
+    }
+}
+#endif
+
+static void box_downscale_band(const uint32_t* src, int src_width, int src_height, size_t src_stride,
+                               uint32_t* dst, int dst_width, int dst_height,
+                               BoxKernel kernel, int first_row, int last_row) {
+    std::vector<uint32_t> acc(static_cast<size_t>(src_width) * 4);
+
+    for (int dy = first_row; dy < last_row; ++dy) {
+        const int y0 = box_start(dy, src_height, dst_height);
+        const int y1 = box_start(dy + 1, src_height, dst_height);
+
+        std::fill(acc.begin(), acc.end(), 0);
+        for (int y = y0; y < y1; ++y) {
+            const uint32_t* row = src + static_cast<size_t>(y) * src_stride;
+            switch (kernel) {
+#ifdef TERMIMG_X86
+                case BoxKernel::Avx2:
+                    accumulate_row_avx2(acc.data(), row, src_width);
+                    break;
+                case BoxKernel::Sse2:
+                    accumulate_row_sse2(acc.data(), row, src_width);
+                    break;
+#endif
+                default:
+                    accumulate_row_scalar(acc.data(), row, src_width);
+                    break;
+            }
+        }
+
+        uint32_t* dst_row = dst + static_cast<size_t>(dy) * static_cast<size_t>(dst_width);
+#ifdef TERMIMG_X86
+        if (kernel != BoxKernel::Scalar) {
+            reduce_row_sse2(acc.data(), dst_row, src_width, dst_width, y1 - y0);
+            continue;
+        }
+#endif
+        reduce_row_scalar(acc.data(), dst_row, src_width, dst_width, y1 - y0);
+    }
+}
+
+void box_downscale(const uint32_t* src, int src_width, int src_height, size_t src_stride,
+                   uint32_t* dst, int dst_width, int dst_height,
+                   BoxKernel kernel, unsigned int thread_count) {
+    assert(can_box_downscale(src_width, src_height, dst_width, dst_height));
+
+    const auto src_pixels = static_cast<uint64_t>(src_width) * static_cast<uint64_t>(src_height);
+    const auto useful_threads = static_cast<int>(std::clamp<uint64_t>(src_pixels / min_pixels_per_thread, 1, thread_count));
+    const int bands = std::min(useful_threads, dst_height);
+
+    std::vector<std::thread> threads;
+    for (int band = 1; band < bands; ++band) {
+        threads.emplace_back(box_downscale_band, src, src_width, src_height, src_stride, dst, dst_width, dst_height,
+                             kernel, band * dst_height / bands, (band + 1) * dst_height / bands);
+    }
+
+    box_downscale_band(src, src_width, src_height, src_stride, dst, dst_width, dst_height, kernel, 0, dst_height / bands);
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
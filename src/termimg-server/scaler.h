@@ -0,0 +1,43 @@
+#ifndef TERMIMG_SCALER_H
+#define TERMIMG_SCALER_H
+
+#include <optional>
+#include <string_view>
+
+#include <cstddef>
+#include <cstdint>
+
+
+enum class Scaler {
+    // Always imlib_create_cropped_scaled_image
+    Imlib,
+    // The box filter for every downscale
+    Box,
+    // The box filter once the image shrinks by at least box_min_ratio on both axes
+    Auto,
+};
+
+enum class BoxKernel {
+    Scalar,
+    Sse2,
+    Avx2,
+};
+
+constexpr int box_min_ratio = 2;
+
+std::optional<Scaler> scaler_from_string(std::string_view name);
+const char* box_kernel_to_string(BoxKernel kernel);
+BoxKernel detect_box_kernel();
+
+// Whether box_downscale can handle this size, the box of source pixels behind one
+// destination pixel has to stay small enough for 32-bit channel sums
+bool can_box_downscale(int src_width, int src_height, int dst_width, int dst_height);
+
+// Area averaging downscale of 32-bit ARGB pixels. Source rows are src_stride pixels
+// apart. The destination rows are split into bands over up to thread_count threads.
+void box_downscale(const uint32_t* src, int src_width, int src_height, size_t src_stride,
+                   uint32_t* dst, int dst_width, int dst_height,
+                   BoxKernel kernel, unsigned int thread_count);
+
+
+#endif //TERMIMG_SCALER_H
@@ -0,0 +1,84 @@
+#include "stats.h"
+
+#include <bit>
+#include <sstream>
+#include <algorithm>
+
+
+const char* stage_to_string(Stage stage) {
+    switch (stage) {
+        case Stage::Receive: return "receive";
+        case Stage::Parse: return "parse";
+        case Stage::Decode: return "decode";
+        case Stage::Scale: return "scale";
+        case Stage::Render: return "render";
+        case Stage::Flush: return "flush";
+        default: return "unknown";
+    }
+}
+
+void Histogram::record(uint64_t us) {
+    const auto bucket = std::min<size_t>(std::bit_width(us), bucket_count - 1);
+    m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum_us.fetch_add(us, std::memory_order_relaxed);
+
+    auto max_us = m_max_us.load(std::memory_order_relaxed);
+    while (us > max_us && !m_max_us.compare_exchange_weak(max_us, us, std::memory_order_relaxed)) {
+    }
+}
+
+std::string Histogram::to_json() const {
+    std::ostringstream json;
+    json << "{\"count\":" << m_count.load(std::memory_order_relaxed)
+         << ",\"sum_us\":" << m_sum_us.load(std::memory_order_relaxed)
+         << ",\"max_us\":" << m_max_us.load(std::memory_order_relaxed)
+         << ",\"buckets\":[";
+
+    // Only buckets that counted anything, each with the duration it stays under
+    bool first = true;
+    for (size_t i = 0; i < bucket_count; ++i) {
+        const auto count = m_buckets[i].load(std::memory_order_relaxed);
+        if (count == 0) {
+            continue;
+        }
+        json << (first ? "" : ",") << "{\"lt_us\":" << (uint64_t{1} << i) << ",\"count\":" << count << "}";
+        first = false;
+    }
+
+    json << "]}";
+    return json.str();
+}
+
+void Stats::record(Stage stage, std::chrono::steady_clock::duration duration) {
+    const auto us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    m_stages[static_cast<size_t>(stage)].record(us > 0 ? static_cast<uint64_t>(us) : 0);
+}
+
+std::string Stats::to_json(const std::vector<Counter> &counters) const {
+    std::ostringstream json;
+    json << "{\"stages\":{";
+    for (size_t i = 0; i < m_stages.size(); ++i) {
+        json << (i == 0 ? "" : ",") << "\"" << stage_to_string(static_cast<Stage>(i)) << "\":" << m_stages[i].to_json();
+    }
+
+    json << "},\"counters\":{";
+    for (size_t i = 0; i < counters.size(); ++i) {
+        json << (i == 0 ? "" : ",") << "\"" << counters[i].name << "\":" << counters[i].value;
+    }
+    json << "}}";
+
+    return json.str();
+}
+
+Stats& stats() {
+    static Stats stats;
+    return stats;
+}
+
+StageTimer::StageTimer(Stage stage) : m_stage(stage), m_start(std::chrono::steady_clock::now()) {
+}
+
+StageTimer::~StageTimer() {
+    stats().record(m_stage, std::chrono::steady_clock::now() - m_start);
+}
@@ -0,0 +1,81 @@
+#ifndef TERMIMG_STATS_H
+#define TERMIMG_STATS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+
+enum class Stage {
+    // Reading the datagrams of one wakeup off the socket
+    Receive,
+    // Splitting them into requests and coalescing those
+    Parse,
+    Decode,
+    Scale,
+    // Uploading pixels to a pixmap
+    Render,
+    // Showing the pixmap in its window and flushing the X connection
+    Flush,
+    Count,
+};
+
+const char* stage_to_string(Stage stage);
+
+// Durations in power of two buckets of microseconds. Recording is a few relaxed atomic
+// increments, so it is cheap enough for every request and safe from any thread.
+class Histogram {
+public:
+    // Bucket 0 counts durations under 1us, bucket i those under 2^i us
+    constexpr static size_t bucket_count = 32;
+
+private:
+    std::array<std::atomic<uint64_t>, bucket_count> m_buckets{};
+    std::atomic<uint64_t> m_count = 0;
+    std::atomic<uint64_t> m_sum_us = 0;
+    std::atomic<uint64_t> m_max_us = 0;
+
+public:
+    void record(uint64_t us);
+
+    [[nodiscard]] std::string to_json() const;
+};
+
+struct Counter {
+    const char* name;
+    uint64_t value;
+};
+
+// Timing of every stage, for the whole process
+class Stats {
+private:
+    std::array<Histogram, static_cast<size_t>(Stage::Count)> m_stages;
+
+public:
+    void record(Stage stage, std::chrono::steady_clock::duration duration);
+
+    // One JSON object with a histogram per stage and the counters passed in
+    [[nodiscard]] std::string to_json(const std::vector<Counter> &counters) const;
+};
+
+Stats& stats();
+
+// Records the time from construction to destruction
+class StageTimer {
+private:
+    const Stage m_stage;
+    const std::chrono::steady_clock::time_point m_start;
+
+public:
+    explicit StageTimer(Stage stage);
+    StageTimer(const StageTimer&) = delete;
+    ~StageTimer();
+};
+
+
+#endif //TERMIMG_STATS_H
@@ -4,42 +4,84 @@
 
 #include "term.h"
 
-#include <ranges>
 #include <vector>
 #include <tuple>
 #include <optional>
-#include <iostream>
 #include <sstream>
 #include <algorithm>
+#include <unordered_map>
+#include <chrono>
+#include <string>
 
 #include <cstdio>
+#include <cstdlib>
+#include <climits>
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <X11/Xlib.h>
+#include <X11/Xatom.h>
 #include <X11/extensions/XRes.h>
 #include <proc/readproc.h>
 #include <sys/ioctl.h>
 #include <sys/sysmacros.h>
 #include <sys/stat.h>
 
+#include "log.h"
 
-int get_pty(pid_t pid) {
+
+struct ProcessEntry {
+    pid_t ppid;
+    dev_t tty;
+};
+
+// One scan of /proc, instead of opening it again for every ancestor
+std::unordered_map<pid_t, ProcessEntry> read_process_table() {
+    std::unordered_map<pid_t, ProcessEntry> processes;
+    PROCTAB* proctab = openproc(PROC_FILLSTAT);
+    if (!proctab) {
+        TERMIMG_LOG(Warning) << "Could not open /proc";
+        return processes;
+    }
+
+    while (proc_t* p = readproc(proctab, nullptr)) {
+        processes.emplace(p->tid, ProcessEntry{p->ppid, static_cast<dev_t>(p->tty)});
+        freeproc(p);
+    }
+
+    closeproc(proctab);
+    return processes;
+}
+
+std::optional<unsigned long long> get_process_start_time(pid_t pid) {
     pid_t pids[] = {pid, 0};
     PROCTAB* proctab = openproc(PROC_FILLSTAT | PROC_PID, pids);
+    if (!proctab) {
+        return std::nullopt;
+    }
 
-    proc_t* p = readproc(proctab, nullptr);
+    std::optional<unsigned long long> start_time;
+    if (proc_t* p = readproc(proctab, nullptr)) {
+        start_time = p->start_time;
+        freeproc(p);
+    }
 
-    auto tty = static_cast<dev_t>(p->tty);
+    closeproc(proctab);
+    return start_time;
+}
+
+int get_pty(pid_t pid, dev_t tty) {
     auto minor_tty = minor(tty);
-    std::cerr << "tty " << tty << " minor " << minor_tty << std::endl;
+    TERMIMG_LOG(Debug) << "tty " << tty << " minor " << minor_tty;
 
     std::stringstream ss;
     ss << "/dev/pts/" << minor_tty;
 
+    // The pty of another session, it must not become the controlling terminal of the daemon or
+    // leak into the processes it starts
     const auto path = ss.str();
     if (minor_tty != 0) {
-        auto fd = open(path.c_str(), O_RDWR);
+        auto fd = open(path.c_str(), O_RDWR | O_NOCTTY | O_CLOEXEC);
         if (fd == -1) {
             perror("open");
         }
@@ -50,42 +92,34 @@ int get_pty(pid_t pid) {
 
     struct stat s{};
     if (stat(path.c_str(), &s) == -1){
-        freeproc(p);
-
-        closeproc(proctab);
         perror("stat");
-        std::cerr << "Could not find pty for " << pid << std::endl;
+        TERMIMG_LOG(Warning) << "Could not find pty for " << pid;
         return -1;
     }
 
-    freeproc(p);
-
-    closeproc(proctab);
-
     if (tty == s.st_rdev) {
-        std::cerr << "Found pty for " << pid << " with tty: " << tty << std::endl;
-        return open(path.c_str(), O_RDWR);
+        TERMIMG_LOG(Debug) << "Found pty for " << pid << " with tty: " << tty;
+        return open(path.c_str(), O_RDWR | O_NOCTTY | O_CLOEXEC);
     }
 
     return -1;
 }
 
-std::vector<pid_t> get_parent_pids(pid_t pid){
+std::vector<pid_t> get_parent_pids(const std::unordered_map<pid_t, ProcessEntry> &processes, pid_t pid){
     std::vector<pid_t> parent_pids;
     parent_pids.push_back(pid);
     while (pid != 1) {
-        pid_t pids[] = {pid, 0};
-        PROCTAB* proctab = openproc(PROC_FILLSTAT | PROC_PID, pids);
-
-        proc_t* p = readproc(proctab, nullptr);
+        const auto it = processes.find(pid);
+        if (it == processes.end()) {
+            TERMIMG_LOG(Warning) << "Process " << pid << " is gone";
+            break;
+        }
 
-        pid = p->ppid;
-        if (pid != 1)
+        pid = it->second.ppid;
+        if (pid != 1 && pid != 0)
             parent_pids.push_back(pid);
-
-        freeproc(p);
-
-        closeproc(proctab);
+        if (pid == 0)
+            break;
     }
 
     return parent_pids;
@@ -119,12 +153,44 @@ bool has_property(std::shared_ptr<Display> display, Window window, Atom atom){
     return false;
 }
 
-void get_all_windows(std::shared_ptr<Display> display, Window window, std::vector<Window> &windows) {
-    Atom wm_class = XInternAtom(display.get(), "WM_CLASS", True);
-    Atom wm_name = XInternAtom(display.get(), "WM_NAME", True);
-    Atom wm_locale_name = XInternAtom(display.get(), "WM_LOCALE_NAME", True);
-    Atom wm_normal_hints = XInternAtom(display.get(), "WM_NORMAL_HINTS", True);
+// Format 32 properties are handed out by Xlib as longs, whatever their type
+std::vector<unsigned long> get_cardinal_property(std::shared_ptr<Display> display, Window window, Atom atom, Atom type) {
+    Atom actual_type_return;
+    int actual_format_return;
+    unsigned long nitems_return;
+    unsigned long bytes_after_return;
+    unsigned char* prop_return = nullptr;
+    int status = XGetWindowProperty(
+            display.get(),
+            window,
+            atom,
+            0L,
+            LONG_MAX / 4,
+            False,
+            type,
+            &actual_type_return,
+            &actual_format_return,
+            &nitems_return,
+            &bytes_after_return,
+            &prop_return);
+
+    std::vector<unsigned long> values;
+    if (status != Success) {
+        return values;
+    }
+
+    if (actual_type_return == type && actual_format_return == 32 && prop_return) {
+        const auto* items = reinterpret_cast<const unsigned long*>(prop_return);
+        values.assign(items, items + nitems_return);
+    }
+    if (prop_return) {
+        XFree(prop_return);
+    }
 
+    return values;
+}
+
+void get_all_windows(std::shared_ptr<Display> display, Window window, std::vector<Window> &windows) {
     Window unused;
     Window *children;
     unsigned int children_count = 0;
@@ -138,19 +204,8 @@ void get_all_windows(std::shared_ptr<Display> display, Window window, std::vecto
 
     if (children) {
         for (unsigned int i = 0; i < children_count; ++i) {
-            auto child = children[i];
-            auto p = [&](Atom atom) {
-                return has_property(display, child, atom);
-            };
-            if (p(wm_class)
-                && p(wm_name)
-                && p(wm_locale_name)
-                && p(wm_normal_hints)
-                    )
-            {
-                windows.push_back(child);
-            }
-            get_all_windows(display, child, windows);
+            windows.push_back(children[i]);
+            get_all_windows(display, children[i], windows);
         }
 
         XFree(children);
@@ -164,55 +219,209 @@ std::vector<Window> get_all_windows(std::shared_ptr<Display> display) {
     return windows;
 }
 
-pid_t get_window_pid(std::shared_ptr<Display> display, Window window) {
-    XResClientIdSpec client_spec;
-    client_spec.client = window;
-    client_spec.mask = XRES_CLIENT_ID_PID_MASK;
-    long num_ids = 0;
-    XResClientIdValue *client_ids;
+// Pids of every local X client, keyed by the base of its resource ids. Two requests in
+// total, rather than one XResQueryClientIds round trip per window.
+class ClientPids {
+    std::unordered_map<XID, pid_t> m_pids;
+    XID m_resource_mask = 0;
+
+public:
+    explicit ClientPids(std::shared_ptr<Display> display) {
+        int client_count = 0;
+        XResClient* clients = nullptr;
+        if (XResQueryClients(display.get(), &client_count, &clients) == Success && clients) {
+            // The server hands every client the same sized range of ids
+            if (client_count > 0) {
+                m_resource_mask = clients[0].resource_mask;
+            }
+            XFree(clients);
+        }
 
+        // A client of None asks for the ids of all clients at once
+        XResClientIdSpec client_spec;
+        client_spec.client = None;
+        client_spec.mask = XRES_CLIENT_ID_PID_MASK;
+        long num_ids = 0;
+        XResClientIdValue *client_ids = nullptr;
+        if (XResQueryClientIds(display.get(), 1, &client_spec, &num_ids, &client_ids) != Success) {
+            TERMIMG_LOG(Warning) << "Could not query X client pids";
+            return;
+        }
 
-    XResQueryClientIds(display.get(), 1, &client_spec, &num_ids, &client_ids);
+        for (long i = 0; i < num_ids; ++i) {
+            XResClientIdValue *client_id = &client_ids[i];
+            if (XResGetClientIdType(client_id) == XRES_CLIENT_ID_PID) {
+                m_pids.emplace(client_id->spec.client, XResGetClientPid(client_id));
+            }
+        }
 
-    pid_t pid = 0;
-    for (long i = 0; i < num_ids; ++i) {
-        XResClientIdValue *client_id = &client_ids[i];
-        XResClientIdType client_id_type = XResGetClientIdType(client_id);
+        XResClientIdsDestroy(num_ids, client_ids);
+    }
 
-        if (client_id_type == XRES_CLIENT_ID_PID) {
-            pid = XResGetClientPid(client_id);
-            break;
+    // 0 when the owner of window is unknown
+    [[nodiscard]] pid_t window_pid(Window window) const {
+        if (m_resource_mask == 0) {
+            return 0;
         }
+
+        const auto it = m_pids.find(window & ~m_resource_mask);
+        return it == m_pids.end() ? 0 : it->second;
     }
+};
 
-    XResClientIdsDestroy(num_ids, client_ids);
+// Nearer ancestors rank lower, std::nullopt when pid is not an ancestor at all
+std::optional<size_t> get_ancestor_rank(const std::vector<pid_t> &parent_pids, pid_t pid) {
+    if (pid <= 0) {
+        return std::nullopt;
+    }
 
-    return pid;
+    const auto it = std::find(parent_pids.begin(), parent_pids.end(), pid);
+    if (it == parent_pids.end()) {
+        return std::nullopt;
+    }
+    return static_cast<size_t>(it - parent_pids.begin());
 }
 
-std::optional<TerminalInfo> get_term(std::shared_ptr<Display> display, pid_t parent) {
-    auto parent_pids = get_parent_pids(parent);
+// Terminals put the window they draw in into WINDOWID for their children
+std::optional<Window> get_env_window_id() {
+    const char* window_id = std::getenv("WINDOWID");
+    if (!window_id || *window_id == '\0') {
+        return std::nullopt;
+    }
 
-    int fd_pty = 0;
+    char* end = nullptr;
+    const auto window = std::strtoul(window_id, &end, 0);
+    if (*end != '\0' || window == 0) {
+        TERMIMG_LOG(Warning) << "Invalid WINDOWID " << window_id;
+        return std::nullopt;
+    }
 
-    for (int & parent_pid : std::ranges::reverse_view(parent_pids)) {
-        std::cerr << parent_pid << std::endl;
-        auto p = get_pty(parent_pid);
-        if (p != -1) {
-            fd_pty = p;
-            break;
+    return window;
+}
+
+std::optional<Window> check_window_id(const ClientPids &client_pids, const std::vector<pid_t> &parent_pids, Window window) {
+    // WINDOWID is inherited, so it may belong to a terminal further up than ours
+    const auto pid = client_pids.window_pid(window);
+    if (pid != 0 && !get_ancestor_rank(parent_pids, pid).has_value()) {
+        TERMIMG_LOG(Warning) << "WINDOWID " << window << " belongs to " << pid << " which is not an ancestor";
+        return std::nullopt;
+    }
+
+    return window;
+}
+
+std::optional<Window> find_window_from_client_list(std::shared_ptr<Display> display, const ClientPids &client_pids,
+                                                   const std::vector<pid_t> &parent_pids) {
+    const Atom net_client_list = XInternAtom(display.get(), "_NET_CLIENT_LIST", True);
+    if (net_client_list == None) {
+        return std::nullopt;
+    }
+
+    const auto root = DefaultRootWindow(display.get());
+    const auto client_windows = get_cardinal_property(display, root, net_client_list, XA_WINDOW);
+    if (client_windows.empty()) {
+        return std::nullopt;
+    }
+
+    const Atom net_wm_pid = XInternAtom(display.get(), "_NET_WM_PID", True);
+
+    std::optional<Window> best_window;
+    size_t best_rank = SIZE_MAX;
+    for (const auto window : client_windows) {
+        auto pid = client_pids.window_pid(window);
+        // Remote clients have no pid in XRes, _NET_WM_PID is their own claim
+        if (pid == 0 && net_wm_pid != None) {
+            const auto wm_pid = get_cardinal_property(display, window, net_wm_pid, XA_CARDINAL);
+            if (!wm_pid.empty()) {
+                pid = static_cast<pid_t>(wm_pid[0]);
+            }
+        }
+
+        const auto rank = get_ancestor_rank(parent_pids, pid);
+        if (rank.has_value() && rank.value() < best_rank) {
+            best_rank = rank.value();
+            best_window = window;
         }
     }
 
+    return best_window;
+}
+
+// Walks the whole tree, only for window managers without _NET_CLIENT_LIST
+std::optional<Window> find_window_from_tree(std::shared_ptr<Display> display, const ClientPids &client_pids,
+                                            const std::vector<pid_t> &parent_pids) {
+    Atom wm_class = XInternAtom(display.get(), "WM_CLASS", True);
+    Atom wm_name = XInternAtom(display.get(), "WM_NAME", True);
+    Atom wm_locale_name = XInternAtom(display.get(), "WM_LOCALE_NAME", True);
+    Atom wm_normal_hints = XInternAtom(display.get(), "WM_NORMAL_HINTS", True);
+
     auto all_windows = get_all_windows(display);
     for (auto window : all_windows){
-        pid_t pid = get_window_pid(display, window);
-        if(std::find(parent_pids.begin(), parent_pids.end(), pid) != parent_pids.end()) {
-            std::cerr << "pty is " << fd_pty << std::endl;
-            return TerminalInfo{window, fd_pty};
+        // The pid lookup is local, so the property round trips are only paid for candidates
+        if (!get_ancestor_rank(parent_pids, client_pids.window_pid(window)).has_value()) {
+            continue;
         }
-    }
 
+        auto p = [&](Atom atom) {
+            return has_property(display, window, atom);
+        };
+        if (p(wm_class)
+            && p(wm_name)
+            && p(wm_locale_name)
+            && p(wm_normal_hints)
+                )
+        {
+            return window;
+        }
+    }
 
     return std::nullopt;
 }
+
+std::optional<TerminalInfo> get_term(std::shared_ptr<Display> display, pid_t parent, std::optional<Window> window_id) {
+    const auto start = std::chrono::steady_clock::now();
+    auto log_found = [&](const char* strategy, Window window) {
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        TERMIMG_LOG(Info) << "Found terminal window " << window << " from " << strategy << " in "
+                          << std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() << "us";
+    };
+
+    const auto processes = read_process_table();
+    auto parent_pids = get_parent_pids(processes, parent);
+
+    const ClientPids client_pids(display);
+
+    std::optional<Window> window;
+    if (window_id.has_value() && (window = check_window_id(client_pids, parent_pids, window_id.value()))) {
+        log_found("WINDOWID", window.value());
+    }
+    else if ((window = find_window_from_client_list(display, client_pids, parent_pids))) {
+        log_found("_NET_CLIENT_LIST", window.value());
+    }
+    else if ((window = find_window_from_tree(display, client_pids, parent_pids))) {
+        log_found("the window tree", window.value());
+    }
+    else {
+        return std::nullopt;
+    }
+
+    // Opened only once the window is found, a failed lookup is retried and would leak it every time
+    int fd_pty = 0;
+
+    // The nearest ancestor with a pty is the shell in the terminal, further up may be whatever started the terminal
+    for (const pid_t parent_pid : parent_pids) {
+        TERMIMG_LOG(Debug) << parent_pid;
+        const auto it = processes.find(parent_pid);
+        if (it == processes.end()) {
+            continue;
+        }
+        auto p = get_pty(parent_pid, it->second.tty);
+        if (p != -1) {
+            fd_pty = p;
+            break;
+        }
+    }
+    TERMIMG_LOG(Debug) << "pty is " << fd_pty;
+
+    return TerminalInfo{window.value(), fd_pty};
+}
@@ -14,7 +14,15 @@
 
 #include "terminal-info.h"
 
-std::optional<TerminalInfo> get_term(std::shared_ptr<Display> display, pid_t parent);
+// window_id is the terminal's own idea of its window, such as WINDOWID, and is tried first
+std::optional<TerminalInfo> get_term(std::shared_ptr<Display> display, pid_t parent, std::optional<Window> window_id);
+
+// In clock ticks since boot, tells a process from a later one that got the same pid.
+// std::nullopt when pid is not running.
+std::optional<unsigned long long> get_process_start_time(pid_t pid);
+
+// WINDOWID from this process' environment
+std::optional<Window> get_env_window_id();
 
 
 
@@ -5,6 +5,7 @@
 #include <cstdio>
 
 #include "terminal-info.h"
+#include "log.h"
 
 TerminalInfo::TerminalInfo(Window terminal_window, int fd_pty) : m_terminal_window(terminal_window), m_fd_pty(fd_pty) { }
 
@@ -21,3 +22,50 @@ std::optional<winsize> TerminalInfo::get_tty_size() const {
 Window TerminalInfo::terminal_window() const {
     return m_terminal_window;
 }
+
+int TerminalInfo::fd_pty() const {
+    return m_fd_pty;
+}
+
+bool TerminalInfo::query_window_size(Display* display) {
+    XWindowAttributes attr {};
+    if (!XGetWindowAttributes(display, m_terminal_window, &attr)) {
+        TERMIMG_LOG(Warning) << "Could not get window attributes";
+        return false;
+    }
+
+    m_width = attr.width;
+    m_height = attr.height;
+    TERMIMG_LOG(Debug) << "Window width: " << m_width << " height: " << m_height;
+    return true;
+}
+
+bool TerminalInfo::on_configure(const XConfigureEvent &event) {
+    if (event.window != m_terminal_window || (event.width == m_width && event.height == m_height)) {
+        return false;
+    }
+
+    m_width = event.width;
+    m_height = event.height;
+    TERMIMG_LOG(Debug) << "Window resized to width: " << m_width << " height: " << m_height;
+    return true;
+}
+
+bool TerminalInfo::refresh_tty_size() {
+    const auto tty_size = get_tty_size();
+    if (!tty_size.has_value() || (tty_size->ws_col == m_tty_size.ws_col && tty_size->ws_row == m_tty_size.ws_row)) {
+        return false;
+    }
+
+    m_tty_size = tty_size.value();
+    TERMIMG_LOG(Debug) << "Terminal size x: " << m_tty_size.ws_col << " y: " << m_tty_size.ws_row;
+    return true;
+}
+
+std::optional<TerminalSize> TerminalInfo::size() const {
+    if (m_tty_size.ws_col == 0 || m_tty_size.ws_row == 0 || m_width == 0 || m_height == 0) {
+        return std::nullopt;
+    }
+
+    return TerminalSize{m_tty_size.ws_col, m_tty_size.ws_row, m_width, m_height};
+}
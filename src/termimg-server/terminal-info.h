@@ -12,9 +12,22 @@
 #include <X11/Xlib.h>
 
 
+struct TerminalSize {
+    int columns;
+    int lines;
+    int width;
+    int height;
+
+    bool operator==(const TerminalSize&) const = default;
+};
+
+// Keeps the terminal's window and cell grid size cached, so requests need no X round trips
 class TerminalInfo {
     Window m_terminal_window;
     int m_fd_pty;
+    winsize m_tty_size{};
+    int m_width = 0;
+    int m_height = 0;
 
 public:
     TerminalInfo(Window terminal_window, int fd_pty);
@@ -22,9 +35,20 @@ public:
     TerminalInfo(TerminalInfo&&) = default;
 
     [[nodiscard]] Window terminal_window() const;
+    [[nodiscard]] int fd_pty() const;
 
     [[nodiscard]] std::optional<winsize> get_tty_size() const;
 
+    // A round trip to the X server, ConfigureNotify keeps the size current after this
+    bool query_window_size(Display* display);
+    // Returns whether the size changed
+    bool on_configure(const XConfigureEvent &event);
+    // The server is not in the terminal's session, so there is no SIGWINCH. TIOCGWINSZ is a
+    // cheap local call though, so this is checked as requests come in. Returns whether it changed.
+    bool refresh_tty_size();
+
+    // std::nullopt until both sizes are known
+    [[nodiscard]] std::optional<TerminalSize> size() const;
 };
 
 
@@ -0,0 +1,112 @@
+#include "terminals.h"
+
+#include <utility>
+#include <unordered_map>
+#include <chrono>
+
+#include <unistd.h>
+
+#include "term.h"
+#include "log.h"
+
+
+// A failed lookup is retried after this, in case the terminal was still mapping its window
+constexpr std::chrono::seconds failed_lookup_expiry{2};
+
+Terminal::Terminal(std::shared_ptr<Display> display, TerminalInfo terminal_info, int screen)
+    : info(terminal_info), placements(std::move(display), terminal_info.terminal_window(), screen) {
+}
+
+Terminal::~Terminal() {
+    if (info.fd_pty() > 0) {
+        close(info.fd_pty());
+    }
+}
+
+Terminals::Terminals(std::shared_ptr<Display> display, int screen) : m_display(std::move(display)), m_screen(screen) {
+}
+
+Terminal& Terminals::add(const TerminalInfo &terminal_info) {
+    const auto window = terminal_info.terminal_window();
+    auto &terminal = m_terminals[window];
+    if (terminal) {
+        if (terminal_info.fd_pty() > 0 && terminal_info.fd_pty() != terminal->info.fd_pty()) {
+            close(terminal_info.fd_pty());
+        }
+        return *terminal;
+    }
+
+    terminal = std::make_unique<Terminal>(m_display, terminal_info, m_screen);
+
+    // The only round trip for the terminal size, ConfigureNotify keeps it current from here on
+    XSelectInput(m_display.get(), window, StructureNotifyMask);
+    terminal->info.query_window_size(m_display.get());
+    terminal->info.refresh_tty_size();
+
+    TERMIMG_LOG(Info) << "Serving terminal window " << window << ", " << m_terminals.size() << " in total";
+    return *terminal;
+}
+
+Terminal* Terminals::find_for_pid(pid_t pid, std::optional<Window> window_id) {
+    const auto start_time = get_process_start_time(pid);
+    if (!start_time.has_value()) {
+        TERMIMG_LOG(Warning) << "Process " << pid << " is not running";
+        m_pid_lookups.erase(pid);
+        return nullptr;
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    const auto it = m_pid_lookups.find(pid);
+    if (it != m_pid_lookups.end() && it->second.start_time == start_time.value() && now < it->second.expires_at) {
+        if (!it->second.window.has_value()) {
+            TERMIMG_LOG(Debug) << "No terminal for " << pid << " the last time either";
+            return nullptr;
+        }
+        return find(it->second.window.value());
+    }
+
+    const auto terminal_info = get_term(m_display, pid, window_id);
+    if (!terminal_info.has_value()) {
+        TERMIMG_LOG(Warning) << "No terminal found for " << pid;
+        std::erase_if(m_pid_lookups, [now](const auto &pid_lookup) { return pid_lookup.second.expires_at <= now; });
+        m_pid_lookups.insert_or_assign(pid, PidLookup{start_time.value(), std::nullopt, now + failed_lookup_expiry});
+        return nullptr;
+    }
+
+    auto &terminal = add(terminal_info.value());
+    m_pid_lookups.insert_or_assign(pid, PidLookup{start_time.value(), terminal.info.terminal_window(), std::chrono::steady_clock::time_point::max()});
+    return &terminal;
+}
+
+Terminal* Terminals::find(Window terminal_window) {
+    const auto it = m_terminals.find(terminal_window);
+    return it == m_terminals.end() ? nullptr : it->second.get();
+}
+
+bool Terminals::remove(Window terminal_window) {
+    if (m_terminals.erase(terminal_window) == 0) {
+        return false;
+    }
+
+    std::erase_if(m_pid_lookups, [terminal_window](const auto &pid_lookup) { return pid_lookup.second.window == terminal_window; });
+    TERMIMG_LOG(Info) << "Terminal window " << terminal_window << " is gone, " << m_terminals.size() << " left";
+    return true;
+}
+
+void Terminals::clear() {
+    m_terminals.clear();
+    m_pid_lookups.clear();
+}
+
+std::vector<Window> Terminals::windows() const {
+    std::vector<Window> terminal_windows;
+    terminal_windows.reserve(m_terminals.size());
+    for (const auto &[window, terminal] : m_terminals) {
+        terminal_windows.push_back(window);
+    }
+    return terminal_windows;
+}
+
+size_t Terminals::size() const {
+    return m_terminals.size();
+}
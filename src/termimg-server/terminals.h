@@ -0,0 +1,64 @@
+#ifndef TERMIMG_TERMINALS_H
+#define TERMIMG_TERMINALS_H
+
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+#include <X11/Xlib.h>
+
+#include "terminal-info.h"
+#include "placements.h"
+
+
+// Everything that belongs to a single terminal, images are shared between terminals
+struct Terminal {
+    TerminalInfo info;
+    Placements placements;
+
+    Terminal(std::shared_ptr<Display> display, TerminalInfo terminal_info, int screen);
+    Terminal(const Terminal&) = delete;
+    ~Terminal();
+};
+
+// What the window discovery made of a pid. Failures are remembered for a while too, so a client
+// outside any terminal does not run the discovery again with every request.
+struct PidLookup {
+    // Pids are reused, the entry only holds for the process that started at this time
+    unsigned long long start_time;
+    std::optional<Window> window;
+    std::chrono::steady_clock::time_point expires_at;
+};
+
+// The terminals served, by window. Requests name their terminal by a pid running in it,
+// which is resolved with the window discovery once and then remembered.
+class Terminals {
+private:
+    const std::shared_ptr<Display> m_display;
+    const int m_screen;
+    std::unordered_map<Window, std::unique_ptr<Terminal>> m_terminals;
+    std::unordered_map<pid_t, PidLookup> m_pid_lookups;
+
+public:
+    Terminals(std::shared_ptr<Display> display, int screen);
+    Terminals(const Terminals&) = delete;
+
+    // Starts watching the window for resizes and its destruction. A terminal that is already
+    // known is kept, only the new pty is closed.
+    Terminal& add(const TerminalInfo &terminal_info);
+    // nullptr when no terminal could be found for pid
+    Terminal* find_for_pid(pid_t pid, std::optional<Window> window_id);
+    Terminal* find(Window terminal_window);
+    bool remove(Window terminal_window);
+    // Destroys every terminal, and with them their placements and animations
+    void clear();
+
+    [[nodiscard]] std::vector<Window> windows() const;
+    [[nodiscard]] size_t size() const;
+};
+
+
+#endif //TERMIMG_TERMINALS_H
@@ -0,0 +1,181 @@
+#include "tiles.h"
+
+#include <algorithm>
+#include <utility>
+
+#include <cmath>
+
+#include "log.h"
+#include "stats.h"
+
+
+// Beyond this a tile would be just a few source pixels, scaling the visible part in one go is cheaper
+constexpr double max_tile_scale = tile_size / 4.0;
+
+TileGrid::TileGrid(int image_width, int image_height, double scale)
+    : m_image_width(image_width), m_image_height(image_height), m_scale(scale),
+      m_source_tile_size(static_cast<int>(std::lround(std::clamp(tile_size / scale, 1.0, static_cast<double>(std::max(image_width, image_height)))))) {
+}
+
+int TileGrid::to_output(int source) const {
+    return static_cast<int>(std::lround(static_cast<double>(source) * m_scale));
+}
+
+int TileGrid::width() const {
+    return to_output(m_image_width);
+}
+
+int TileGrid::height() const {
+    return to_output(m_image_height);
+}
+
+std::pair<int, int> TileGrid::span(int start, int end, int image_size) const {
+    const int count = (image_size + m_source_tile_size - 1) / m_source_tile_size;
+
+    // The guess from the scale can be one off either way after rounding
+    int first = std::clamp(static_cast<int>(static_cast<double>(start) / m_scale) / m_source_tile_size, 0, count - 1);
+    while (first > 0 && to_output(first * m_source_tile_size) > start) {
+        --first;
+    }
+    while (first + 1 < count && to_output((first + 1) * m_source_tile_size) <= start) {
+        ++first;
+    }
+
+    int last = first;
+    while (last < count && to_output(last * m_source_tile_size) < end) {
+        ++last;
+    }
+    return {first, last};
+}
+
+std::vector<Tile> TileGrid::cover(int x, int y, int width, int height) const {
+    const auto [first_column, end_column] = span(x, x + width, m_image_width);
+    const auto [first_row, end_row] = span(y, y + height, m_image_height);
+
+    std::vector<Tile> tiles;
+    for (int row = first_row; row < end_row; ++row) {
+        for (int column = first_column; column < end_column; ++column) {
+            Tile tile{};
+            tile.column = column;
+            tile.row = row;
+            tile.src_x = column * m_source_tile_size;
+            tile.src_y = row * m_source_tile_size;
+            tile.src_width = std::min(m_source_tile_size, m_image_width - tile.src_x);
+            tile.src_height = std::min(m_source_tile_size, m_image_height - tile.src_y);
+            tile.x = to_output(tile.src_x);
+            tile.y = to_output(tile.src_y);
+            tile.width = to_output(tile.src_x + tile.src_width) - tile.x;
+            tile.height = to_output(tile.src_y + tile.src_height) - tile.y;
+
+            // A sliver at the edge of a shrunk image can round away
+            if (tile.width > 0 && tile.height > 0) {
+                tiles.push_back(tile);
+            }
+        }
+    }
+    return tiles;
+}
+
+std::optional<TiledView> make_tiled_view(const ImageKey &source, const ViewportRect &rect, int image_width, int image_height, int visible_width, int visible_height) {
+    if (rect.scale > max_tile_scale) {
+        return std::nullopt;
+    }
+
+    // Images shrunk below a pixel are laid out a pixel large, which no tile covers
+    const TileGrid grid(image_width, image_height, rect.scale);
+    if (grid.width() < rect.width || grid.height() < rect.height) {
+        return std::nullopt;
+    }
+
+    TiledView view{};
+    view.source = source;
+    view.scale = rect.scale;
+    view.x = std::clamp(grid.to_output(rect.src_x), 0, grid.width() - rect.width);
+    view.y = std::clamp(grid.to_output(rect.src_y), 0, grid.height() - rect.height);
+    view.width = std::min(rect.width, visible_width);
+    view.height = std::min(rect.height, visible_height);
+    view.tiles = grid.cover(view.x, view.y, view.width, view.height);
+    return view;
+}
+
+static GC create_copy_gc(Display* display) {
+    // Copies between pixmaps are never obscured, so they need no NoExpose events
+    XGCValues values{};
+    values.graphics_exposures = False;
+    return XCreateGC(display, DefaultRootWindow(display), GCGraphicsExposures, &values);
+}
+
+TileCache::TileCache(std::shared_ptr<Display> display, int screen, size_t budget_bytes)
+    : m_display(std::move(display)), m_screen(screen), m_gc(create_copy_gc(m_display.get())),
+      m_pixmaps(m_display, DefaultDepth(m_display.get(), screen), budget_bytes) {
+}
+
+TileCache::~TileCache() {
+    XFreeGC(m_display.get(), m_gc);
+}
+
+bool TileCache::contains(const TileKey &key) const {
+    return m_pixmaps.contains(key);
+}
+
+CachedPixmap TileCache::upload(const Image &tile_image, Renderer &renderer) {
+    const auto width = static_cast<unsigned int>(tile_image.width());
+    const auto height = static_cast<unsigned int>(tile_image.height());
+    const Pixmap pixmap = XCreatePixmap(m_display.get(), DefaultRootWindow(m_display.get()), width, height, static_cast<unsigned int>(DefaultDepth(m_display.get(), m_screen)));
+
+    const StageTimer timer(Stage::Render);
+    renderer.render(tile_image, pixmap);
+    return {pixmap, width, height};
+}
+
+std::optional<CachedPixmap> TileCache::compose(const TiledView &view, Renderer &renderer) {
+    const auto width = static_cast<unsigned int>(view.width);
+    const auto height = static_cast<unsigned int>(view.height);
+    const Pixmap pixmap = XCreatePixmap(m_display.get(), DefaultRootWindow(m_display.get()), width, height, static_cast<unsigned int>(DefaultDepth(m_display.get(), m_screen)));
+
+    // Cached only once everything is copied, so caching one cannot evict another that is still needed
+    std::vector<std::pair<TileKey, CachedPixmap>> uploaded;
+    bool complete = true;
+    for (size_t i = 0; i < view.tiles.size(); ++i) {
+        const auto &tile = view.tiles[i];
+        const TileKey key{view.source, view.scale, tile.column, tile.row};
+
+        auto tile_pixmap = m_pixmaps.get(key);
+        if (!tile_pixmap.has_value()) {
+            auto tile_image = view.scaled_tiles[i];
+            if (!tile_image) {
+                TERMIMG_LOG(Debug) << "Tile " << tile.column << "x" << tile.row << " was evicted, scaling it again";
+                tile_image = crop_scale_image(*view.image, tile.src_x, tile.src_y, tile.src_width, tile.src_height, tile.width, tile.height);
+            }
+            if (!tile_image) {
+                complete = false;
+                break;
+            }
+
+            tile_pixmap = upload(*tile_image, renderer);
+            uploaded.emplace_back(key, tile_pixmap.value());
+        }
+
+        XCopyArea(m_display.get(), tile_pixmap->pixmap, pixmap, m_gc, 0, 0, tile_pixmap->width, tile_pixmap->height, tile.x - view.x, tile.y - view.y);
+    }
+
+    for (const auto &[key, tile_pixmap] : uploaded) {
+        m_pixmaps.put(key, tile_pixmap);
+    }
+
+    if (!complete) {
+        XFreePixmap(m_display.get(), pixmap);
+        return std::nullopt;
+    }
+
+    TERMIMG_LOG(Debug) << "Composed " << view.tiles.size() << " tiles, " << uploaded.size() << " of them uploaded";
+    return CachedPixmap{pixmap, width, height};
+}
+
+void TileCache::shrink() {
+    m_pixmaps.shrink();
+}
+
+const PixmapCacheStats& TileCache::stats() const {
+    return m_pixmaps.stats();
+}
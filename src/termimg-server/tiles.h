@@ -0,0 +1,116 @@
+#ifndef TERMIMG_TILES_H
+#define TERMIMG_TILES_H
+
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <cstddef>
+
+#include <X11/Xlib.h>
+
+#include "image.h"
+#include "pixmap-cache.h"
+#include "renderer.h"
+#include "viewport.h"
+
+
+// Output pixels along each side of a tile, give or take one from rounding
+constexpr int tile_size = 256;
+
+struct TileKey {
+    ImageKey source;
+    double scale;
+    int column;
+    int row;
+
+    auto operator<=>(const TileKey&) const = default;
+};
+
+struct Tile {
+    int column;
+    int row;
+    // The source pixels it is scaled from
+    int src_x;
+    int src_y;
+    int src_width;
+    int src_height;
+    // Where it is in the scaled image
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+// An image scaled by scale, cut into tiles on whole source pixels. Every tile scales on its own,
+// and neighbours still meet without gaps or overlaps, whatever the scale.
+class TileGrid {
+private:
+    const int m_image_width;
+    const int m_image_height;
+    const double m_scale;
+    const int m_source_tile_size;
+
+    // The tiles along one axis that cover the output pixels from start up to end
+    [[nodiscard]] std::pair<int, int> span(int start, int end, int image_size) const;
+
+public:
+    TileGrid(int image_width, int image_height, double scale);
+
+    // Where a source position ends up in the scaled image
+    [[nodiscard]] int to_output(int source) const;
+    [[nodiscard]] int width() const;
+    [[nodiscard]] int height() const;
+    // The tiles covering width x height output pixels at x, y
+    [[nodiscard]] std::vector<Tile> cover(int x, int y, int width, int height) const;
+};
+
+// The visible part of a viewport as tiles. The tiles that were not cached when it was laid out
+// are scaled already, the decoded image is kept to scale those evicted since.
+struct TiledView {
+    ImageKey source;
+    double scale;
+    // Where the visible part is in the scaled image
+    int x;
+    int y;
+    int width;
+    int height;
+    std::vector<Tile> tiles;
+    // Along tiles, nullptr where the tile was cached
+    std::vector<std::shared_ptr<Image>> scaled_tiles;
+    std::shared_ptr<Image> image;
+};
+
+// Only the visible_width x visible_height at the top left of the viewport are laid out. Nullopt when
+// it is magnified so much that a single source pixel is larger than a tile.
+std::optional<TiledView> make_tiled_view(const ImageKey &source, const ViewportRect &rect, int image_width, int image_height, int visible_width, int visible_height);
+
+// Scaled tiles as server side pixmaps. Panning within a zoomed image only scales and uploads the
+// tiles coming into view, the visible part is put together from the others on the X server.
+class TileCache {
+private:
+    const std::shared_ptr<Display> m_display;
+    const int m_screen;
+    const GC m_gc;
+    BasicPixmapCache<TileKey> m_pixmaps;
+
+    CachedPixmap upload(const Image &tile_image, Renderer &renderer);
+
+public:
+    TileCache(std::shared_ptr<Display> display, int screen, size_t budget_bytes);
+    TileCache(const TileCache&) = delete;
+    ~TileCache();
+
+    // Does not count as a use of the tile
+    [[nodiscard]] bool contains(const TileKey &key) const;
+    // Returns a new pixmap of the visible part of view, or nullopt when a tile could not be scaled.
+    // Its tiles that are not cached are uploaded with renderer and cached.
+    std::optional<CachedPixmap> compose(const TiledView &view, Renderer &renderer);
+    void shrink();
+
+    [[nodiscard]] const PixmapCacheStats& stats() const;
+};
+
+
+#endif //TERMIMG_TILES_H
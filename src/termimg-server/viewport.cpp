@@ -0,0 +1,112 @@
+#include "viewport.h"
+
+#include <algorithm>
+#include <utility>
+
+#include <cmath>
+#include <cstdint>
+
+
+constexpr uint32_t min_zoom_permille = 100;
+constexpr uint32_t max_zoom_permille = 100 * 1000;
+
+bool Viewport::is_default() const {
+    return mode == ViewportMode::Fit && zoom_permille == 1000 && offset_x == 0 && offset_y == 0;
+}
+
+std::shared_ptr<Image> ViewportSource::find(const ImageKey &key) const {
+    std::lock_guard lock(m_mutex);
+    return m_key == key ? m_image.lock() : nullptr;
+}
+
+std::shared_ptr<Image> ViewportSource::get(const ImageCache &image_cache, const ImageKey &key, const std::function<std::shared_ptr<Image>()> &decode) {
+    std::lock_guard decode_lock(m_decode_mutex);
+    auto image = peek(image_cache, key);
+    if (image) {
+        return image;
+    }
+
+    image = decode();
+    if (!image) {
+        return nullptr;
+    }
+
+    std::lock_guard lock(m_mutex);
+    m_key = key;
+    m_image = image;
+    return image;
+}
+
+std::shared_ptr<Image> ViewportSource::peek(const ImageCache &image_cache, const ImageKey &key) const {
+    auto image = find(key);
+    return image ? image : image_cache.peek(key.original());
+}
+
+void apply_viewport_request(Viewport &viewport, const ViewportPayload &request, int pan_x, int pan_y) {
+    const auto mode = static_cast<ViewportMode>(request.mode);
+    if (mode != ViewportMode::Keep) {
+        viewport = Viewport{mode};
+    }
+
+    if (request.zoom_permille != 0) {
+        const auto zoom_permille = std::clamp(request.zoom_permille, min_zoom_permille, max_zoom_permille);
+        // Keeps the same part of the image in the middle
+        const double ratio = static_cast<double>(zoom_permille) / static_cast<double>(viewport.zoom_permille);
+        viewport.offset_x *= ratio;
+        viewport.offset_y *= ratio;
+        viewport.zoom_permille = zoom_permille;
+    }
+
+    viewport.offset_x += pan_x;
+    viewport.offset_y += pan_y;
+}
+
+// Rounded and clamped before the conversion, which would overflow for huge zooms
+static int to_size(double size, int max_size) {
+    return static_cast<int>(std::lround(std::clamp(size, 1.0, static_cast<double>(max_size))));
+}
+
+// The offset along one axis is clamped and turned into where the visible span starts in the image
+static int place_span(double &offset, int image_size, int src_size, double scale) {
+    const double max_offset = static_cast<double>(image_size - src_size) / 2.0 * scale;
+    offset = std::clamp(offset, -max_offset, max_offset);
+
+    const double start = static_cast<double>(image_size) / 2.0 + offset / scale - static_cast<double>(src_size) / 2.0;
+    return std::clamp(static_cast<int>(std::lround(start)), 0, image_size - src_size);
+}
+
+ViewportRect layout_viewport(Viewport &viewport, int image_width, int image_height, int max_width, int max_height) {
+    const double width_ratio = static_cast<double>(max_width) / static_cast<double>(image_width);
+    const double height_ratio = static_cast<double>(max_height) / static_cast<double>(image_height);
+
+    // Like fit_size, fit never scales up. An unbounded box has nothing to fill.
+    double base_scale = std::min({1.0, width_ratio, height_ratio});
+    if (viewport.mode == ViewportMode::Fill && max_width != INT32_MAX && max_height != INT32_MAX) {
+        base_scale = std::max(width_ratio, height_ratio);
+    }
+    const double scale = base_scale * static_cast<double>(viewport.zoom_permille) / 1000.0;
+
+    ViewportRect rect{};
+    rect.width = to_size(static_cast<double>(image_width) * scale, max_width);
+    rect.height = to_size(static_cast<double>(image_height) * scale, max_height);
+    rect.src_width = to_size(static_cast<double>(rect.width) / scale, image_width);
+    rect.src_height = to_size(static_cast<double>(rect.height) / scale, image_height);
+    rect.src_x = place_span(viewport.offset_x, image_width, rect.src_width, scale);
+    rect.src_y = place_span(viewport.offset_y, image_height, rect.src_height, scale);
+    rect.scale = scale;
+
+    return rect;
+}
+
+ViewportRect clip_viewport(const ViewportRect &rect, int max_width, int max_height) {
+    auto clipped = rect;
+    if (rect.width > max_width) {
+        clipped.width = max_width;
+        clipped.src_width = to_size(static_cast<double>(max_width) / rect.scale, rect.src_width);
+    }
+    if (rect.height > max_height) {
+        clipped.height = max_height;
+        clipped.src_height = to_size(static_cast<double>(max_height) / rect.scale, rect.src_height);
+    }
+    return clipped;
+}
@@ -0,0 +1,70 @@
+#ifndef TERMIMG_VIEWPORT_H
+#define TERMIMG_VIEWPORT_H
+
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <functional>
+
+#include <cstdint>
+
+#include "image.h"
+#include "image-cache.h"
+#include "protocol.h"
+
+
+struct Viewport {
+    // Never Keep
+    ViewportMode mode = ViewportMode::Fit;
+    uint32_t zoom_permille = 1000;
+    // Where the middle of the visible area is, relative to the middle of the image, in output pixels.
+    // Output pixels, so panning needs no image size and zooming scales them along.
+    double offset_x = 0;
+    double offset_y = 0;
+
+    [[nodiscard]] bool is_default() const;
+};
+
+// The part of the image that is visible and the size it is scaled to
+struct ViewportRect {
+    int src_x;
+    int src_y;
+    int src_width;
+    int src_height;
+    int width;
+    int height;
+    // Output pixels per source pixel
+    double scale;
+};
+
+// Finds the decoded full size image of a placement's viewport. The image lives in the image cache
+// under the key of the original, so it counts against its budget and is shared with other
+// placements. Decodes are serialized, so a burst of zooms decodes once even when the first of them
+// is superseded. Only a weak reference is kept here, which finds an image too large for the cache
+// for as long as a worker still uses it.
+class ViewportSource {
+private:
+    // Held for a whole decode, the reference itself is only guarded by m_mutex
+    std::mutex m_decode_mutex;
+    mutable std::mutex m_mutex;
+    std::optional<ImageKey> m_key;
+    std::weak_ptr<Image> m_image;
+
+    [[nodiscard]] std::shared_ptr<Image> find(const ImageKey &key) const;
+
+public:
+    // Decodes with decode, which is expected to cache the image, unless the image of key is found
+    std::shared_ptr<Image> get(const ImageCache &image_cache, const ImageKey &key, const std::function<std::shared_ptr<Image>()> &decode);
+    // Never waits for a decode, nullptr unless the image of key is found
+    [[nodiscard]] std::shared_ptr<Image> peek(const ImageCache &image_cache, const ImageKey &key) const;
+};
+
+// Pans are given in pixels, so cells have to be converted by the caller
+void apply_viewport_request(Viewport &viewport, const ViewportPayload &request, int pan_x, int pan_y);
+// Clamps the offsets so the visible area stays within the image
+ViewportRect layout_viewport(Viewport &viewport, int image_width, int image_height, int max_width, int max_height);
+// Only the top left max_width x max_height of the output, the scale stays within half a source pixel
+ViewportRect clip_viewport(const ViewportRect &rect, int max_width, int max_height);
+
+
+#endif //TERMIMG_VIEWPORT_H
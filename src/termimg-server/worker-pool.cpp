@@ -0,0 +1,111 @@
+#include "worker-pool.h"
+
+#include <utility>
+
+#include <cstdint>
+#include <cstdio>
+
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+
+
+WorkerPool::WorkerPool(Epoll &epoll, size_t thread_count) : m_epoll(epoll), m_fd_event(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+    if (m_fd_event == -1) {
+        perror("eventfd");
+        throw 1;
+    }
+
+    m_epoll.register_fd(m_fd_event, [this]() {
+        run_completions();
+    });
+
+    TERMIMG_LOG(Info) << "Starting " << thread_count << " workers";
+    for (size_t i = 0; i < thread_count; ++i) {
+        m_threads.emplace_back([this]() {
+            work();
+        });
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard lock(m_mutex);
+        m_stopping = true;
+        m_jobs.clear();
+        m_low_priority_jobs.clear();
+    }
+    m_condition.notify_all();
+
+    for (auto &thread : m_threads) {
+        thread.join();
+    }
+
+    m_epoll.unregister_fd(m_fd_event);
+    close(m_fd_event);
+}
+
+void WorkerPool::submit(Job job, Priority priority) {
+    {
+        std::lock_guard lock(m_mutex);
+        auto &jobs = priority == Priority::Normal ? m_jobs : m_low_priority_jobs;
+        jobs.push_back(std::move(job));
+    }
+    m_condition.notify_one();
+}
+
+bool WorkerPool::has_waiting_jobs() {
+    std::lock_guard lock(m_mutex);
+    return !m_jobs.empty();
+}
+
+void WorkerPool::work() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock lock(m_mutex);
+            m_condition.wait(lock, [this]() { return m_stopping || !m_jobs.empty() || !m_low_priority_jobs.empty(); });
+            if (m_stopping) {
+                return;
+            }
+
+            auto &jobs = !m_jobs.empty() ? m_jobs : m_low_priority_jobs;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        auto completion = job();
+        if (!completion) {
+            continue;
+        }
+
+        {
+            std::lock_guard lock(m_mutex);
+            m_completions.push_back(std::move(completion));
+        }
+
+        const uint64_t one = 1;
+        if (write(m_fd_event, &one, sizeof(one)) == -1) {
+            perror("write");
+        }
+    }
+}
+
+void WorkerPool::run_completions() {
+    uint64_t count;
+    if (read(m_fd_event, &count, sizeof(count)) == -1) {
+        perror("read");
+        return;
+    }
+
+    std::vector<Completion> completions;
+    {
+        std::lock_guard lock(m_mutex);
+        completions.swap(m_completions);
+    }
+
+    for (auto &completion : completions) {
+        completion();
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef TERMIMG_WORKER_POOL_H
+#define TERMIMG_WORKER_POOL_H
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include <cstddef>
+
+#include "epoll.h"
+
+
+// Runs jobs on background threads. A job returns a completion which is run on the
+// epoll loop thread, woken through an eventfd, so X11 work never leaves that thread.
+class WorkerPool {
+public:
+    using Completion = std::function<void()>;
+    using Job = std::function<Completion()>;
+
+    // Low priority jobs only run when no normal job is waiting
+    enum class Priority {
+        Normal,
+        Low,
+    };
+
+private:
+    Epoll &m_epoll;
+    const int m_fd_event;
+
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::deque<Job> m_jobs;
+    std::deque<Job> m_low_priority_jobs;
+    std::vector<Completion> m_completions;
+    bool m_stopping = false;
+
+    std::vector<std::thread> m_threads;
+
+    void work();
+    void run_completions();
+
+public:
+    WorkerPool(Epoll &epoll, size_t thread_count);
+    WorkerPool(const WorkerPool&) = delete;
+    ~WorkerPool();
+
+    void submit(Job job, Priority priority = Priority::Normal);
+    // Lets low priority jobs give up their thread when a normal job wants it
+    [[nodiscard]] bool has_waiting_jobs();
+};
+
+
+#endif //TERMIMG_WORKER_POOL_H